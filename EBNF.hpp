@@ -12,9 +12,29 @@
 #include <sstream>      // for std::stringstream
 #include <cassert>      // for assert macro
 #include <cstring>      // for std::strlen, std::strtol, ...
+#include <cstdint>      // for uint32_t
+#include <climits>      // for INT_MAX
+#include <algorithm>    // for std::upper_bound, std::swap
 
 #include "bnf_ast.hpp"  // for bnf_ast::BaseAst, ...
 
+/////////////////////////////////////////////////////////////////////////
+// SIMD support (define EBNF_NO_SIMD to use the scalar code only)
+
+#ifndef EBNF_NO_SIMD
+    #if defined(__AVX2__)
+        #define EBNF_AVX2
+        #define EBNF_SSE2
+        #include <immintrin.h>
+    #elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+        #define EBNF_SSE2
+        #include <emmintrin.h>
+    #endif
+    #if defined(EBNF_SSE2) && defined(_MSC_VER)
+        #include <intrin.h>     // for _BitScanForward
+    #endif
+#endif
+
 /////////////////////////////////////////////////////////////////////////
 
 #if defined(NDEBUG) || 1
@@ -79,12 +99,253 @@ namespace EBNF
         return strchr(" \t\n\r\f\v", ch) && ch;
     }
 
+    /////////////////////////////////////////////////////////////////////////
+    // fast scanning kernels
+    //
+    // They look at 32 (AVX2) or 16 (SSE2) bytes at a time and fall back to
+    // the scalar code for the rest.
+
+#ifdef EBNF_SSE2
+    inline unsigned int bit_scan_forward(unsigned int mask)
+    {
+        assert(mask);
+    #ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return (unsigned int)index;
+    #else
+        return (unsigned int)__builtin_ctz(mask);
+    #endif
+    }
+
+    // the mask of the bytes in " \t\n\r\f\v"
+    inline __m128i simd_space_mask(__m128i x)
+    {
+        // '\t', '\n', '\v', '\f' and '\r' are 9 to 13
+        const __m128i t = _mm_sub_epi8(x, _mm_set1_epi8(9));
+        const __m128i in_range = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t);
+        return _mm_or_si128(in_range, _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')));
+    }
+#endif
+
+    // find ch1 or ch2 in [p, end). returns end if not found.
+    inline const char *simd_find_either(const char *p, const char *end, char ch1, char ch2)
+    {
+#ifdef EBNF_AVX2
+        const __m256i v1 = _mm256_set1_epi8(ch1), v2 = _mm256_set1_epi8(ch2);
+        for (; end - p >= 32; p += 32)
+        {
+            const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+            const __m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(x, v1),
+                                               _mm256_cmpeq_epi8(x, v2));
+            if (unsigned int mask = (unsigned int)_mm256_movemask_epi8(eq))
+                return p + bit_scan_forward(mask);
+        }
+#endif
+#ifdef EBNF_SSE2
+        const __m128i w1 = _mm_set1_epi8(ch1), w2 = _mm_set1_epi8(ch2);
+        for (; end - p >= 16; p += 16)
+        {
+            const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            const __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(x, w1), _mm_cmpeq_epi8(x, w2));
+            if (unsigned int mask = (unsigned int)_mm_movemask_epi8(eq))
+                return p + bit_scan_forward(mask);
+        }
+#endif
+        for (; p < end; ++p)
+        {
+            if (*p == ch1 || *p == ch2)
+                break;
+        }
+        return p;
+    }
+
+    // find ch in [p, end). returns end if not found.
+    inline const char *simd_find_char(const char *p, const char *end, char ch)
+    {
+        return simd_find_either(p, end, ch, ch);
+    }
+
+    // skip the spaces in [p, end). returns the first non-space or end.
+    inline const char *simd_skip_spaces(const char *p, const char *end)
+    {
+        // spaces are mostly short; check the first one in scalar
+        if (p < end && !is_space(*p))
+            return p;
+#ifdef EBNF_SSE2
+        for (; end - p >= 16; p += 16)
+        {
+            const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            unsigned int mask = (unsigned int)_mm_movemask_epi8(simd_space_mask(x));
+            mask ^= 0xFFFF;
+            if (mask)
+                return p + bit_scan_forward(mask);
+        }
+#endif
+        for (; p < end; ++p)
+        {
+            if (!is_space(*p))
+                break;
+        }
+        return p;
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    // DFA tables for TokenStream::scan_dfa
+
+    enum DfaCharClass
+    {
+        DCC_OTHER,      // invalid character
+        DCC_SPACE,      // " \t\n\r\f\v"
+        DCC_DIGIT,      // "0123456789"
+        DCC_ALPHA,      // "A-Za-z"
+        DCC_DASH,       // '-'
+        DCC_SQUOTE,     // '\''
+        DCC_DQUOTE,     // '"'
+        DCC_QUEST,      // '?'
+        DCC_LPAREN,     // '('
+        DCC_STAR,       // '*'
+        DCC_RPAREN,     // ')'
+        DCC_SYMBOL,     // "=;|,[]{}"
+        DCC_COUNT
+    };
+
+    // NOTE: The states below DS_COUNT consume the character and go on.
+    //       The others are actions that finish the token.
+    enum DfaState
+    {
+        DS_START,
+        DS_INTEGER,
+        DS_IDENT,
+        DS_SQUOTE_FIRST,
+        DS_SQUOTE,
+        DS_DQUOTE_FIRST,
+        DS_DQUOTE,
+        DS_SPECIAL,
+        DS_LPAREN,
+        DS_COMMENT,
+        DS_COMMENT_STAR,
+        DS_COUNT,
+        DA_INTEGER = DS_COUNT,  // an integer ends before the character
+        DA_IDENT,               // an identifier ends before the character
+        DA_LPAREN,              // '(' that is not a comment
+        DA_STRING,              // a terminal string ends at the character
+        DA_SPECIAL,             // a special sequence ends at the character
+        DA_COMMENT,             // a comment ends at the character
+        DA_SYMBOL,              // the character is a symbol
+        DA_EMPTY_STRING,        // an empty terminal string
+        DA_INVALID              // an invalid character
+    };
+
+    struct DfaTables
+    {
+        unsigned char m_class[256];                 // DfaCharClass
+        unsigned char m_next[DS_COUNT][DCC_COUNT];  // DfaState
+        char          m_skip_to[DS_COUNT];  // the state may skip to this
+
+        constexpr DfaTables() : m_class(), m_next(), m_skip_to()
+        {
+            // the states that only wait for one character
+            m_skip_to[DS_SQUOTE] = '\'';
+            m_skip_to[DS_DQUOTE] = '"';
+            m_skip_to[DS_SPECIAL] = '?';
+            m_skip_to[DS_COMMENT] = '*';
+
+            for (int ch = 0; ch < 256; ++ch)
+            {
+                DfaCharClass cc = DCC_OTHER;
+                if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' ||
+                    ch == '\f' || ch == '\v')
+                    cc = DCC_SPACE;
+                else if ('0' <= ch && ch <= '9')
+                    cc = DCC_DIGIT;
+                else if (('A' <= ch && ch <= 'Z') || ('a' <= ch && ch <= 'z'))
+                    cc = DCC_ALPHA;
+                else if (ch == '-')
+                    cc = DCC_DASH;
+                else if (ch == '\'')
+                    cc = DCC_SQUOTE;
+                else if (ch == '"')
+                    cc = DCC_DQUOTE;
+                else if (ch == '?')
+                    cc = DCC_QUEST;
+                else if (ch == '(')
+                    cc = DCC_LPAREN;
+                else if (ch == '*')
+                    cc = DCC_STAR;
+                else if (ch == ')')
+                    cc = DCC_RPAREN;
+                else if (ch == '=' || ch == ';' || ch == '|' || ch == ',' ||
+                         ch == '[' || ch == ']' || ch == '{' || ch == '}')
+                    cc = DCC_SYMBOL;
+                m_class[ch] = (unsigned char)cc;
+            }
+
+            for (int cc = 0; cc < DCC_COUNT; ++cc)
+            {
+                unsigned char start = DA_INVALID;
+                switch (cc)
+                {
+                case DCC_SPACE:     start = DS_START; break;
+                case DCC_DIGIT:     start = DS_INTEGER; break;
+                case DCC_ALPHA:     start = DS_IDENT; break;
+                case DCC_SQUOTE:    start = DS_SQUOTE_FIRST; break;
+                case DCC_DQUOTE:    start = DS_DQUOTE_FIRST; break;
+                case DCC_QUEST:     start = DS_SPECIAL; break;
+                case DCC_LPAREN:    start = DS_LPAREN; break;
+                case DCC_DASH:
+                case DCC_STAR:
+                case DCC_RPAREN:
+                case DCC_SYMBOL:    start = DA_SYMBOL; break;
+                default:            break;
+                }
+                m_next[DS_START][cc] = start;
+
+                m_next[DS_INTEGER][cc] = (cc == DCC_DIGIT ? DS_INTEGER : DA_INTEGER);
+
+                bool word = (cc == DCC_ALPHA || cc == DCC_DIGIT || cc == DCC_DASH);
+                m_next[DS_IDENT][cc] = (word ? DS_IDENT : DA_IDENT);
+
+                // NOTE: '' and "" are invalid in ISO EBNF only, as in
+                //       skip_terminal_string().
+#ifdef ISO_EBNF
+                const DfaState empty = DA_EMPTY_STRING;
+#else
+                const DfaState empty = DA_STRING;
+#endif
+                m_next[DS_SQUOTE_FIRST][cc] = (cc == DCC_SQUOTE ? empty : DS_SQUOTE);
+                m_next[DS_SQUOTE][cc] = (cc == DCC_SQUOTE ? DA_STRING : DS_SQUOTE);
+                m_next[DS_DQUOTE_FIRST][cc] = (cc == DCC_DQUOTE ? empty : DS_DQUOTE);
+                m_next[DS_DQUOTE][cc] = (cc == DCC_DQUOTE ? DA_STRING : DS_DQUOTE);
+
+                m_next[DS_SPECIAL][cc] = (cc == DCC_QUEST ? DA_SPECIAL : DS_SPECIAL);
+
+                m_next[DS_LPAREN][cc] = (cc == DCC_STAR ? DS_COMMENT : DA_LPAREN);
+
+                m_next[DS_COMMENT][cc] = (cc == DCC_STAR ? DS_COMMENT_STAR : DS_COMMENT);
+                if (cc == DCC_STAR)
+                    m_next[DS_COMMENT_STAR][cc] = DS_COMMENT_STAR;
+                else if (cc == DCC_RPAREN)
+                    m_next[DS_COMMENT_STAR][cc] = DA_COMMENT;
+                else
+                    m_next[DS_COMMENT_STAR][cc] = DS_COMMENT;
+            }
+        }
+    };
+
+    inline const DfaTables& dfa_tables()
+    {
+        static constexpr DfaTables s_tables;
+        return s_tables;
+    }
+
     /////////////////////////////////////////////////////////////////////////
     // AuxItem and AuxInfo
 
     struct AuxItem
     {
         size_t      m_line;
+        size_t      m_column;   // 1-based, or zero if unknown
         string_type m_text;
     };
 
@@ -93,17 +354,19 @@ namespace EBNF
         std::vector<AuxItem>    m_errors;
         std::vector<AuxItem>    m_warnings;
 
-        void add_error(const string_type& msg, size_t line)
+        void add_error(const string_type& msg, size_t line, size_t column = 0)
         {
             AuxItem item;
             item.m_line = line;
+            item.m_column = column;
             item.m_text = msg;
             m_errors.push_back(item);
         }
-        void add_warning(const string_type& msg, size_t line)
+        void add_warning(const string_type& msg, size_t line, size_t column = 0)
         {
             AuxItem item;
             item.m_line = line;
+            item.m_column = column;
             item.m_text = msg;
             m_warnings.push_back(item);
         }
@@ -137,49 +400,280 @@ namespace EBNF
     // TOK_COMMENT: "(*" ... "*)"
     // TOK_SPECIAL: "?" ... "?"
 
+    // the symbol code of TOK_SYMBOL (the value is the character)
+    enum SymbolType
+    {
+        SYM_NONE = 0,               // not a symbol
+        SYM_DEFINING = '=',         // defining symbol
+        SYM_TERMINATOR = ';',       // terminator symbol
+        SYM_SEPARATOR = '|',        // definition separator symbol
+        SYM_CONCATENATE = ',',      // concatenate symbol
+        SYM_EXCEPT = '-',           // except symbol
+        SYM_REPETITION = '*',       // repetition symbol
+        SYM_START_OPTION = '[',     // start option symbol
+        SYM_END_OPTION = ']',       // end option symbol
+        SYM_START_REPEAT = '{',     // start repeat symbol
+        SYM_END_REPEAT = '}',       // end repeat symbol
+        SYM_START_GROUP = '(',      // start group symbol
+        SYM_END_GROUP = ')'         // end group symbol
+    };
+
+    // NOTE: A token either owns its text in m_str (m_text is NULL), or
+    //       refers to m_len characters at m_text in the scanner buffer.
     class Token
     {
     public:
         string_type m_str;
         TokenType   m_type;
+        SymbolType  m_symbol;   // SYM_NONE unless TOK_SYMBOL
         int         m_integer;
         size_t      m_line;
-
-        Token(string_type str, TokenType type, size_t line = 0)
-            : m_str(str), m_type(type), m_line(line)
+        size_t      m_begin;    // offset of the first character
+        size_t      m_end;      // offset next to the last character
+        const char *m_text;     // view to the scanner buffer, or NULL
+        size_t      m_len;      // length of the view
+        atom_type   m_atom;     // ATOM_NONE until TokenStream::atom()
+
+        Token(string_type str, TokenType type, size_t line = 0,
+              size_t begin = 0, size_t end = 0)
+            : m_str(str), m_type(type), m_symbol(SYM_NONE), m_integer(0),
+              m_line(line), m_begin(begin), m_end(end), m_text(NULL), m_len(0),
+              m_atom(ATOM_NONE)
+        {
+            if (type == TOK_INTEGER)
+            {
+                m_integer = integer_of(str.c_str(), str.size());
+            }
+            else if (type == TOK_SYMBOL && str.size() == 1)
+            {
+                m_symbol = SymbolType(str[0]);
+            }
+        }
+        Token(const char *text, size_t len, TokenType type, size_t line,
+              size_t begin, size_t end)
+            : m_type(type), m_symbol(SYM_NONE), m_integer(0), m_line(line),
+              m_begin(begin), m_end(end), m_text(text), m_len(len),
+              m_atom(ATOM_NONE)
         {
             if (type == TOK_INTEGER)
             {
-                m_integer = (int)std::strtol(str.c_str(), NULL, 10);
+                m_integer = integer_of(text, len);
+            }
+            else if (type == TOK_SYMBOL && len == 1)
+            {
+                m_symbol = SymbolType(text[0]);
+            }
+        }
+
+        // the value of the digits, saturated at INT_MAX
+        static int integer_of(const char *text, size_t len)
+        {
+            int integer = 0;
+            for (size_t i = 0; i < len; ++i)
+            {
+                const int digit = text[i] - '0';
+                if (integer > (INT_MAX - digit) / 10)
+                    return INT_MAX;
+                integer = integer * 10 + digit;
+            }
+            return integer;
+        }
+
+        const char *data() const
+        {
+            return m_text ? m_text : m_str.c_str();
+        }
+        size_t size() const
+        {
+            return m_text ? m_len : m_str.size();
+        }
+        string_type str() const
+        {
+            if (m_text)
+                return string_type(m_text, m_len);
+            return m_str;
+        }
+        bool is_view() const
+        {
+            return m_text != NULL;
+        }
+        void materialize()
+        {
+            if (m_text)
+            {
+                m_str.assign(m_text, m_len);
+                m_text = NULL;
+                m_len = 0;
             }
         }
+
         void to_dbg(os_type& os) const
         {
-            os << "[TOKEN: " << m_type << ", '" << m_str << "']";
+            os << "[TOKEN: " << m_type << ", '";
+            os.write(data(), size());
+            os << "']";
         }
     };
     typedef std::vector<Token> tokens_type;
 
+    /////////////////////////////////////////////////////////////////////////
+    // TokenBuffer --- the compact token storage (structure of arrays)
+
+    // NOTE: A token takes 14 bytes here. The text of a token is found in the
+    //       scanner buffer from its offsets, except for the joined words,
+    //       whose texts are kept in a side table as the integers are.
+    class TokenBuffer
+    {
+    public:
+        size_t size() const
+        {
+            return m_kinds.size();
+        }
+        void clear();
+        void reserve(size_t count);
+        void resize(size_t count);
+
+        // data is the scanner buffer. The text out of it is copied.
+        void push_back(TokenType type, size_t begin, size_t end,
+                       const char *text, size_t len, const char *data);
+
+        TokenType type(size_t i) const
+        {
+            return TokenType(m_kinds[i] & ~OWNED);
+        }
+        SymbolType symbol(size_t i) const
+        {
+            return SymbolType(m_symbols[i]);
+        }
+        size_t begin(size_t i) const
+        {
+            return m_begins[i];
+        }
+        size_t end(size_t i) const
+        {
+            return m_ends[i];
+        }
+        int integer(size_t i) const
+        {
+            if (type(i) == TOK_INTEGER)
+                return m_integers[m_extra[i]];
+            return 0;
+        }
+        bool is_owned(size_t i) const
+        {
+            return (m_kinds[i] & OWNED) != 0;
+        }
+        const char *text(size_t i, const char *data, size_t& len) const;
+
+        // the atom kept by TokenStream::atom(), or ATOM_NONE
+        atom_type atom(size_t i) const
+        {
+            if (i < m_atoms.size() && m_atoms[i] != NO_ATOM)
+                return m_atoms[i];
+            return ATOM_NONE;
+        }
+        void atom(size_t i, atom_type value);
+
+        // join_word() appends the word i to the word k.
+        void join_word(size_t k, size_t i, const char *data);
+        // move() overwrites the token k by the token i.
+        void move(size_t k, size_t i);
+
+        // the bytes in use
+        size_t memory() const;
+
+    protected:
+        enum { OWNED = 0x80 };
+        static const uint32_t NO_ATOM = 0xFFFFFFFF;
+        std::vector<unsigned char>  m_kinds;    // TokenType and OWNED flag
+        std::vector<unsigned char>  m_symbols;  // SymbolType
+        std::vector<uint32_t>       m_begins;
+        std::vector<uint32_t>       m_ends;
+        std::vector<uint32_t>       m_extra;    // index to the side table
+        std::vector<int>            m_integers; // for TOK_INTEGER
+        std::vector<string_type>    m_owned;    // for OWNED
+        std::vector<uint32_t>       m_atoms;    // made on the first atom()
+
+        static size_t text_margin(TokenType type)
+        {
+            switch (type)
+            {
+            case TOK_STRING:
+            case TOK_SPECIAL:
+                return 1;
+            case TOK_COMMENT:
+                return 2;
+            default:
+                return 0;
+            }
+        }
+    };
+
     /////////////////////////////////////////////////////////////////////////
     // StringScanner
 
+    // where a scanner of a part of the buffer starts
+    struct ScanOrigin
+    {
+        size_t  m_begin;    // the offset to scan from
+        size_t  m_head;     // the offset of the head of the line of m_begin
+        size_t  m_line;     // the line number of m_begin
+    };
+
     class StringScanner
     {
     public:
-        StringScanner(const string_type& str) : m_str(str), m_index(0)
+        // NOTE: This constructor copies the string.
+        StringScanner(const string_type& str)
+            : m_str(str), m_data(m_str.c_str()), m_size(m_str.size()), m_index(0),
+              m_line_base(0)
+        {
+            build_line_index(0);
+        }
+        // NOTE: This constructor doesn't copy the buffer. The buffer must
+        //       outlive the scanner. It doesn't have to be NUL-terminated.
+        StringScanner(const char *data, size_t size)
+            : m_data(data), m_size(size), m_index(0), m_line_base(0)
+        {
+            build_line_index(0);
+        }
+        // NOTE: This constructor scans data[origin.m_begin, size) only. The
+        //       offsets, lines and columns are still of the whole buffer.
+        StringScanner(const char *data, size_t size, const ScanOrigin& origin)
+            : m_data(data), m_size(size), m_index(origin.m_begin),
+              m_line_base(origin.m_line - 1)
+        {
+            assert(origin.m_head <= origin.m_begin && origin.m_begin <= size);
+            assert(origin.m_line >= 1);
+            build_line_index(origin.m_head);
+        }
+        // NOTE: reset() moves the scanner onto another buffer as the
+        //       constructors do, but reuses the memory of the line index
+        //       and of the owned copy.
+        void reset(const string_type& str)
+        {
+            m_str.assign(str);
+            reset(m_str.c_str(), m_str.size());
+        }
+        void reset(const char *data, size_t size)
         {
+            m_data = data;
+            m_size = size;
+            m_index = 0;
+            m_line_base = 0;
+            build_line_index(0);
         }
         char getch()
         {
-            if (m_index < m_str.size())
+            if (m_index < m_size)
             {
-                return m_str[m_index++];
+                return m_data[m_index++];
             }
             return 0;
         }
         void nextch()
         {
-            if (m_index < m_str.size())
+            if (m_index < m_size)
             {
                 ++m_index;
             }
@@ -189,18 +683,39 @@ namespace EBNF
             if (m_index > 0)
                 --m_index;
         }
+        // NOTE: The buffer at peek() is not NUL-terminated. See remaining().
         const char *peek() const
         {
-            return &m_str.c_str()[m_index];
+            return &m_data[m_index];
         }
+        // NOTE: peekch() returns zero at the end of buffer. Use eof() to
+        //       tell it from a NUL character.
         char peekch() const
         {
-            return *peek();
+            if (m_index < m_size)
+                return m_data[m_index];
+            return 0;
+        }
+        bool eof() const
+        {
+            return m_index >= m_size;
+        }
+        size_t remaining() const
+        {
+            return m_size - m_index;
+        }
+        void skip_spaces()
+        {
+            m_index = simd_skip_spaces(m_data + m_index, m_data + m_size) - m_data;
+        }
+        bool match(const char *psz, size_t len) const
+        {
+            return len <= remaining() && memcmp(peek(), psz, len) == 0;
         }
         bool match_get(const char *psz)
         {
             const size_t len = strlen(psz);
-            if (memcmp(peek(), psz, len) == 0)
+            if (match(psz, len))
             {
                 skip(len);
                 return true;
@@ -210,7 +725,7 @@ namespace EBNF
         bool match_get(const char *psz, string_type& str)
         {
             const size_t len = strlen(psz);
-            if (memcmp(peek(), psz, len) == 0)
+            if (match(psz, len))
             {
                 str = psz;
                 skip(len);
@@ -220,7 +735,7 @@ namespace EBNF
         }
         void skip(size_t count)
         {
-            if (m_index + count <= m_str.size())
+            if (m_index + count <= m_size)
                 m_index += count;
         }
         size_t index() const
@@ -232,18 +747,51 @@ namespace EBNF
             m_index = pos;
         }
 
+        const char *data() const
+        {
+            return m_data;
+        }
+        size_t size() const
+        {
+            return m_size;
+        }
+
         bool scan_special(string_type& ret);
         bool scan_comment(string_type& ret);
         bool scan_meta_identifier(string_type& ret);
         bool scan_integer(string_type& ret);
         bool scan_terminal_string(string_type& ret);
 
+        // The skip_* functions are scan_* without building the string.
+        bool skip_special();
+        bool skip_comment();
+        bool skip_meta_identifier();
+        bool skip_integer();
+        bool skip_terminal_string();
+
+        // NOTE: Lines and columns are 1-based.
         size_t index_to_line(size_t index) const;
+        size_t index_to_column(size_t index) const;
         size_t line_to_index(size_t line) const;
 
     protected:
-        string_type     m_str;
+        string_type     m_str;      // the owned copy, if any
+        const char     *m_data;
+        size_t          m_size;
         size_t          m_index;
+        mutable std::vector<size_t> m_line_starts;  // offsets of the line heads
+        mutable size_t  m_line_end;         // the heads before it are found
+        size_t          m_line_base;        // the lines before m_line_starts
+
+        // NOTE: The line heads are found on demand up to the offset asked,
+        //       so a lazy stream reads no further than its tokens.
+        enum { LINE_INDEX_STEP = 4096 };
+        void build_line_index(size_t head);
+        void index_lines(size_t index) const;
+
+    private:
+        StringScanner(const StringScanner&);
+        StringScanner& operator=(const StringScanner&);
     };
 
     /////////////////////////////////////////////////////////////////////////
@@ -253,32 +801,116 @@ namespace EBNF
     {
     public:
         tokens_type             m_tokens;
+        tokens_type             m_comments;     // trivia kept by fixup
 
         TokenStream(StringScanner& scanner, AuxInfo& aux);
+
+        // NOTE: In zero-copy mode, the tokens refer to the scanner buffer
+        //       instead of owning their strings.
+        bool zero_copy() const
+        {
+            return m_zero_copy;
+        }
+        void zero_copy(bool flag)
+        {
+            m_zero_copy = flag;
+        }
+
+        // NOTE: In lazy mode, scan() reads only the first token, and next()
+        //       pulls the following tokens from the scanner on demand with
+        //       the comments deleted and the words joined. Only the last
+        //       LAZY_WINDOW tokens are kept for unget() and operator[].
+        //       A scan error ends the stream with TOK_EOF and sets failed().
+        //       The line heads are found as far as the tokens pulled only.
+        enum { LAZY_WINDOW = 8 };
+        bool lazy() const
+        {
+            return m_lazy;
+        }
+        void lazy(bool flag)
+        {
+            m_lazy = flag;
+            if (flag)
+                m_compact = false;
+        }
+        bool failed() const
+        {
+            return m_failed;
+        }
+
+        // NOTE: In compact mode, the tokens are stored in m_buffer instead of
+        //       m_tokens, so there is no Token to refer to. at() returns a
+        //       copy made on demand, and type(), str(), atom(), token_line(),
+        //       ... read m_buffer. operator[] and token() unpack the tokens
+        //       to m_tokens once, in O(tokens), and turn compact mode off.
+        //       Compact mode excludes lazy mode, and is turned off by scan()
+        //       if the input is larger than 4 GiB.
+        bool compact() const
+        {
+            return m_compact;
+        }
+        void compact(bool flag)
+        {
+            m_compact = flag;
+            if (flag)
+                m_lazy = false;
+        }
+        const TokenBuffer& buffer() const
+        {
+            return m_buffer;
+        }
+
         bool scan();
-        void fixup()
+        // scan_dfa() is a table-driven version of scan() that produces the
+        // same tokens. In lazy mode, the tokens are pulled as scan() does.
+        bool scan_dfa();
+
+        // fixup() deletes the comments and joins the words in one pass.
+        // If keep_comments is true, the comments are moved to m_comments.
+        // In lazy mode, this has been done while pulling.
+        void fixup(bool keep_comments = false)
         {
-            delete_comments();
-            join_words();
+            if (!m_lazy)
+                filter(true, true, keep_comments);
         }
 
-        void delete_comments();
-        void join_words();
+        void delete_comments()
+        {
+            filter(true, false, false);
+        }
+        void join_words()
+        {
+            filter(false, true, false);
+        }
 
               Token& token();
         const Token& token() const;
+        // the copy of the token i, in any mode
+        Token at(size_t i) const;
         void unget(size_t count = 1);
         bool next();
 
         TokenType type() const;
+        SymbolType symbol() const;
         string_type str() const;
         int integer() const;
+        // atom() interns the text of the current token (see AtomTable).
+        atom_type atom();
 
         size_t index() const;
         bool index(size_t pos);
 
         size_t get_line() const;
+        size_t get_column() const;
+        size_t get_column(const Token& t) const;
+        // the line and the column of the current token
+        size_t token_line() const;
+        size_t token_column() const;
         size_t size() const;
+        // the begin offset of the current token
+        size_t offset() const;
+        // the end offset of the token before the current one
+        size_t prev_end() const;
 
         void to_dbg(os_type& os) const;
 
@@ -286,10 +918,18 @@ namespace EBNF
 
         Token& operator[](size_t i)
         {
+            if (m_compact)
+                unpack();
+            if (m_lazy)
+                return lazy_at(i);
             return m_tokens[i];
         }
         const Token& operator[](size_t i) const
         {
+            if (m_compact)
+                const_cast<TokenStream *>(this)->unpack();
+            if (m_lazy)
+                return const_cast<TokenStream *>(this)->lazy_at(i);
             return m_tokens[i];
         }
 
@@ -297,6 +937,42 @@ namespace EBNF
         size_t          m_index;
         StringScanner&  m_scanner;
         AuxInfo&        m_aux;
+        bool            m_zero_copy;
+        bool            m_lazy;
+        bool            m_failed;
+        size_t          m_pulled;       // the number of tokens pulled
+        tokens_type     m_ring;         // the last LAZY_WINDOW tokens
+        tokens_type     m_pending;      // a token read ahead for joining
+        bool            m_compact;
+        TokenBuffer     m_buffer;
+
+        void add_token(TokenType type, size_t line, size_t begin,
+                       size_t text_begin, size_t text_end);
+        bool scan_token();
+        bool pull_raw(Token& t);
+        bool pull(Token& t);
+        void pull_next();
+        Token& lazy_at(size_t i)
+        {
+            assert(i < m_pulled && i + LAZY_WINDOW >= m_pulled);
+            return m_ring[i % LAZY_WINDOW];
+        }
+        void clear_tokens();
+        TokenType last_type() const
+        {
+            if (m_compact)
+                return m_buffer.type(m_buffer.size() - 1);
+            return m_tokens.back().m_type;
+        }
+        Token compact_at(size_t i) const;
+        void unpack();
+        const char *compact_text(size_t i, size_t& len) const
+        {
+            return m_buffer.text(i, m_scanner.data(), len);
+        }
+        void filter(bool del_comments, bool join, bool keep_comments);
+        void compact_filter(bool del_comments, bool join, bool keep_comments);
+        static void join_word(Token& word, const Token& next_word);
 
         char getch()
         {
@@ -321,13 +997,57 @@ namespace EBNF
     class Parser
     {
     public:
+        enum { DEFAULT_MAX_DEPTH = 0 };
+
         Parser(TokenStream& stream, AuxInfo& aux)
-            : m_stream(stream), m_aux(aux), m_ast(NULL), m_line(0)
+            : m_stream(stream), m_aux(aux), m_ast(NULL), m_line(0),
+              m_use_arena(false), m_arena(NULL), m_iterative(false),
+              m_depth(0), m_max_depth(DEFAULT_MAX_DEPTH)
         {
         }
         virtual ~Parser()
         {
-            delete m_ast;
+            release_ast();
+            delete m_arena;
+        }
+
+        // NOTE: In arena mode, the AST nodes are made in an AstArena owned
+        //       by the parser. detach() returns a heap copy of such a tree;
+        //       detach_tree() hands over the tree with its arena instead.
+        bool use_arena() const
+        {
+            return m_use_arena;
+        }
+        void use_arena(bool flag)
+        {
+            m_use_arena = flag;
+        }
+        AstArena *arena() const
+        {
+            return m_arena;
+        }
+
+        // NOTE: In iterative mode, the nested brackets of a rule body are
+        //       parsed with an explicit stack instead of recursion. Either
+        //       way, a bracket nested deeper than max_depth() is an error.
+        //       A max_depth of zero, the default, means no limit. Set one
+        //       to parse untrusted text by recursion, whose depth is bound
+        //       by the stack.
+        bool iterative() const
+        {
+            return m_iterative;
+        }
+        void iterative(bool flag)
+        {
+            m_iterative = flag;
+        }
+        size_t max_depth() const
+        {
+            return m_max_depth;
+        }
+        void max_depth(size_t depth)
+        {
+            m_max_depth = depth;
         }
 
         BaseAst *ast() const
@@ -338,11 +1058,28 @@ namespace EBNF
         BaseAst *detach()
         {
             BaseAst *ast = m_ast;
+            if (ast && ast->m_arena)
+            {
+                ast = ast->clone();
+                release_ast();
+            }
             m_ast = NULL;
             return ast;
         }
+        AstTree detach_tree()
+        {
+            AstTree tree(m_ast, m_arena);
+            m_ast = NULL;
+            m_arena = NULL;
+            return tree;
+        }
 
         bool parse();
+        // NOTE: reset() drops the AST, and keeps the arena for reuse.
+        void reset()
+        {
+            release_ast();
+        }
 
         BaseAst *visit_syntax();
         BaseAst *visit_syntax_rule();
@@ -355,12 +1092,49 @@ namespace EBNF
         BaseAst *visit_optional_sequence();
         BaseAst *visit_repeated_sequence();
         BaseAst *visit_grouped_sequence();
+        BaseAst *visit_definitions_list_iterative();
 
     protected:
-        TokenStream     m_stream;
+        TokenStream&    m_stream;
         AuxInfo&        m_aux;
         BaseAst        *m_ast;
         size_t          m_line;
+        bool            m_use_arena;
+        AstArena       *m_arena;    // owned
+        bool            m_iterative;
+        size_t          m_depth;
+        size_t          m_max_depth;
+
+        // a bracket being parsed by visit_definitions_list_iterative()
+        struct Nest
+        {
+            SymbolType  m_open;         // '[', '{', '(', or '=' for the body
+            size_t      m_first;        // the offset of m_open
+            SeqAst     *m_expr;
+            size_t      m_expr_first;
+            SeqAst     *m_terms;
+            size_t      m_terms_first;
+            size_t      m_term_first;
+            BaseAst    *m_left;         // the factor before '-'
+            IntegerAst *m_times;        // the integer before '*'
+            size_t      m_factor_first;
+        };
+
+        bool nest_in();
+        void nest_out()
+        {
+            assert(m_depth > 0);
+            --m_depth;
+        }
+        void begin_nest(Nest& nest, SymbolType open, size_t first);
+
+        void release_ast()
+        {
+            ast_delete(m_ast);
+            m_ast = NULL;
+            if (m_arena)
+                m_arena->clear();
+        }
 
         size_t index() const
         {
@@ -386,6 +1160,14 @@ namespace EBNF
         {
             return m_stream.type();
         }
+        SymbolType symbol() const
+        {
+            return m_stream.symbol();
+        }
+        bool is_symbol(SymbolType sym) const
+        {
+            return m_stream.symbol() == sym;
+        }
         string_type str() const
         {
             return m_stream.str();
@@ -394,10 +1176,92 @@ namespace EBNF
         {
             return m_stream.integer();
         }
+        atom_type atom() const
+        {
+            return m_stream.atom();
+        }
+        size_t offset() const
+        {
+            return m_stream.offset();
+        }
         size_t get_line() const
         {
-            return m_stream.token().m_line;
+            return m_stream.token_line();
+        }
+        size_t get_column() const
+        {
+            return m_stream.token_column();
+        }
+
+        template <typename T_AST>
+        T_AST *span(T_AST *ast, size_t first) const;
+    };
+
+    /////////////////////////////////////////////////////////////////////////
+
+    // NOTE: ParseContext owns a scanner, a stream and a parser, to parse
+    //       many inputs one by one. reset() keeps the capacity of the token
+    //       and message vectors, the line index and the blocks of the
+    //       arena, so that a batch of small inputs allocates little after
+    //       the first ones. The stream is zero-copy and the parser uses
+    //       the arena by default; see stream() and parser().
+    //       ast() is valid until the next reset() or parse(). Use detach()
+    //       to keep it.
+    class ParseContext
+    {
+    public:
+        ParseContext()
+            : m_scanner(NULL, 0), m_stream(m_scanner, m_aux), m_parser(m_stream, m_aux)
+        {
+            m_stream.zero_copy(true);
+            m_parser.use_arena(true);
+        }
+
+        // NOTE: This doesn't copy the buffer. It must outlive the parse.
+        void reset(const char *data, size_t size);
+        // NOTE: This copies the string.
+        void reset(const string_type& str);
+
+        // scan, fixup and parse
+        bool parse();
+
+        BaseAst *ast() const
+        {
+            return m_parser.ast();
+        }
+        BaseAst *detach()
+        {
+            return m_parser.detach();
         }
+
+        AuxInfo& aux()
+        {
+            return m_aux;
+        }
+        StringScanner& scanner()
+        {
+            return m_scanner;
+        }
+        TokenStream& stream()
+        {
+            return m_stream;
+        }
+        Parser& parser()
+        {
+            return m_parser;
+        }
+
+    protected:
+        AuxInfo         m_aux;
+        StringScanner   m_scanner;
+        TokenStream     m_stream;
+        Parser          m_parser;
+
+        void clear();
+
+    private:
+        ParseContext(const ParseContext&);
+        ParseContext& operator=(const ParseContext&);
     };
 
     /////////////////////////////////////////////////////////////////////////
@@ -408,12 +1272,18 @@ namespace EBNF
         for (size_t i = 0; i < m_errors.size(); ++i)
         {
             const AuxItem& item = m_errors[i];
-            os << "ERROR: " << item.m_text << ", at line " << item.m_line << std::endl;
+            os << "ERROR: " << item.m_text << ", at line " << item.m_line;
+            if (item.m_column)
+                os << ", column " << item.m_column;
+            os << std::endl;
         }
         for (size_t i = 0; i < m_warnings.size(); ++i)
         {
             const AuxItem& item = m_warnings[i];
-            os << "WARNING: " << item.m_text << ", at line " << item.m_line << std::endl;
+            os << "WARNING: " << item.m_text << ", at line " << item.m_line;
+            if (item.m_column)
+                os << ", column " << item.m_column;
+            os << std::endl;
         }
     }
 
@@ -422,29 +1292,39 @@ namespace EBNF
 
     inline void TokenStream::to_dbg(os_type& os) const
     {
-        if (m_tokens.size())
+        // a lazy stream shows its window only
+        size_t i = 0;
+        if (m_lazy && m_pulled > LAZY_WINDOW)
+            i = m_pulled - LAZY_WINDOW;
+
+        if (i < size())
         {
-            m_tokens[0].to_dbg(os);
-            for (size_t i = 1; i < m_tokens.size(); ++i)
+            at(i).to_dbg(os);
+            for (++i; i < size(); ++i)
             {
                 os << ", ";
-                m_tokens[i].to_dbg(os);
+                at(i).to_dbg(os);
             }
         }
         os << "\n";
     }
 
     inline TokenStream::TokenStream(StringScanner& scanner, AuxInfo& aux)
-        : m_index(0), m_scanner(scanner), m_aux(aux)
+        : m_index(0), m_scanner(scanner), m_aux(aux), m_zero_copy(false),
+          m_lazy(false), m_failed(false), m_pulled(0), m_compact(false)
     {
     }
 
     inline void TokenStream::unget(size_t count/* = 1*/)
     {
-        if (count <= m_index)
+        size_t lowest = 0;
+        if (m_lazy && m_pulled > LAZY_WINDOW)
+            lowest = m_pulled - LAZY_WINDOW;
+
+        if (count <= m_index - lowest)
             m_index -= count;
         else
-            m_index = 0;
+            m_index = lowest;
     }
 
     inline bool TokenStream::next()
@@ -454,41 +1334,134 @@ namespace EBNF
             ++m_index;
             return true;
         }
+        if (m_lazy && m_pulled && lazy_at(m_index).m_type != TOK_EOF)
+        {
+            pull_next();
+            ++m_index;
+            return true;
+        }
         return false;
     }
 
     inline void TokenStream::push_back(const Token& t)
     {
+        if (m_compact)
+        {
+            m_buffer.push_back(t.m_type, t.m_begin, t.m_end, t.data(), t.size(),
+                               m_scanner.data());
+            return;
+        }
         m_tokens.push_back(t);
     }
 
+    inline Token TokenStream::compact_at(size_t i) const
+    {
+        assert(i < m_buffer.size());
+        size_t len;
+        const char *text = compact_text(i, len);
+        const size_t begin = m_buffer.begin(i);
+        Token t(text, len, m_buffer.type(i), m_scanner.index_to_line(begin),
+                begin, m_buffer.end(i));
+        if (!m_zero_copy || m_buffer.is_owned(i))
+            t.materialize();
+        t.m_atom = m_buffer.atom(i);
+        return t;
+    }
+
+    // unpack() leaves compact mode with the same tokens in m_tokens.
+    inline void TokenStream::unpack()
+    {
+        tokens_type tokens;
+        tokens.reserve(m_buffer.size());
+        for (size_t i = 0; i < m_buffer.size(); ++i)
+        {
+            tokens.push_back(compact_at(i));
+        }
+        m_tokens.swap(tokens);
+        m_buffer.clear();
+        m_compact = false;
+    }
+
     inline Token& TokenStream::token()
     {
         assert(m_index <= size());
-        return m_tokens[m_index];
+        return (*this)[m_index];
     }
 
     inline const Token& TokenStream::token() const
     {
         assert(m_index <= size());
-        return m_tokens[m_index];
+        return (*this)[m_index];
+    }
+
+    inline Token TokenStream::at(size_t i) const
+    {
+        if (m_compact)
+            return compact_at(i);
+        return (*this)[i];
     }
 
     inline TokenType TokenStream::type() const
     {
+        if (m_compact)
+            return m_buffer.type(m_index);
         return token().m_type;
     }
 
+    inline SymbolType TokenStream::symbol() const
+    {
+        if (m_compact)
+            return m_buffer.symbol(m_index);
+        return token().m_symbol;
+    }
+
     inline string_type TokenStream::str() const
     {
-        return token().m_str;
+        if (m_compact)
+        {
+            size_t len;
+            const char *text = compact_text(m_index, len);
+            return string_type(text, len);
+        }
+        return token().str();
     }
 
     inline int TokenStream::integer() const
     {
+        if (m_compact)
+            return m_buffer.integer(m_index);
         return token().m_integer;
     }
 
+    inline atom_type TokenStream::atom()
+    {
+        if (m_compact)
+        {
+            atom_type atom = m_buffer.atom(m_index);
+            if (atom == ATOM_NONE)
+            {
+                size_t len;
+                const char *text = compact_text(m_index, len);
+                if (m_buffer.type(m_index) == TOK_IDENT)
+                    atom = atom_table().intern_name(text, len);
+                else
+                    atom = atom_table().intern(text, len);
+                m_buffer.atom(m_index, atom);
+            }
+            return atom;
+        }
+
+        Token& t = token();
+        if (t.m_atom == ATOM_NONE)
+        {
+            if (t.m_type == TOK_IDENT)
+                t.m_atom = atom_table().intern_name(t.data(), t.size());
+            else
+                t.m_atom = atom_table().intern(t.data(), t.size());
+        }
+        return t.m_atom;
+    }
+
     inline size_t TokenStream::index() const
     {
         return m_index;
@@ -496,11 +1469,40 @@ namespace EBNF
 
     inline size_t TokenStream::size() const
     {
+        if (m_lazy)
+            return m_pulled;
+        if (m_compact)
+            return m_buffer.size();
         return m_tokens.size();
     }
 
+    inline size_t TokenStream::offset() const
+    {
+        if (m_compact)
+            return m_buffer.begin(m_index);
+        return token().m_begin;
+    }
+
+    inline size_t TokenStream::prev_end() const
+    {
+        if (m_index == 0)
+            return 0;
+        if (m_compact)
+            return m_buffer.end(m_index - 1);
+        return (*this)[m_index - 1].m_end;
+    }
+
     inline bool TokenStream::index(size_t pos)
     {
+        if (m_lazy)
+        {
+            if (pos < m_pulled && pos + LAZY_WINDOW >= m_pulled)
+            {
+                m_index = pos;
+                return true;
+            }
+            return false;
+        }
         if (pos <= size())
         {
             m_index = pos;
@@ -509,341 +1511,812 @@ namespace EBNF
         return false;
     }
 
-    size_t TokenStream::get_line() const
+    inline size_t TokenStream::get_line() const
     {
         return m_scanner.index_to_line(m_scanner.index());
     }
 
-    inline bool TokenStream::scan()
+    inline size_t TokenStream::get_column() const
+    {
+        return m_scanner.index_to_column(m_scanner.index());
+    }
+
+    inline size_t TokenStream::get_column(const Token& t) const
+    {
+        return m_scanner.index_to_column(t.m_begin);
+    }
+
+    inline size_t TokenStream::token_line() const
+    {
+        if (m_compact)
+            return m_scanner.index_to_line(m_buffer.begin(m_index));
+        return token().m_line;
+    }
+
+    inline size_t TokenStream::token_column() const
+    {
+        return m_scanner.index_to_column(offset());
+    }
+
+    inline void
+    TokenStream::add_token(TokenType type, size_t line, size_t begin,
+                           size_t text_begin, size_t text_end)
+    {
+        if (m_compact)
+        {
+            m_buffer.push_back(type, begin, m_scanner.index(),
+                               m_scanner.data() + text_begin,
+                               text_end - text_begin, m_scanner.data());
+            return;
+        }
+
+        Token token(m_scanner.data() + text_begin, text_end - text_begin,
+                    type, line, begin, m_scanner.index());
+        if (!m_zero_copy)
+            token.materialize();
+        m_tokens.push_back(token);
+    }
+
+    inline void TokenStream::clear_tokens()
     {
         m_tokens.clear();
+        m_buffer.clear();
+        if (m_compact && m_scanner.size() > UINT32_MAX)
+            m_compact = false;
+    }
 
-        char ch;
-        string_type str;
+    inline bool TokenStream::scan()
+    {
+        clear_tokens();
+        m_index = 0;
 
-        for (;;)
+        if (m_lazy)
         {
-            for (;;)
+            m_pulled = 0;
+            m_failed = false;
+            m_pending.clear();
+            m_ring.assign(LAZY_WINDOW, Token("", TOK_EOF));
+            pull_next();
+            return !m_failed && m_aux.m_errors.empty();
+        }
+
+        while (scan_token())
+        {
+            if (last_type() == TOK_EOF)
+                break;
+        }
+
+        return m_aux.m_errors.empty();
+    }
+
+    // scan_token() reads one token into m_tokens.
+    inline bool TokenStream::scan_token()
+    {
+        m_scanner.skip_spaces();
+        char ch = peekch();
+
+        const size_t begin = m_scanner.index();
+        const size_t line = get_line();
+
+        if (m_scanner.eof())
+        {
+            // end of file
+            add_token(TOK_EOF, line, begin, begin, begin);
+            return true;
+        }
+
+        if (is_digit(ch))
+        {
+            // integer
+            m_scanner.skip_integer();
+            add_token(TOK_INTEGER, line, begin, begin, m_scanner.index());
+            return true;
+        }
+
+        if (ch == '"' || ch == '\'')
+        {
+            // terminal_string
+            if (m_scanner.skip_terminal_string())
             {
-                ch = peekch();
-                if (!is_space(ch))
-                    break;
-                // space
-                nextch();
+                add_token(TOK_STRING, line, begin, begin + 1, m_scanner.index() - 1);
+                return true;
             }
+            m_aux.add_error("terminal string is invalid", line,
+                            m_scanner.index_to_column(begin));
+            return false;
+        }
 
-            if (is_digit(ch))
+        if (is_alpha(ch))
+        {
+            // meta_identifier
+            m_scanner.skip_meta_identifier();
+            add_token(TOK_IDENT, line, begin, begin, m_scanner.index());
+            return true;
+        }
+
+        if (m_scanner.match_get("(*"))  // )
+        {
+            // comment
+            if (m_scanner.skip_comment())
             {
-                // integer
-                size_t line = get_line();
-                m_scanner.scan_integer(str);
-                Token token(str, TOK_INTEGER, line);
-                m_tokens.push_back(token);
-                continue;
+                add_token(TOK_COMMENT, line, begin, begin + 2, m_scanner.index() - 2);
+                return true;
             }
+            m_aux.add_error("no end of comment", line,
+                            m_scanner.index_to_column(begin));
+            return false;
+        }
 
-            if (ch == '"' || ch == '\'')
+        if (ch == '?')
+        {
+            // special
+            nextch();
+            if (m_scanner.skip_special())
             {
-                // terminal_string
-                size_t line = get_line();
-                if (m_scanner.scan_terminal_string(str))
-                {
-                    Token token(str, TOK_STRING, line);
-                    m_tokens.push_back(token);
-                    continue;
-                }
-                m_aux.add_error("terminal string is invalid", line);
-                return false;
+                add_token(TOK_SPECIAL, line, begin, begin + 1, m_scanner.index() - 1);
+                return true;
             }
+            // no end of special
+            m_aux.add_error("no end of special", line,
+                            m_scanner.index_to_column(begin));
+            return false;
+        }
+
+        if (ch && strchr("=;|,-*[]{}()", ch) != NULL)
+        {
+            // symbol
+            nextch();
+            add_token(TOK_SYMBOL, line, begin, begin, begin + 1);
+            return true;
+        }
 
-            if (is_alpha(ch))
+        // invalid character
+        string_type msg = "invalid character: '";
+        msg += ch;
+        msg += "'";
+        m_aux.add_error(msg, line, m_scanner.index_to_column(begin));
+        return false;
+    }
+
+    // pull_raw() reads the next token except comments.
+    inline bool TokenStream::pull_raw(Token& t)
+    {
+        if (m_pending.size())
+        {
+            std::swap(t, m_pending.back());
+            m_pending.pop_back();
+            return true;
+        }
+        do
+        {
+            m_tokens.clear();
+            if (!scan_token())
+                return false;
+        } while (m_tokens.back().m_type == TOK_COMMENT);
+
+        std::swap(t, m_tokens.back());
+        return true;
+    }
+
+    // pull() reads the next token and joins the following words into it.
+    inline bool TokenStream::pull(Token& t)
+    {
+        if (!pull_raw(t))
+            return false;
+        if (t.m_type != TOK_IDENT)
+            return true;
+
+        Token next_word("", TOK_EOF);
+        while (pull_raw(next_word))
+        {
+            if (next_word.m_type != TOK_IDENT)
             {
-                // meta_identifier
-                size_t line = get_line();
-                m_scanner.scan_meta_identifier(str);
-                Token token(str, TOK_IDENT, line);
-                m_tokens.push_back(token);
-                continue;
+                m_pending.push_back(Token("", TOK_EOF));
+                std::swap(m_pending.back(), next_word);
+                return true;
             }
+            join_word(t, next_word);
+        }
+        return false;
+    }
+
+    // pull_next() appends a token to the window, or TOK_EOF on error.
+    inline void TokenStream::pull_next()
+    {
+        Token& t = m_ring[m_pulled % LAZY_WINDOW];
+        if (!pull(t))
+        {
+            const size_t begin = m_scanner.index();
+            t = Token("", TOK_EOF, m_scanner.index_to_line(begin), begin, begin);
+            m_failed = true;
+        }
+        ++m_pulled;
+    }
+
+    inline bool TokenStream::scan_dfa()
+    {
+        if (m_lazy)
+            return scan();
+
+        clear_tokens();
+        m_index = 0;
 
-            if (m_scanner.match_get("(*"))  // )
+        const DfaTables& tables = dfa_tables();
+        const char *data = m_scanner.data();
+        const size_t size = m_scanner.size();
+        size_t pos = m_scanner.index(), begin = pos;
+        unsigned int state = DS_START;
+
+        for (;;)
+        {
+            if (state == DS_START)
             {
-                // comment
-                size_t line = get_line();
-                if (m_scanner.scan_comment(str))
-                {
-                    Token token(str, TOK_COMMENT, line);
-                    m_tokens.push_back(token);
-                    continue;
-                }
-                m_aux.add_error("no end of comment", line);
-                return false;
+                pos = simd_skip_spaces(data + pos, data + size) - data;
+                begin = pos;
             }
 
-            if (ch == '?')
+            if (pos >= size)
             {
-                // special
-                nextch();
-                size_t line = get_line();
-                if (m_scanner.scan_special(str))
+                // end of buffer
+                m_scanner.index(pos);
+                const size_t line = m_scanner.index_to_line(begin);
+                switch (state)
                 {
-                    Token token(str, TOK_SPECIAL, line);
-                    m_tokens.push_back(token);
-                    continue;
+                case DS_START:
+                    add_token(TOK_EOF, line, begin, begin, begin);
+                    return m_aux.m_errors.empty();
+                case DS_INTEGER:
+                    add_token(TOK_INTEGER, line, begin, begin, pos);
+                    break;
+                case DS_IDENT:
+                    add_token(TOK_IDENT, line, begin, begin, pos);
+                    break;
+                case DS_LPAREN:
+                    add_token(TOK_SYMBOL, line, begin, begin, begin + 1);
+                    break;
+                case DS_SPECIAL:
+                    m_aux.add_error("no end of special", line,
+                                    m_scanner.index_to_column(begin));
+                    return false;
+                case DS_COMMENT:
+                case DS_COMMENT_STAR:
+                    m_aux.add_error("no end of comment", line,
+                                    m_scanner.index_to_column(begin));
+                    return false;
+                default:
+                    m_aux.add_error("terminal string is invalid", line,
+                                    m_scanner.index_to_column(begin));
+                    return false;
                 }
-                // no end of special
-                m_aux.add_error("no end of special", line);
-                return false;
+                state = DS_START;
+                continue;
             }
 
-            if (ch == 0)
+            const unsigned char ch = data[pos];
+            const unsigned int next = tables.m_next[state][tables.m_class[ch]];
+            if (next < DS_COUNT)
             {
-                // end of file
-                size_t line = get_line();
-                Token token("", TOK_EOF, line);
-                m_tokens.push_back(token);
-                break;
+                ++pos;
+                state = next;
+                if (const char skip_to = tables.m_skip_to[state])
+                    pos = simd_find_char(data + pos, data + size, skip_to) - data;
+                continue;
             }
-            else if (strchr("=;|,-*[]{}()", ch) != NULL)
+
+            // the actions that finish the token
+            TokenType type;
+            size_t text_begin = begin, text_end = pos;
+            switch (next)
             {
-                // symbol
-                nextch();
-                size_t line = get_line();
-                str.clear();
-                str += ch;
-                Token token(str, TOK_SYMBOL, line);
-                m_tokens.push_back(token);
-                continue;
+            case DA_INTEGER:
+                type = TOK_INTEGER;
+                break;
+            case DA_IDENT:
+                type = TOK_IDENT;
+                break;
+            case DA_LPAREN:
+                type = TOK_SYMBOL;
+                text_end = begin + 1;
+                break;
+            case DA_STRING:
+                type = TOK_STRING;
+                ++pos;
+                text_begin = begin + 1;
+                break;
+            case DA_SPECIAL:
+                type = TOK_SPECIAL;
+                ++pos;
+                text_begin = begin + 1;
+                break;
+            case DA_COMMENT:
+                type = TOK_COMMENT;
+                ++pos;
+                text_begin = begin + 2;
+                text_end = pos - 2;
+                break;
+            case DA_SYMBOL:
+                type = TOK_SYMBOL;
+                ++pos;
+                text_end = pos;
+                break;
+            case DA_EMPTY_STRING:
+                m_scanner.index(begin);
+                m_aux.add_error("terminal string is invalid",
+                                m_scanner.index_to_line(begin),
+                                m_scanner.index_to_column(begin));
+                return false;
+            default:
+                {
+                    // invalid character
+                    m_scanner.index(begin);
+                    string_type msg = "invalid character: '";
+                    msg += (char)ch;
+                    msg += "'";
+                    m_aux.add_error(msg, m_scanner.index_to_line(begin),
+                                    m_scanner.index_to_column(begin));
+                    return false;
+                }
             }
 
-            // invalid character
-            string_type msg = "invalid character: '";
-            msg += ch;
-            msg += "'";
-            m_aux.add_error(msg, get_line());
-            break;
+            m_scanner.index(pos);
+            add_token(type, m_scanner.index_to_line(begin), begin,
+                      text_begin, text_end);
+            state = DS_START;
         }
+    }
 
-        return m_aux.m_errors.empty();
+    inline void TokenStream::join_word(Token& word, const Token& next_word)
+    {
+        // only the joined words are materialized
+        word.materialize();
+        word.m_str += "-";
+        word.m_str.append(next_word.data(), next_word.size());
+        word.m_end = next_word.m_end;
+        word.m_atom = ATOM_NONE;
     }
 
-    inline void TokenStream::join_words()
+    // NOTE: This compacts m_tokens in place in linear time.
+    inline void
+    TokenStream::filter(bool del_comments, bool join, bool keep_comments)
     {
-        for (size_t i = 0; i < m_tokens.size() - 1; ++i)
+        if (keep_comments)
+            m_comments.clear();
+
+        if (m_compact)
         {
-            if (m_tokens[i].m_type == TOK_IDENT &&
-                m_tokens[i + 1].m_type == TOK_IDENT)
+            compact_filter(del_comments, join, keep_comments);
+            return;
+        }
+
+        size_t k = 0;
+        for (size_t i = 0; i < m_tokens.size(); ++i)
+        {
+            Token& t = m_tokens[i];
+            if (del_comments && t.m_type == TOK_COMMENT)
             {
-                m_tokens[i].m_str += "-";
-                m_tokens[i].m_str += m_tokens[i + 1].m_str;
-                m_tokens.erase(m_tokens.begin() + (i + 1));
-                --i;
+                if (keep_comments)
+                    m_comments.push_back(t);
+                continue;
             }
+            if (join && t.m_type == TOK_IDENT &&
+                k > 0 && m_tokens[k - 1].m_type == TOK_IDENT)
+            {
+                join_word(m_tokens[k - 1], t);
+                continue;
+            }
+            if (k != i)
+                std::swap(m_tokens[k], t);
+            ++k;
         }
+        m_tokens.erase(m_tokens.begin() + k, m_tokens.end());
     }
 
-    inline void TokenStream::delete_comments()
+    inline void
+    TokenStream::compact_filter(bool del_comments, bool join, bool keep_comments)
     {
-        for (size_t i = m_tokens.size(); i > 0; )
+        const char *data = m_scanner.data();
+        size_t k = 0;
+        for (size_t i = 0; i < m_buffer.size(); ++i)
         {
-            --i;
-            if (m_tokens[i].m_type == TOK_COMMENT)
+            const TokenType type = m_buffer.type(i);
+            if (del_comments && type == TOK_COMMENT)
             {
-                m_tokens.erase(m_tokens.begin() + i);
+                if (keep_comments)
+                    m_comments.push_back(compact_at(i));
+                continue;
             }
+            if (join && type == TOK_IDENT &&
+                k > 0 && m_buffer.type(k - 1) == TOK_IDENT)
+            {
+                m_buffer.join_word(k - 1, i, data);
+                continue;
+            }
+            if (k != i)
+                m_buffer.move(k, i);
+            ++k;
         }
+        m_buffer.resize(k);
     }
 
     /////////////////////////////////////////////////////////////////////////
-    // StringScanner inlines
+    // TokenBuffer inlines
 
-    inline bool StringScanner::scan_comment(string_type& ret)
+    inline void TokenBuffer::clear()
     {
-        ret.clear();
+        m_kinds.clear();
+        m_symbols.clear();
+        m_begins.clear();
+        m_ends.clear();
+        m_extra.clear();
+        m_integers.clear();
+        m_owned.clear();
+        m_atoms.clear();
+    }
+
+    inline void TokenBuffer::reserve(size_t count)
+    {
+        m_kinds.reserve(count);
+        m_symbols.reserve(count);
+        m_begins.reserve(count);
+        m_ends.reserve(count);
+        m_extra.reserve(count);
+    }
+
+    inline void TokenBuffer::resize(size_t count)
+    {
+        assert(count <= size());
+        m_kinds.resize(count);
+        m_symbols.resize(count);
+        m_begins.resize(count);
+        m_ends.resize(count);
+        m_extra.resize(count);
+        if (m_atoms.size() > count)
+            m_atoms.resize(count);
+    }
+
+    inline void
+    TokenBuffer::push_back(TokenType type, size_t begin, size_t end,
+                           const char *text, size_t len, const char *data)
+    {
+        unsigned char kind = (unsigned char)type;
+        SymbolType symbol = SYM_NONE;
+        uint32_t extra = 0;
+        if (type == TOK_INTEGER)
+        {
+            extra = (uint32_t)m_integers.size();
+            m_integers.push_back(Token::integer_of(text, len));
+        }
+        else if (type == TOK_SYMBOL && len == 1)
+        {
+            symbol = SymbolType(text[0]);
+        }
+
+        const size_t margin = text_margin(type);
+        if (text != data + begin + margin || len + margin * 2 != end - begin)
+        {
+            // the text is not the one in the scanner buffer
+            kind |= OWNED;
+            extra = (uint32_t)m_owned.size();
+            m_owned.push_back(string_type(text, len));
+        }
+
+        m_kinds.push_back(kind);
+        m_symbols.push_back((unsigned char)symbol);
+        m_begins.push_back((uint32_t)begin);
+        m_ends.push_back((uint32_t)end);
+        m_extra.push_back(extra);
+    }
+
+    inline const char *
+    TokenBuffer::text(size_t i, const char *data, size_t& len) const
+    {
+        if (is_owned(i))
+        {
+            const string_type& str = m_owned[m_extra[i]];
+            len = str.size();
+            return str.c_str();
+        }
+        const size_t margin = text_margin(type(i));
+        len = m_ends[i] - m_begins[i] - margin * 2;
+        return data + m_begins[i] + margin;
+    }
+
+    inline void TokenBuffer::join_word(size_t k, size_t i, const char *data)
+    {
+        assert(type(k) == TOK_IDENT && type(i) == TOK_IDENT);
+        if (!is_owned(k))
+        {
+            size_t len;
+            const char *str = text(k, data, len);
+            m_kinds[k] |= OWNED;
+            m_extra[k] = (uint32_t)m_owned.size();
+            m_owned.push_back(string_type(str, len));
+        }
+
+        size_t len;
+        const char *str = text(i, data, len);
+        string_type& word = m_owned[m_extra[k]];
+        word += "-";
+        word.append(str, len);
+        m_ends[k] = m_ends[i];
+        if (k < m_atoms.size())
+            m_atoms[k] = NO_ATOM;
+    }
+
+    inline void TokenBuffer::move(size_t k, size_t i)
+    {
+        m_kinds[k] = m_kinds[i];
+        m_symbols[k] = m_symbols[i];
+        m_begins[k] = m_begins[i];
+        m_ends[k] = m_ends[i];
+        m_extra[k] = m_extra[i];
+        if (k < m_atoms.size())
+            m_atoms[k] = (i < m_atoms.size() ? m_atoms[i] : uint32_t(NO_ATOM));
+    }
 
+    inline void TokenBuffer::atom(size_t i, atom_type value)
+    {
+        assert(i < size() && value < NO_ATOM);
+        if (m_atoms.size() <= i)
+            m_atoms.resize(size(), uint32_t(NO_ATOM));
+        m_atoms[i] = (uint32_t)value;
+    }
+
+    inline size_t TokenBuffer::memory() const
+    {
+        size_t ret = size() * (2 + sizeof(uint32_t) * 3);
+        ret += m_integers.size() * sizeof(int);
+        ret += m_atoms.size() * sizeof(uint32_t);
+        for (size_t i = 0; i < m_owned.size(); ++i)
+        {
+            ret += sizeof(string_type);
+            if (m_owned[i].capacity() >= sizeof(string_type))
+                ret += m_owned[i].capacity() + 1;   // not in the object
+        }
+        return ret;
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    // StringScanner inlines
+
+    inline bool StringScanner::skip_comment()
+    {
         for (;;)
         {
             // (*
+            m_index = simd_find_char(peek(), m_data + m_size, '*') - m_data;
             if (match_get("*)"))
                 return true;
 
-            char ch = getch();
-            if (ch == 0)
+            if (eof())
                 break;
-
-            ret += ch;
+            nextch();
         }
 
         return false;
     }
 
-    inline bool StringScanner::scan_special(string_type& ret)
+    inline bool StringScanner::scan_comment(string_type& ret)
     {
-        ret.clear();
-
-        for (;;)
+        const size_t begin = m_index;
+        if (skip_comment())
         {
-            char ch = getch();
-            if (ch == 0)
-                break;
-            if (ch == '?')
-                return true;
-            ret += ch;
+            ret.assign(m_data + begin, m_index - 2 - begin);
+            return true;
         }
+        ret.assign(m_data + begin, m_index - begin);
         return false;
     }
 
+    inline bool StringScanner::skip_special()
+    {
+        m_index = simd_find_char(peek(), m_data + m_size, '?') - m_data;
+        if (eof())
+            return false;
+        nextch();
+        return true;
+    }
 
-    // meta_identifier = letter, { letter | decimal_digit };
-    inline bool StringScanner::scan_meta_identifier(string_type& ret)
+    inline bool StringScanner::scan_special(string_type& ret)
     {
-        ret.clear();
+        const size_t begin = m_index;
+        if (skip_special())
+        {
+            ret.assign(m_data + begin, m_index - 1 - begin);
+            return true;
+        }
+        ret.assign(m_data + begin, m_index - begin);
+        return false;
+    }
 
-        char ch = *peek();
-        if (!is_alpha(ch))
+    // meta_identifier = letter, { letter | decimal_digit };
+    inline bool StringScanner::skip_meta_identifier()
+    {
+        if (eof() || !is_alpha(peekch()))
             return false;
 
-        ch = getch();
-        ret += ch;
-        for (;;)
+        nextch();
+        while (!eof())
         {
-            ch = getch();
-            if (ch == 0)
-                break;
+            char ch = peekch();
             if (!is_alnum(ch) && ch != '-')
-            {
-                ungetch();
                 break;
-            }
-            ret += ch;
+            nextch();
         }
 
         return true;
     }
 
-    // integer = decimal_digit, { decimal digit };
-    inline bool StringScanner::scan_integer(string_type& ret)
+    inline bool StringScanner::scan_meta_identifier(string_type& ret)
     {
-        ret.clear();
+        const size_t begin = m_index;
+        bool ok = skip_meta_identifier();
+        ret.assign(m_data + begin, m_index - begin);
+        return ok;
+    }
 
-        char ch = *peek();
-        if (!is_digit(ch))
+    // integer = decimal_digit, { decimal digit };
+    inline bool StringScanner::skip_integer()
+    {
+        if (eof() || !is_digit(peekch()))
             return false;
 
-        ch = getch();
-        ret += ch;
-        for (;;)
+        nextch();
+        while (!eof() && is_digit(peekch()))
         {
-            ch = getch();
-            if (ch == 0)
-                break;
-            if (!is_digit(ch))
-            {
-                ungetch();
-                break;
-            }
-            ret += ch;
+            nextch();
         }
 
         return true;
     }
 
+    inline bool StringScanner::scan_integer(string_type& ret)
+    {
+        const size_t begin = m_index;
+        bool ok = skip_integer();
+        ret.assign(m_data + begin, m_index - begin);
+        return ok;
+    }
+
     // terminal string = "'", character - "'", {character - "'"}, "'"
     //                 | '"', character - '"', {character - '"'}, '"';
-    inline bool StringScanner::scan_terminal_string(string_type& ret)
+    inline bool StringScanner::skip_terminal_string()
     {
-        ret.clear();
-
-        char ch = getch();
-        if (ch == 0)
+        if (eof())
             return false;
 
+        char ch = peekch();
         if (ch != '"' && ch != '\'')
-        {
-            ungetch();
             return false;
-        }
         const char first_ch = ch;
+        nextch();
 
 #ifdef ISO_EBNF
-        ch = getch();
-        if (ch == first_ch)
+        if (!eof() && peekch() == first_ch)
         {
             // an empty string is not acceptable
             ungetch();
-            ungetch();
             return false;
         }
-        ungetch();
 #endif
 
-        for (;;)
+        m_index = simd_find_char(peek(), m_data + m_size, first_ch) - m_data;
+        if (eof())
         {
-            ch = getch();
-            if (ch == 0)
-            {
-                // no end of string
-                return false;
-            }
-            if (ch == first_ch)
-            {
-                break;
-            }
-            ret += ch;
+            // no end of string
+            return false;
         }
+        nextch();
 
         return true;
     }
 
-    inline size_t StringScanner::index_to_line(size_t index) const
+    inline bool StringScanner::scan_terminal_string(string_type& ret)
     {
-        size_t line_count = 1;
-        for (size_t i = 0; i < m_str.size(); ++i)
+        const size_t begin = m_index;
+        if (skip_terminal_string())
         {
-            if (i == index)
-                return line_count;
-
-            if (m_str[i] == '\n')
-            {
-                ++line_count;
-            }
+            ret.assign(m_data + begin + 1, m_index - 2 - begin);
+            return true;
         }
-        return line_count;
+        ret.clear();
+        return false;
     }
 
-    inline size_t StringScanner::line_to_index(size_t line) const
+    inline void StringScanner::build_line_index(size_t head)
     {
-        if (line <= 1)
-            return 0;
+        m_line_starts.clear();
+        m_line_starts.push_back(head);
+        m_line_end = head;
+    }
 
-        size_t index, line_count = 1;
-        for (index = 0; index < m_str.size(); ++index)
-        {
-            if (m_str[index] == '\n')
-            {
-                ++line_count;
-                if (line_count == line)
-                    return index + 1;
-            }
+    inline void StringScanner::index_lines(size_t index) const
+    {
+        // find the line heads up to index by LINE_INDEX_STEP at least
+        if (index <= m_line_end)
+            return;
+        if (index < m_line_end + LINE_INDEX_STEP)
+            index = m_line_end + LINE_INDEX_STEP;
+        if (index > m_size)
+            index = m_size;
+
+        const char *end = m_data + index;
+        for (const char *p = m_data + m_line_end; ; ++p)
+        {
+            p = simd_find_char(p, end, '\n');
+            if (p == end)
+                break;
+            m_line_starts.push_back(p - m_data + 1);
         }
-        return index;
+        m_line_end = index;
+    }
+
+    inline size_t StringScanner::index_to_line(size_t index) const
+    {
+        index_lines(index);
+        // the number of the line heads at or before index
+        return m_line_base +
+               (std::upper_bound(m_line_starts.begin(), m_line_starts.end(), index) -
+                m_line_starts.begin());
+    }
+
+    inline size_t StringScanner::index_to_column(size_t index) const
+    {
+        if (index > m_size)
+            index = m_size;
+        if (index < m_line_starts[0])
+            index = m_line_starts[0];
+        return index - m_line_starts[index_to_line(index) - m_line_base - 1] + 1;
+    }
+
+    inline size_t StringScanner::line_to_index(size_t line) const
+    {
+        if (line <= m_line_base + 1)
+            return m_line_starts[0];
+        line -= m_line_base;
+        while (line - 1 >= m_line_starts.size() && m_line_end < m_size)
+            index_lines(m_line_end + LINE_INDEX_STEP);
+        if (line - 1 < m_line_starts.size())
+            return m_line_starts[line - 1];
+        return m_size;
     }
 
     /////////////////////////////////////////////////////////////////////////
     // Parser inlines
 
+    // NOTE: The span is kept by offsets, because a lazy stream forgets
+    //       the old tokens.
+    template <typename T_AST>
+    inline T_AST *Parser::span(T_AST *ast, size_t first) const
+    {
+        const size_t last = m_stream.prev_end();
+        ast->m_begin = first;
+        ast->m_end = (last > first ? last : first);
+        return ast;
+    }
+
     inline bool Parser::parse()
     {
-        if (m_stream.size() == 0)
+        if (m_stream.size() == 0 || m_stream.failed())
             return false;
 
-        delete m_ast;
+        release_ast();
+        if (!m_use_arena)
+        {
+            delete m_arena;
+            m_arena = NULL;
+        }
+        else if (m_arena == NULL)
+        {
+            m_arena = new AstArena();
+        }
+
+        m_depth = 0;
         m_ast = visit_syntax();
-        if (m_ast != NULL && type() == TOK_EOF)
+        if (m_ast != NULL && type() == TOK_EOF && !m_stream.failed())
             return true;
 
-        delete m_ast;
-        m_ast = NULL;
+        release_ast();
         return false;
     }
 
@@ -853,13 +2326,14 @@ namespace EBNF
     {
         PRINT_FUNCTION();
 
+        const size_t first = offset();
         BaseAst *rule = visit_syntax_rule();
         if (rule == NULL)
         {
             return NULL;
         }
 
-        SeqAst *seq = new SeqAst("rules");
+        SeqAst *seq = ast_new<SeqAst>(m_arena, SEQ_RULES);
         for (;;)
         {
             seq->push_back(rule);
@@ -870,11 +2344,11 @@ namespace EBNF
             rule = visit_syntax_rule();
             if (rule == NULL)
             {
-                delete seq;
+                ast_delete(seq);
                 return NULL;
             }
         }
-        return seq;
+        return span(seq, first);
     }
 
     // syntax_rule = meta_identifier, '=', definitions_list, ';';
@@ -885,35 +2359,41 @@ namespace EBNF
 
         if (type() != TOK_IDENT)
         {
-            m_aux.add_error("expected TOK_IDENT", get_line());
+            m_aux.add_error("expected TOK_IDENT", get_line(), get_column());
             return NULL;
         }
-        IdentAst *id = new IdentAst(str());
+        const size_t first = offset();
+        IdentAst *id = ast_new<IdentAst>(m_arena, atom());
         next();
-        if (type() != TOK_SYMBOL || str() != "=")
+        span(id, first);
+        if (!is_symbol(SYM_DEFINING))
         {
-            m_aux.add_error("expected '='", get_line());
-            delete id;
+            m_aux.add_error("expected '='", get_line(), get_column());
+            ast_delete(id);
             return NULL;
         }
         next();
-        BaseAst *def_list = visit_definitions_list();
+        BaseAst *def_list;
+        if (m_iterative)
+            def_list = visit_definitions_list_iterative();
+        else
+            def_list = visit_definitions_list();
         if (def_list == NULL)
         {
-            delete id;
+            ast_delete(id);
             return NULL;
         }
-        if (type() != TOK_SYMBOL || str() != ";")
+        if (!is_symbol(SYM_TERMINATOR))
         {
-            m_aux.add_error("expected ';' or ','", get_line());
-            delete id;
-            delete def_list;
+            m_aux.add_error("expected ';' or ','", get_line(), get_column());
+            ast_delete(id);
+            ast_delete(def_list);
             return NULL;
         }
         next();
 
-        BinaryAst *bin = new BinaryAst("rule", id, def_list);
-        return bin;
+        BinaryAst *bin = ast_new<BinaryAst>(m_arena, BINARY_RULE, id, def_list);
+        return span(bin, first);
     }
 
     // definitions_list = single_definition, {'|', single_definition};
@@ -922,16 +2402,17 @@ namespace EBNF
     {
         PRINT_FUNCTION();
 
+        const size_t first = offset();
         BaseAst *ast = visit_single_definition();
         if (ast == NULL)
             return NULL;
 
-        SeqAst *seq = new SeqAst("expr");
+        SeqAst *seq = ast_new<SeqAst>(m_arena, SEQ_EXPR);
         for (;;)
         {
             seq->push_back(ast);
 
-            if (type() == TOK_SYMBOL && str() == "|")
+            if (is_symbol(SYM_SEPARATOR))
             {
                 next();
             }
@@ -943,11 +2424,11 @@ namespace EBNF
             ast = visit_single_definition();
             if (ast == NULL)
             {
-                delete seq;
+                ast_delete(seq);
                 return NULL;
             }
         }
-        return seq;
+        return span(seq, first);
     }
 
     // single_definition = term, {',', term};
@@ -956,16 +2437,17 @@ namespace EBNF
     {
         PRINT_FUNCTION();
 
+        const size_t first = offset();
         BaseAst *term = visit_term();
         if (term == NULL)
             return NULL;
 
-        SeqAst *seq = new SeqAst("terms");
+        SeqAst *seq = ast_new<SeqAst>(m_arena, SEQ_TERMS);
         for (;;)
         {
             seq->push_back(term);
 
-            if (type() == TOK_SYMBOL && str() == ",")
+            if (is_symbol(SYM_CONCATENATE))
                 next();
             else
                 break;
@@ -973,11 +2455,11 @@ namespace EBNF
             term = visit_term();
             if (term == NULL)
             {
-                delete seq;
+                ast_delete(seq);
                 return NULL;
             }
         }
-        return seq;
+        return span(seq, first);
     }
 
     // term = factor, ['-', exception];
@@ -986,20 +2468,21 @@ namespace EBNF
     {
         PRINT_FUNCTION();
 
+        const size_t first = offset();
         BaseAst *fact = visit_factor();
         if (fact == NULL)
             return NULL;
 
-        if (type() == TOK_SYMBOL && str() == "-")
+        if (is_symbol(SYM_EXCEPT))
         {
             next();
             BaseAst *ex = visit_exception();
             if (ex)
             {
-                BaseAst *ret = new BinaryAst("-", fact, ex);
-                return ret;
+                BaseAst *ret = ast_new<BinaryAst>(m_arena, BINARY_EXCEPT, fact, ex);
+                return span(ret, first);
             }
-            delete fact;
+            ast_delete(fact);
             return NULL;
         }
         return fact;
@@ -1023,20 +2506,21 @@ namespace EBNF
 
         if (type() == TOK_INTEGER)
         {
+            const size_t first = offset();
             int inte = integer();
             next();
-            if (type() == TOK_SYMBOL && str() == "*")
+            if (is_symbol(SYM_REPETITION))
             {
+                IntegerAst *i_ast = span(ast_new<IntegerAst>(m_arena, inte), first);
                 next();
-                IntegerAst *i_ast = new IntegerAst(inte);
                 BaseAst *prim = visit_primary();
                 if (prim)
                 {
-                    return new BinaryAst("*", i_ast, prim);
+                    return span(ast_new<BinaryAst>(m_arena, BINARY_TIMES, i_ast, prim), first);
                 }
-                delete i_ast;
+                ast_delete(i_ast);
             }
-            m_aux.add_error("expected '*'", get_line());
+            m_aux.add_error("expected '*'", get_line(), get_column());
             return NULL;
         }
 
@@ -1052,44 +2536,55 @@ namespace EBNF
     {
         PRINT_FUNCTION();
 
+        const size_t first = offset();
         BaseAst *ret;
         switch (type())
         {
         case TOK_STRING:
-            ret = new StringAst(str());
+            ret = ast_new<StringAst>(m_arena, atom());
             next();
+            span(ret, first);
             break;
         case TOK_IDENT:
-            ret = new IdentAst(str());
+            ret = ast_new<IdentAst>(m_arena, atom());
             next();
+            span(ret, first);
             break;
         case TOK_SPECIAL:
-            ret = new SpecialAst(str());
+            ret = ast_new<SpecialAst>(m_arena, str());
             next();
+            span(ret, first);
             break;
         case TOK_SYMBOL:
-            if (str() == "[")   // ]
+            switch (symbol())
             {
-                ret = visit_optional_sequence();
+            case SYM_START_OPTION:
+            case SYM_START_REPEAT:
+            case SYM_START_GROUP:
+                ret = NULL;
+                if (nest_in())
+                {
+                    if (is_symbol(SYM_START_OPTION))
+                        ret = visit_optional_sequence();
+                    else if (is_symbol(SYM_START_REPEAT))
+                        ret = visit_repeated_sequence();
+                    else
+                        ret = visit_grouped_sequence();
+                    nest_out();
+                }
                 break;
-            }
-            if (str() == "{")   // }
-            {
-                ret = visit_repeated_sequence();
+            case SYM_TERMINATOR:
+            case SYM_SEPARATOR:
+            case SYM_CONCATENATE:
+            case SYM_END_GROUP:
+            case SYM_END_REPEAT:
+            case SYM_END_OPTION:
+                ret = span(ast_new<EmptyAst>(m_arena), first);
                 break;
-            }
-            if (str() == "(")   // )
-            {
-                ret = visit_grouped_sequence();
-                break;
-            }
-            if (str() == ";" || str() == "|" || str() == "," ||
-                str() == ")" || str() == "}" || str() == "]")
-            {
-                ret = new EmptyAst();
+            default:
+                ret = NULL;
                 break;
             }
-            ret = NULL;
             break;
         default:
             ret = NULL;
@@ -1103,28 +2598,29 @@ namespace EBNF
     inline BaseAst *Parser::visit_optional_sequence()
     {
         PRINT_FUNCTION();
+        const size_t first = offset();
         BaseAst *ret;
-        if (type() != TOK_SYMBOL || str() != "[")
+        if (!is_symbol(SYM_START_OPTION))
         {
-            m_aux.add_error("expected '['", get_line());
+            m_aux.add_error("expected '['", get_line(), get_column());
             return NULL;
         }
         next();
         ret = visit_definitions_list();
         if (ret == NULL)
         {
-            delete ret;
+            ast_delete(ret);
             return NULL;
         }
-        if (type() != TOK_SYMBOL || str() != "]")
+        if (!is_symbol(SYM_END_OPTION))
         {
-            m_aux.add_error("']' unmatched", get_line());
-            delete ret;
+            m_aux.add_error("']' unmatched", get_line(), get_column());
+            ast_delete(ret);
             return NULL;
         }
         next();
-        ret = new UnaryAst("optional", ret);
-        return ret;
+        ret = ast_new<UnaryAst>(m_arena, UNARY_OPTIONAL, ret);
+        return span(ret, first);
     }
 
     // repeated_sequence = '{', definitions_list, '}';
@@ -1132,28 +2628,29 @@ namespace EBNF
     inline BaseAst *Parser::visit_repeated_sequence()
     {
         PRINT_FUNCTION();
+        const size_t first = offset();
         BaseAst *ret;
-        if (type() != TOK_SYMBOL || str() != "{")
+        if (!is_symbol(SYM_START_REPEAT))
         {
-            m_aux.add_error("expected '{'", get_line());    // }
+            m_aux.add_error("expected '{'", get_line(), get_column());    // }
             return NULL;
         }
         next();
         ret = visit_definitions_list();
         if (ret == NULL)
         {
-            delete ret;
+            ast_delete(ret);
             return NULL;
         }
-        if (type() != TOK_SYMBOL || str() != "}")
+        if (!is_symbol(SYM_END_REPEAT))
         {
-            m_aux.add_error("'}' unmatched", get_line());
-            delete ret;
+            m_aux.add_error("'}' unmatched", get_line(), get_column());
+            ast_delete(ret);
             return NULL;
         }
         next();
-        ret = new UnaryAst("repeated", ret);
-        return ret;
+        ret = ast_new<UnaryAst>(m_arena, UNARY_REPEATED, ret);
+        return span(ret, first);
     }
 
     // grouped_sequence = '(', definitions_list, ')';
@@ -1162,28 +2659,241 @@ namespace EBNF
     {
         PRINT_FUNCTION();
 
+        const size_t first = offset();
         BaseAst *ret;
-        if (type() != TOK_SYMBOL || str() != "(")
+        if (!is_symbol(SYM_START_GROUP))
         {
-            m_aux.add_error("expected '('", get_line());
+            m_aux.add_error("expected '('", get_line(), get_column());
             return NULL;
         }
         next();
         ret = visit_definitions_list();
         if (ret == NULL)
         {
-            delete ret;
+            ast_delete(ret);
             return NULL;
         }
-        if (type() != TOK_SYMBOL || str() != ")")
+        if (!is_symbol(SYM_END_GROUP))
         {
-            m_aux.add_error("')' unmatched", get_line());
-            delete ret;
+            m_aux.add_error("')' unmatched", get_line(), get_column());
+            ast_delete(ret);
             return NULL;
         }
         next();
-        ret = new UnaryAst("group", ret);
-        return ret;
+        ret = ast_new<UnaryAst>(m_arena, UNARY_GROUP, ret);
+        return span(ret, first);
+    }
+
+    inline bool Parser::nest_in()
+    {
+        if (m_max_depth && m_depth >= m_max_depth)
+        {
+            m_aux.add_error("brackets nested too deeply", get_line(), get_column());
+            return false;
+        }
+        ++m_depth;
+        return true;
+    }
+
+    inline void Parser::begin_nest(Nest& nest, SymbolType open, size_t first)
+    {
+        nest.m_open = open;
+        nest.m_first = first;
+        nest.m_expr = ast_new<SeqAst>(m_arena, SEQ_EXPR);
+        nest.m_expr_first = offset();
+        nest.m_terms = ast_new<SeqAst>(m_arena, SEQ_TERMS);
+        nest.m_terms_first = offset();
+        nest.m_term_first = offset();
+        nest.m_left = NULL;
+        nest.m_times = NULL;
+        nest.m_factor_first = offset();
+    }
+
+    // NOTE: This parses a definitions_list as visit_definitions_list()
+    //       does, with the same ASTs, spans and errors. The brackets that
+    //       are open are kept in a stack of Nest, so the depth of the call
+    //       stack does not grow with the depth of the brackets.
+    inline BaseAst *Parser::visit_definitions_list_iterative()
+    {
+        PRINT_FUNCTION();
+
+        std::vector<Nest> stack(1);
+        begin_nest(stack.back(), SYM_DEFINING, offset());
+
+        BaseAst *ast = NULL;
+        bool failed = false;
+        while (!failed)
+        {
+            // factor = [integer, '*'], primary;
+            Nest *nest = &stack.back();
+            const size_t first = offset();
+            if (nest->m_left == NULL)
+                nest->m_term_first = first;
+            nest->m_factor_first = first;
+            if (type() == TOK_INTEGER)
+            {
+                int inte = integer();
+                next();
+                if (!is_symbol(SYM_REPETITION))
+                {
+                    m_aux.add_error("expected '*'", get_line(), get_column());
+                    break;
+                }
+                nest->m_times = span(ast_new<IntegerAst>(m_arena, inte), first);
+                next();
+            }
+
+            // open a bracket
+            if (is_symbol(SYM_START_OPTION) || is_symbol(SYM_START_REPEAT) ||
+                is_symbol(SYM_START_GROUP))
+            {
+                if (!nest_in())
+                    break;
+                const SymbolType open = symbol();
+                const size_t open_first = offset();
+                next();
+                stack.push_back(Nest());
+                begin_nest(stack.back(), open, open_first);
+                continue;
+            }
+
+            ast = visit_primary();
+            if (ast == NULL)
+            {
+                if (nest->m_times)
+                    m_aux.add_error("expected '*'", get_line(), get_column());
+                break;
+            }
+
+            // reduce the factor, and close the brackets that end here
+            for (;;)
+            {
+                nest = &stack.back();
+                if (nest->m_times)
+                {
+                    ast = ast_new<BinaryAst>(m_arena, BINARY_TIMES, nest->m_times, ast);
+                    span(ast, nest->m_factor_first);
+                    nest->m_times = NULL;
+                }
+
+                // term = factor, ['-', exception];
+                if (nest->m_left)
+                {
+                    ast = ast_new<BinaryAst>(m_arena, BINARY_EXCEPT, nest->m_left, ast);
+                    span(ast, nest->m_term_first);
+                    nest->m_left = NULL;
+                }
+                else if (is_symbol(SYM_EXCEPT))
+                {
+                    next();
+                    nest->m_left = ast;
+                    ast = NULL;
+                    break;
+                }
+
+                // single_definition = term, {',', term};
+                nest->m_terms->push_back(ast);
+                ast = NULL;
+                if (is_symbol(SYM_CONCATENATE))
+                {
+                    next();
+                    break;
+                }
+
+                // definitions_list = single_definition, {'|', single_definition};
+                nest->m_expr->push_back(span(nest->m_terms, nest->m_terms_first));
+                nest->m_terms = NULL;
+                if (is_symbol(SYM_SEPARATOR))
+                {
+                    next();
+                    nest->m_terms = ast_new<SeqAst>(m_arena, SEQ_TERMS);
+                    nest->m_terms_first = offset();
+                    break;
+                }
+                span(nest->m_expr, nest->m_expr_first);
+                if (stack.size() == 1)
+                    return nest->m_expr;
+
+                UnaryType unary_type;
+                SymbolType close;
+                const char *unmatched;
+                switch (nest->m_open)
+                {
+                case SYM_START_OPTION:
+                    unary_type = UNARY_OPTIONAL;
+                    close = SYM_END_OPTION;
+                    unmatched = "']' unmatched";
+                    break;
+                case SYM_START_REPEAT:
+                    unary_type = UNARY_REPEATED;
+                    close = SYM_END_REPEAT;
+                    unmatched = "'}' unmatched";
+                    break;
+                default:
+                    assert(nest->m_open == SYM_START_GROUP);
+                    unary_type = UNARY_GROUP;
+                    close = SYM_END_GROUP;
+                    unmatched = "')' unmatched";
+                    break;
+                }
+                if (!is_symbol(close))
+                {
+                    m_aux.add_error(unmatched, get_line(), get_column());
+                    failed = true;
+                    break;
+                }
+                next();
+
+                ast = ast_new<UnaryAst>(m_arena, unary_type, nest->m_expr);
+                span(ast, nest->m_first);
+                stack.pop_back();
+                nest_out();
+            }
+        }
+
+        ast_delete(ast);
+        for (size_t i = stack.size(); i-- > 0; )
+        {
+            Nest& nest = stack[i];
+            ast_delete(nest.m_expr);
+            ast_delete(nest.m_terms);
+            ast_delete(nest.m_left);
+            ast_delete(nest.m_times);
+            if (i > 0)
+                nest_out();
+        }
+        return NULL;
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    // ParseContext inlines
+
+    inline void ParseContext::clear()
+    {
+        m_parser.reset();
+        m_aux.clear_errors();
+    }
+
+    inline void ParseContext::reset(const char *data, size_t size)
+    {
+        clear();
+        m_scanner.reset(data, size);
+    }
+
+    inline void ParseContext::reset(const string_type& str)
+    {
+        clear();
+        m_scanner.reset(str);
+    }
+
+    inline bool ParseContext::parse()
+    {
+        clear();
+        m_scanner.index(0);
+        if (!m_stream.scan())
+            return false;
+        m_stream.fixup();
+        return m_parser.parse();
     }
 } // namespace EBNF
 
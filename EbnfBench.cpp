@@ -0,0 +1,731 @@
+// EbnfBench.cpp --- benchmarks for ISO EBNF notation parser
+// See ReadMe.txt and License.txt.
+/////////////////////////////////////////////////////////////////////////
+
+#include "EBNF.hpp"
+#include "parallel_parser.hpp"
+#include "event_parser.hpp"
+#include "lazy_parser.hpp"
+#include "ebnf_document.hpp"
+#include "hash_cons.hpp"
+#include "ast_digest.hpp"
+#include <cstdio>       // for std::printf
+#include <ctime>        // for std::clock
+#include <chrono>       // for std::chrono::steady_clock
+
+static double elapsed_msec(std::clock_t start)
+{
+    return (std::clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+}
+
+// std::clock() counts the time of all the threads
+typedef std::chrono::steady_clock wall_clock;
+static double elapsed_wall_msec(wall_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(wall_clock::now() - start).count();
+}
+
+// make a comment-heavy grammar of multi-word identifiers
+static std::string make_grammar(size_t num_rules)
+{
+    std::string str;
+    char buf[256];
+    for (size_t i = 0; i < num_rules; ++i)
+    {
+        std::sprintf(buf,
+            "(* rule %u *) rule number%u (* name *) = first word%u, "
+            "(* one *) second long word | 'a' (* two *), [third word%u];\n",
+            (int)i, (int)i, (int)i, (int)i);
+        str += buf;
+    }
+    return str;
+}
+
+// the former delete_comments and join_words, for comparison
+static void legacy_fixup(EBNF::tokens_type& tokens)
+{
+    using namespace EBNF;
+
+    for (size_t i = tokens.size(); i > 0; )
+    {
+        --i;
+        if (tokens[i].m_type == TOK_COMMENT)
+        {
+            tokens.erase(tokens.begin() + i);
+        }
+    }
+
+    for (size_t i = 0; i + 1 < tokens.size(); ++i)
+    {
+        if (tokens[i].m_type == TOK_IDENT && tokens[i + 1].m_type == TOK_IDENT)
+        {
+            tokens[i].m_str += "-";
+            tokens[i].m_str += tokens[i + 1].m_str;
+            tokens.erase(tokens.begin() + (i + 1));
+            --i;
+        }
+    }
+}
+
+// scan and fixup
+static void bench_fixup(void)
+{
+    using namespace EBNF;
+
+    printf("scan and fixup:\n");
+    printf("%8s %10s %12s %12s %12s\n",
+           "rules", "tokens", "scan(ms)", "fixup(ms)", "legacy(ms)");
+
+    bool do_legacy = true;
+    for (size_t num_rules = 1000; num_rules <= 64000; num_rules *= 2)
+    {
+        std::string str = make_grammar(num_rules);
+
+        StringScanner scanner(str.c_str(), str.size());
+        AuxInfo aux;
+        TokenStream stream(scanner, aux);
+
+        std::clock_t start = std::clock();
+        stream.scan();
+        double scan_time = elapsed_msec(start);
+        size_t num_tokens = stream.size();
+
+        tokens_type tokens = stream.m_tokens;
+
+        start = std::clock();
+        stream.fixup();
+        double fixup_time = elapsed_msec(start);
+
+        double legacy_time = 0;
+        if (do_legacy)
+        {
+            start = std::clock();
+            legacy_fixup(tokens);
+            legacy_time = elapsed_msec(start);
+            // the legacy one is quadratic; don't wait for it too long
+            if (legacy_time > 2000)
+                do_legacy = false;
+        }
+
+        printf("%8u %10u %12.2f %12.2f ", (int)num_rules, (int)num_tokens,
+               scan_time, fixup_time);
+        if (legacy_time > 0)
+            printf("%12.2f\n", legacy_time);
+        else
+            printf("%12s\n", "-");
+    }
+}
+
+// scan vs. scan_dfa
+static void bench_lexers(void)
+{
+    using namespace EBNF;
+
+    printf("lexers:\n");
+    printf("%8s %10s %12s %12s\n", "rules", "tokens", "scan(ms)", "dfa(ms)");
+
+    for (size_t num_rules = 4000; num_rules <= 64000; num_rules *= 2)
+    {
+        std::string str = make_grammar(num_rules);
+
+        StringScanner scanner1(str.c_str(), str.size());
+        StringScanner scanner2(str.c_str(), str.size());
+        AuxInfo aux1, aux2;
+        TokenStream stream1(scanner1, aux1), stream2(scanner2, aux2);
+        stream1.zero_copy(true);
+        stream2.zero_copy(true);
+
+        std::clock_t start = std::clock();
+        stream1.scan();
+        double scan_time = elapsed_msec(start);
+
+        start = std::clock();
+        stream2.scan_dfa();
+        double dfa_time = elapsed_msec(start);
+
+        assert(stream1.size() == stream2.size());
+        printf("%8u %10u %12.2f %12.2f\n", (int)num_rules, (int)stream1.size(),
+               scan_time, dfa_time);
+    }
+}
+
+// tokens vs. compact tokens
+static void bench_compact(void)
+{
+    using namespace EBNF;
+
+    printf("compact tokens:\n");
+    printf("%8s %10s %12s %12s %12s %12s\n", "rules", "tokens",
+           "bytes", "compact", "parse(ms)", "compact(ms)");
+
+    for (size_t num_rules = 4000; num_rules <= 64000; num_rules *= 2)
+    {
+        std::string str = make_grammar(num_rules);
+        size_t bytes[2];
+        double parse_time[2];
+        size_t num_tokens = 0;
+        for (int compact = 0; compact < 2; ++compact)
+        {
+            StringScanner scanner(str.c_str(), str.size());
+            AuxInfo aux;
+            TokenStream stream(scanner, aux);
+            stream.zero_copy(true);
+            stream.compact(compact != 0);
+            stream.scan();
+            stream.fixup();
+            num_tokens = stream.size();
+
+            if (compact)
+            {
+                bytes[compact] = stream.buffer().memory();
+            }
+            else
+            {
+                bytes[compact] = stream.m_tokens.size() * sizeof(Token);
+                for (size_t i = 0; i < stream.m_tokens.size(); ++i)
+                {
+                    const Token& t = stream.m_tokens[i];
+                    if (t.m_str.capacity() >= sizeof(std::string))
+                        bytes[compact] += t.m_str.capacity() + 1;
+                }
+            }
+
+            std::clock_t start = std::clock();
+            Parser parser(stream, aux);
+            parser.parse();
+            parse_time[compact] = elapsed_msec(start);
+        }
+
+        printf("%8u %10u %12u %12u %12.2f %12.2f\n", (int)num_rules,
+               (int)num_tokens, (int)bytes[0], (int)bytes[1],
+               parse_time[0], parse_time[1]);
+    }
+}
+
+// new/delete vs. arena
+static void bench_arena(void)
+{
+    using namespace EBNF;
+
+    printf("AST allocation:\n");
+    printf("%8s %10s %12s %12s\n", "rules", "nodes", "heap(ms)", "arena(ms)");
+
+    for (size_t num_rules = 4000; num_rules <= 64000; num_rules *= 2)
+    {
+        std::string str = make_grammar(num_rules);
+        StringScanner scanner(str.c_str(), str.size());
+        AuxInfo aux;
+        TokenStream stream(scanner, aux);
+        stream.zero_copy(true);
+        stream.scan();
+        stream.fixup();
+
+        double times[2];
+        size_t num_nodes = 0;
+        for (int arena = 0; arena < 2; ++arena)
+        {
+            // parse and destroy
+            std::clock_t start = std::clock();
+            {
+                stream.index(0);
+                Parser parser(stream, aux);
+                parser.use_arena(arena != 0);
+                parser.parse();
+                if (parser.arena())
+                    num_nodes = parser.arena()->size();
+            }
+            times[arena] = elapsed_msec(start);
+        }
+
+        printf("%8u %10u %12.2f %12.2f\n", (int)num_rules, (int)num_nodes,
+               times[0], times[1]);
+    }
+}
+
+// Parser vs. ParallelParser on the threads
+static void bench_parallel(void)
+{
+    using namespace EBNF;
+
+    const size_t num_rules = 100000;
+    std::string str = make_grammar(num_rules);
+
+    printf("parallel parse of %u rules (%u hardware threads):\n",
+           (int)num_rules, (int)std::thread::hardware_concurrency());
+    printf("%8s %8s %12s %10s\n", "threads", "chunks", "wall(ms)", "speedup");
+
+    // NOTE: Every row starts from an empty atom table, so that the
+    //       threads intern the names as they would on the first parse.
+    double serial;
+    {
+        atom_table().clear();
+        wall_clock::time_point start = wall_clock::now();
+        StringScanner scanner(str.c_str(), str.size());
+        AuxInfo aux;
+        TokenStream stream(scanner, aux);
+        stream.zero_copy(true);
+        stream.scan();
+        stream.fixup();
+        Parser parser(stream, aux);
+        parser.parse();
+        serial = elapsed_wall_msec(start);
+        printf("%8s %8u %12.2f %10.2f\n", "serial", 1, serial, 1.0);
+    }
+
+    for (size_t threads = 1; threads <= 8; threads *= 2)
+    {
+        atom_table().clear();
+        wall_clock::time_point start = wall_clock::now();
+        AuxInfo aux;
+        ParallelParser parser(str.c_str(), str.size(), aux);
+        parser.thread_count(threads);
+        parser.parse();
+        const double wall = elapsed_wall_msec(start);
+        printf("%8u %8u %12.2f %10.2f\n", (int)threads, (int)parser.chunks().size(),
+               wall, serial / wall);
+    }
+}
+
+// count the rules and the identifiers
+struct CountingHandler : EBNF::EventHandler
+{
+    size_t m_rules, m_idents;
+
+    CountingHandler() : m_rules(0), m_idents(0)
+    {
+    }
+    virtual void begin_rule(EBNF::atom_type /* name */)
+    {
+        ++m_rules;
+    }
+    virtual void ident(EBNF::atom_type /* atom */)
+    {
+        ++m_idents;
+    }
+};
+
+// Parser on the whole tokens vs. EventParser on a lazy stream
+static void bench_events(void)
+{
+    using namespace EBNF;
+
+    printf("validation:\n");
+    printf("%8s %10s %12s %12s\n", "rules", "idents", "ast(ms)", "events(ms)");
+
+    for (size_t num_rules = 4000; num_rules <= 64000; num_rules *= 2)
+    {
+        std::string str = make_grammar(num_rules);
+
+        double times[2];
+        CountingHandler handler;
+        for (int events = 0; events < 2; ++events)
+        {
+            std::clock_t start = std::clock();
+            {
+                StringScanner scanner(str.c_str(), str.size());
+                AuxInfo aux;
+                TokenStream stream(scanner, aux);
+                stream.zero_copy(true);
+                stream.lazy(events != 0);
+                stream.scan();
+                if (events)
+                {
+                    EventParser parser(stream, aux, handler);
+                    parser.parse();
+                }
+                else
+                {
+                    stream.fixup();
+                    Parser parser(stream, aux);
+                    parser.parse();
+                }
+            }
+            times[events] = elapsed_msec(start);
+        }
+
+        printf("%8u %10u %12.2f %12.2f\n", (int)handler.m_rules,
+               (int)handler.m_idents, times[0], times[1]);
+    }
+}
+
+// Parser vs. LazyParser for a few rules of a large grammar
+static void bench_lazy_bodies(void)
+{
+    using namespace EBNF;
+
+    printf("lookup of 3 rules:\n");
+    printf("%8s %12s %12s\n", "rules", "full(ms)", "lazy(ms)");
+
+    for (size_t num_rules = 4000; num_rules <= 64000; num_rules *= 2)
+    {
+        std::string str = make_grammar(num_rules);
+
+        double times[2];
+        for (int lazy = 0; lazy < 2; ++lazy)
+        {
+            std::clock_t start = std::clock();
+            {
+                AuxInfo aux;
+                StringScanner scanner(str.c_str(), str.size());
+                TokenStream stream(scanner, aux);
+                Parser parser(stream, aux);
+                LazyParser lazy_parser(str.c_str(), str.size(), aux);
+                BaseAst *ast;
+                if (lazy)
+                {
+                    lazy_parser.parse();
+                    ast = lazy_parser.ast();
+                }
+                else
+                {
+                    stream.zero_copy(true);
+                    stream.scan();
+                    stream.fixup();
+                    parser.parse();
+                    ast = parser.ast();
+                }
+
+                const rules_vector *rules = ast_get_rules_vector(ast);
+                for (size_t i = 0; i < 3; ++i)
+                {
+                    const BaseAst *rule = (*rules)[i * rules->size() / 3];
+                    ast_get_rule_body(ast, ast_get_rule_atom(rule));
+                }
+            }
+            times[lazy] = elapsed_msec(start);
+        }
+
+        printf("%8u %12.2f %12.2f\n", (int)num_rules, times[0], times[1]);
+    }
+}
+
+// parse from scratch vs. EbnfDocument::edit() and ast() on a keystroke
+static void bench_document(void)
+{
+    using namespace EBNF;
+
+    printf("keystroke in the middle:\n");
+    printf("%8s %12s %14s %14s\n", "rules", "full(ms)", "edit+ast(ms)",
+           "edit+lazy(ms)");
+
+    for (size_t num_rules = 5000; num_rules <= 40000; num_rules *= 2)
+    {
+        std::string str = make_grammar(num_rules);
+        const int count = 20;
+
+        std::clock_t start = std::clock();
+        for (int i = 0; i < count; ++i)
+        {
+            StringScanner scanner(str.c_str(), str.size());
+            AuxInfo aux;
+            TokenStream stream(scanner, aux);
+            stream.zero_copy(true);
+            stream.scan();
+            stream.fixup();
+            Parser parser(stream, aux);
+            parser.parse();
+        }
+        double full = elapsed_msec(start) / count;
+
+        // ast() vs. unshifted_ast() after each edit
+        double edit[2];
+        for (int k = 0; k < 2; ++k)
+        {
+            EbnfDocument doc;
+            doc.set_text(str);
+            const size_t offset = str.size() / 2;
+            start = std::clock();
+            for (int i = 0; i < count; ++i)
+            {
+                if (i % 2)
+                    doc.edit(offset, 1, "");
+                else
+                    doc.edit(offset, 0, "x");
+                if (k == 0)
+                    doc.ast();
+                else
+                    doc.unshifted_ast();
+            }
+            edit[k] = elapsed_msec(start) / count;
+        }
+
+        printf("%8u %12.2f %14.3f %14.3f\n", (int)num_rules, full, edit[0], edit[1]);
+    }
+}
+
+// comparing the sorted clones vs. ast_compare() on the rule bodies
+static void bench_compare(void)
+{
+    using namespace EBNF;
+
+    printf("rule body comparison:\n");
+    printf("%8s %14s %14s %14s\n", "rules", "clones(ms)", "compare(ms)", "kept(ms)");
+
+    for (size_t num_rules = 4000; num_rules <= 16000; num_rules *= 2)
+    {
+        std::string str = make_grammar(num_rules);
+        StringScanner scanner(str.c_str(), str.size());
+        AuxInfo aux;
+        TokenStream stream(scanner, aux);
+        stream.zero_copy(true);
+        stream.scan();
+        stream.fixup();
+        Parser parser(stream, aux);
+        parser.parse();
+        const SeqAst *rules = parser.ast()->get_seq_ast();
+
+        // each body against the next one
+        int sign1 = 0, sign2 = 0;
+        std::clock_t start = std::clock();
+        for (size_t i = 0; i + 1 < rules->size(); ++i)
+        {
+            const BaseAst *body1 = rules->m_vec[i]->get_bin_ast()->m_right;
+            const BaseAst *body2 = rules->m_vec[i + 1]->get_bin_ast()->m_right;
+            BaseAst *sorted1 = body1->sorted_clone();
+            BaseAst *sorted2 = body2->sorted_clone();
+            sign1 += (ast_compare(sorted1, sorted2, true) < 0);
+            delete sorted1;
+            delete sorted2;
+        }
+        double clones = elapsed_msec(start);
+
+        start = std::clock();
+        for (size_t i = 0; i + 1 < rules->size(); ++i)
+        {
+            const BaseAst *body1 = rules->m_vec[i]->get_bin_ast()->m_right;
+            const BaseAst *body2 = rules->m_vec[i + 1]->get_bin_ast()->m_right;
+            sign2 += (ast_compare(body1, body2) < 0);
+        }
+        double compare = elapsed_msec(start);
+        assert(sign1 == sign2);
+
+        // again with the canonical forms kept
+        for (size_t i = 0; i < rules->size(); ++i)
+        {
+            ast_canonical(rules->m_vec[i]->get_bin_ast()->m_right);
+        }
+        int sign3 = 0;
+        start = std::clock();
+        for (size_t i = 0; i + 1 < rules->size(); ++i)
+        {
+            const BaseAst *body1 = rules->m_vec[i]->get_bin_ast()->m_right;
+            const BaseAst *body2 = rules->m_vec[i + 1]->get_bin_ast()->m_right;
+            sign3 += (ast_compare(body1, body2) < 0);
+        }
+        double kept = elapsed_msec(start);
+        assert(sign1 == sign3);
+
+        printf("%8u %14.2f %14.2f %14.2f\n", (int)num_rules, clones, compare, kept);
+    }
+}
+
+// sorted_clone() vs. ast_canonicalize_in_place() on a long token list
+static void bench_canonicalize(void)
+{
+    using namespace EBNF;
+
+    printf("token-list rule, 90%% duplicates:\n");
+    printf("%12s %14s %14s\n", "alternatives", "clone(ms)", "in-place(ms)");
+
+    for (size_t num_alts = 12500; num_alts <= 50000; num_alts *= 2)
+    {
+        std::string str = "tokens = ";
+        char buf[64];
+        for (size_t i = 0; i < num_alts; ++i)
+        {
+            std::sprintf(buf, "%s'tok%u'", (i ? " | " : ""), (int)(i % (num_alts / 10)));
+            str += buf;
+        }
+        str += ";\n";
+
+        StringScanner scanner(str.c_str(), str.size());
+        AuxInfo aux;
+        TokenStream stream(scanner, aux);
+        stream.zero_copy(true);
+        stream.scan();
+        stream.fixup();
+        Parser parser(stream, aux);
+        parser.parse();
+
+        std::clock_t start = std::clock();
+        BaseAst *sorted = parser.ast()->sorted_clone();
+        double clone = elapsed_msec(start);
+
+        BaseAst *copy = parser.ast()->clone();
+        start = std::clock();
+        ast_canonicalize_in_place(copy);
+        double in_place = elapsed_msec(start);
+        assert(ast_equal(sorted, copy, true));
+
+        printf("%12u %14.2f %14.2f\n", (int)num_alts, clone, in_place);
+        delete sorted;
+        delete copy;
+    }
+}
+
+// fresh objects per input vs. a reused ParseContext
+static void bench_context(void)
+{
+    using namespace EBNF;
+
+    printf("many small grammars:\n");
+    printf("%8s %12s %12s %14s\n", "inputs", "fresh(ms)", "reused(ms)", "reused(in/s)");
+
+    for (size_t num_inputs = 25000; num_inputs <= 100000; num_inputs *= 2)
+    {
+        std::vector<std::string> inputs(num_inputs);
+        char buf[256];
+        for (size_t i = 0; i < num_inputs; ++i)
+        {
+            std::sprintf(buf,
+                "rule%u = first word, 'a' | [second%u], {third};\n"
+                "second%u = (* note *) 'b' | 3 * 'c';\n",
+                (int)i, (int)i, (int)i);
+            inputs[i] = buf;
+        }
+
+        size_t ok = 0;
+        std::clock_t start = std::clock();
+        for (size_t i = 0; i < num_inputs; ++i)
+        {
+            StringScanner scanner(inputs[i]);
+            AuxInfo aux;
+            TokenStream stream(scanner, aux);
+            if (stream.scan())
+            {
+                stream.fixup();
+                Parser parser(stream, aux);
+                ok += parser.parse();
+            }
+        }
+        double fresh = elapsed_msec(start);
+
+        ParseContext context;
+        start = std::clock();
+        for (size_t i = 0; i < num_inputs; ++i)
+        {
+            context.reset(inputs[i].c_str(), inputs[i].size());
+            ok -= context.parse();
+        }
+        double reused = elapsed_msec(start);
+        assert(ok == 0);
+
+        printf("%8u %12.2f %12.2f %14.0f\n", (int)num_inputs, fresh, reused,
+               reused > 0 ? num_inputs * 1000.0 / reused : 0.0);
+    }
+}
+
+// ast_add_rule() vs. RuleIndex on the rule bodies of a grammar
+static void bench_hash_cons(void)
+{
+    using namespace EBNF;
+
+    printf("adding rule bodies, 75%% duplicates:\n");
+    printf("%8s %12s %14s %12s %12s\n",
+           "rules", "nodes", "shared nodes", "linear(ms)", "hashed(ms)");
+
+    for (size_t num_rules = 2000; num_rules <= 8000; num_rules *= 2)
+    {
+        std::string str;
+        char buf[256];
+        for (size_t i = 0; i < num_rules; ++i)
+        {
+            const int k = (int)(i % (num_rules / 4));
+            std::sprintf(buf, "rule%u = first word%u, ('a' | second) | [third, 'a'];\n",
+                         (int)i, k);
+            str += buf;
+        }
+        StringScanner scanner(str.c_str(), str.size());
+        AuxInfo aux;
+        TokenStream stream(scanner, aux);
+        stream.zero_copy(true);
+        stream.scan();
+        stream.fixup();
+        Parser parser(stream, aux);
+        parser.use_arena(true);
+        parser.parse();
+        const SeqAst *input = parser.ast()->get_seq_ast();
+
+        SeqAst *rules1 = new SeqAst(SEQ_RULES);
+        std::clock_t start = std::clock();
+        for (size_t i = 0; i < input->size(); ++i)
+        {
+            std::string name = ast_get_rule_name(input->m_vec[i]);
+            ast_add_rule(rules1, name, input->m_vec[i]->get_bin_ast()->m_right);
+        }
+        double linear = elapsed_msec(start);
+
+        SeqAst *rules2 = new SeqAst(SEQ_RULES);
+        start = std::clock();
+        {
+            RuleIndex index(rules2);
+            for (size_t i = 0; i < input->size(); ++i)
+            {
+                std::string name = ast_get_rule_name(input->m_vec[i]);
+                ast_add_rule(index, name, input->m_vec[i]->get_bin_ast()->m_right);
+            }
+            double hashed = elapsed_msec(start);
+            assert(rules1->size() == rules2->size());
+
+            printf("%8u %12u %14u %12.2f %12.2f\n", (int)num_rules,
+                   (int)parser.arena()->size(), (int)index.factory().size(),
+                   linear, hashed);
+        }
+        delete rules1;
+        delete rules2;
+    }
+}
+
+// the digests of the rules in one pass vs. the sorted clones
+static void bench_digest(void)
+{
+    using namespace EBNF;
+
+    printf("grammar digest:\n");
+    printf("%8s %14s %12s %14s\n", "rules", "clones(ms)", "digest(ms)", "digest(r/s)");
+
+    for (size_t num_rules = 10000; num_rules <= 40000; num_rules *= 2)
+    {
+        std::string str = make_grammar(num_rules);
+        StringScanner scanner(str.c_str(), str.size());
+        AuxInfo aux;
+        TokenStream stream(scanner, aux);
+        stream.zero_copy(true);
+        stream.scan();
+        stream.fixup();
+        Parser parser(stream, aux);
+        parser.parse();
+
+        std::clock_t start = std::clock();
+        BaseAst *sorted = parser.ast()->sorted_clone();
+        double clones = elapsed_msec(start);
+        delete sorted;
+
+        std::vector<AstDigest> digests;
+        start = std::clock();
+        ast_digest(parser.ast(), digests);
+        double digest = elapsed_msec(start);
+        assert(digests.size() == num_rules);
+
+        printf("%8u %14.2f %12.2f %14.0f\n", (int)num_rules, clones, digest,
+               num_rules * 1000.0 / (digest > 0 ? digest : 1));
+    }
+}
+
+int main(void)
+{
+    bench_fixup();
+    bench_lexers();
+    bench_compact();
+    bench_arena();
+    bench_parallel();
+    bench_events();
+    bench_lazy_bodies();
+    bench_document();
+    bench_context();
+    bench_compare();
+    bench_canonicalize();
+    bench_hash_cons();
+    bench_digest();
+    return 0;
+}
@@ -3,6 +3,9 @@
 /////////////////////////////////////////////////////////////////////////
 
 #include "EBNF.hpp"
+#include "flat_ast.hpp"
+#include "hash_cons.hpp"
+#include "ast_digest.hpp"
 #include <cstdio>       // for std::puts
 
 static int g_num_executions = 0;       // number of test executions
@@ -43,6 +46,17 @@ static const COMPARE_TEST_ENTRY g_test_entries[] =
     { 15, TR_EQUAL, "expr = ((((a))));", "expr = a;" },
     { 16, TR_EQUAL, "d = (((a) | b) | c);", "d = a | b | c;" },
     { 17, TR_EQUAL, "d = (((a), b), c);", "d = a, b, c;" },
+    { 18, TR_EQUAL, "a b = x y;", "a  b = (x\ty);" },
+    { 19, TR_EQUAL, "s = 'abc';", "s = \"abc\";" },
+    { 20, TR_LESS_THAN, "s = 'abc';", "s = 'abd';" },
+    { 21, TR_GREATER_THAN, "s = x z;", "s = x y;" },
+    { 22, TR_EQUAL, "a = [b | c], {d | (e | f)};", "a = [c | b], {(f | e) | d};" },
+    { 23, TR_LESS_THAN, "a = [b | c];", "a = [b | d];" },
+    { 24, TR_EQUAL, "a = x - (y | z);", "a = x - (z | y);" },
+    { 25, TR_GREATER_THAN, "a = 3 * (c | d);", "a = 3 * (d | b);" },
+    { 26, TR_EQUAL, "a = x, ((b | c)) | ((y));", "a = y | x, (c | b) | y;" },
+    { 27, TR_GREATER_THAN, "a = (b | b), c;", "a = (b), c;" },
+    { 28, TR_EQUAL, "a = x - (y | z) | 2 * [b];", "a = 2 * [b] | x - (z | y);" },
 };
 
 static EBNF::SeqAst *do_parse(const std::string& str)
@@ -73,6 +87,13 @@ static EBNF::SeqAst *do_parse(const std::string& str)
     return NULL;
 }
 
+static std::string to_dbg_str(const EBNF::BaseAst *ast)
+{
+    EBNF::os_type os;
+    ast->to_dbg(os);
+    return os.str();
+}
+
 static COMPARE_TEST_RETURN just_do_it(const COMPARE_TEST_ENTRY *entry)
 {
     using namespace EBNF;
@@ -108,6 +129,71 @@ static COMPARE_TEST_RETURN just_do_it(const COMPARE_TEST_ENTRY *entry)
     puts(os.str().c_str());
 #endif
 
+    // the flat ASTs of the sorted clones must compare as ast_equal
+    {
+        BaseAst *s1 = seq1->sorted_clone();
+        BaseAst *s2 = seq2->sorted_clone();
+        FlatAst flat1(s1), flat2(s2);
+        if (flat_equal(flat1, flat2) != ast_equal(seq1, seq2))
+        {
+            printf("#%d: FAILED: flat_equal differs from ast_equal\n",
+                   entry->entry_number);
+            ++g_num_failures;
+        }
+
+        // canonicalizing in place must give the sorted clones
+        BaseAst *c1 = seq1->clone();
+        BaseAst *c2 = seq2->clone();
+        ast_canonicalize_in_place(c1);
+        ast_canonicalize_in_place(c2);
+        if (to_dbg_str(c1) != to_dbg_str(s1) || to_dbg_str(c2) != to_dbg_str(s2))
+        {
+            printf("#%d: FAILED: ast_canonicalize_in_place differs\n",
+                   entry->entry_number);
+            ++g_num_failures;
+        }
+        delete c1;
+        delete c2;
+
+        // the hash-consed forms must be the sorted clones, shared if equal
+        HashConsFactory factory;
+        const BaseAst *h1 = factory.intern(seq1);
+        const BaseAst *h2 = factory.intern(seq2);
+        if (to_dbg_str(h1) != to_dbg_str(s1) || to_dbg_str(h2) != to_dbg_str(s2) ||
+            (h1 == h2) != ast_equal(seq1, seq2) ||
+            (h1 == h2 && factory.hash(h1) != factory.hash(h2)))
+        {
+            printf("#%d: FAILED: HashConsFactory differs\n", entry->entry_number);
+            ++g_num_failures;
+        }
+
+        // the digests must be equal if ast_equal
+        std::vector<AstDigest> rule_digests1, rule_digests2;
+        const AstDigest digest1 = ast_digest(seq1, rule_digests1);
+        const AstDigest digest2 = ast_digest(seq2, rule_digests2);
+        if ((digest1 == digest2) != ast_equal(seq1, seq2) ||
+            rule_digests1.size() != seq1->size() ||
+            rule_digests1[0] != ast_digest(seq1->m_vec[0]))
+        {
+            printf("#%d: FAILED: ast_digest differs\n", entry->entry_number);
+            ++g_num_failures;
+        }
+
+        // ast_compare must agree with itself and with the sorted clones
+        const int cmp = ast_compare(seq1, seq2);
+        const int sorted_cmp = ast_compare(s1, s2, true);
+        const int reversed_cmp = ast_compare(seq2, seq1);
+        if ((cmp < 0) != (sorted_cmp < 0) || (cmp > 0) != (sorted_cmp > 0) ||
+            (cmp < 0) != (reversed_cmp > 0) || (cmp > 0) != (reversed_cmp < 0) ||
+            (cmp > 0) != ast_greater_than(seq1, seq2))
+        {
+            printf("#%d: FAILED: ast_compare is inconsistent\n", entry->entry_number);
+            ++g_num_failures;
+        }
+        delete s1;
+        delete s2;
+    }
+
     COMPARE_TEST_RETURN ret;
     if (ast_equal(seq1, seq2))
         ret = TR_EQUAL;
@@ -137,6 +223,282 @@ static bool do_test_entry(const COMPARE_TEST_ENTRY *entry)
     return !failed;
 }
 
+// the canonical forms kept in the nodes follow the changes
+static bool do_canonical_test(void)
+{
+    using namespace EBNF;
+
+    SeqAst *rules = do_parse("a = b | (c | d), [e | f]; g = x;");
+    assert(rules);
+    BaseAst *body = ast_get_rule_body(rules, "a");
+    bool failed = false;
+
+    const BaseAst *canonical = ast_canonical(body);
+    const std::string before = to_dbg_str(ast_canonical(rules));
+    BaseAst *sorted = body->sorted_clone();
+    if (ast_canonical(body) != canonical || to_dbg_str(canonical) != to_dbg_str(sorted))
+        failed = true;
+    if (ast_compare(body, sorted) != 0)
+        failed = true;
+    delete sorted;
+
+    // a body already in the form is its own
+    BaseAst *x_body = ast_get_rule_body(rules, "g");
+    if (ast_canonical(x_body) != x_body)
+        failed = true;
+
+    // a change by push_back
+    UnaryAst *optional = body->get_expr()->m_vec[1]->get_terms()->m_vec[1]->get_optional();
+    assert(optional);
+    SeqAst *terms = optional->m_arg->get_expr()->m_vec[0]->get_terms();
+    terms->push_back(new IdentAst("z"));
+    sorted = rules->sorted_clone();
+    const std::string after = to_dbg_str(ast_canonical(rules));
+    if (after == before || after != to_dbg_str(sorted))
+        failed = true;
+    if (to_dbg_str(ast_canonical(body)).find("z") == std::string::npos)
+        failed = true;
+    delete sorted;
+
+    // a change by set_right
+    BinaryAst *g_rule = rules->m_vec[1]->get_bin_ast();
+    assert(g_rule);
+    delete g_rule->set_right(body->clone());
+    sorted = rules->sorted_clone();
+    if (to_dbg_str(ast_canonical(rules)) != to_dbg_str(sorted))
+        failed = true;
+    delete sorted;
+
+    // a change by hand, told by ast_modified()
+    optional->m_type = UNARY_REPEATED;
+    ast_modified(optional);
+    sorted = rules->sorted_clone();
+    if (to_dbg_str(ast_canonical(rules)) != to_dbg_str(sorted))
+        failed = true;
+    delete sorted;
+
+    // unique() on an empty sequence
+    SeqAst empty_expr(SEQ_EXPR);
+    empty_expr.unique();
+    if (empty_expr.size() != 0)
+        failed = true;
+
+    // ast_add_rule() finds an equal body
+    SeqAst *other = do_parse("h = f | e z;");
+    assert(other);
+    const BaseAst *expr = ast_get_rule_body(other, "h");
+    std::string name = "h";
+    ast_add_rule(rules, name, expr);
+    if (name != "h" || rules->size() != 3)
+        failed = true;
+    name = "h";
+    ast_add_rule(rules, name, expr);
+    if (name != "h" || rules->size() != 3)
+        failed = true;
+    delete other;
+
+    // the forms kept by ast_add_rule() follow the changes
+    SeqAst *grammar = do_parse("a = 'x' | 'y'; b = 'z';");
+    SeqAst *yx = do_parse("c = 'y' | 'x';");
+    assert(grammar && yx);
+    const BaseAst *yx_body = ast_get_rule_body(yx, "c");
+    name = "c";
+    ast_add_rule(grammar, name, yx_body);
+    if (name != "a" || grammar->size() != 2)
+        failed = true;
+    SeqAst *alts = ast_get_rule_body(grammar, "a")->get_expr();
+    alts->erase(alts->size() - 1, alts->size());
+    name = "c";
+    ast_add_rule(grammar, name, yx_body);
+    if (name != "c" || grammar->size() != 3 ||
+        ast_equal(ast_get_rule_body(grammar, "a"), yx_body))
+    {
+        failed = true;
+    }
+    delete grammar;
+
+    // a change by hand, told by ast_modified()
+    grammar = do_parse("a = 'y' | 'x' | 'w';");
+    assert(grammar);
+    alts = ast_get_rule_body(grammar, "a")->get_expr();
+    if (ast_canonical(alts) == alts)
+        failed = true;
+    delete alts->m_vec.back();
+    alts->m_vec.pop_back();
+    ast_modified(alts);
+    name = "c";
+    ast_add_rule(grammar, name, yx_body);
+    if (name != "a" || grammar->size() != 1)
+        failed = true;
+    delete grammar;
+    delete yx;
+
+    if (failed)
+    {
+        printf("canonical: FAILED\n");
+        ++g_num_failures;
+    }
+    ++g_num_executions;
+    delete rules;
+    return !failed;
+}
+
+// the hash-consed nodes are shared, and RuleIndex adds as ast_add_rule()
+static bool do_hash_cons_test(void)
+{
+    using namespace EBNF;
+
+    bool failed = false;
+    HashConsFactory factory;
+
+    const BaseAst *a = factory.make_ident(atom_table().intern_name("a", 1));
+    const BaseAst *b = factory.make_string(atom_table().intern("b"));
+    const BaseAst *empty = factory.make_string(atom_table().intern(""));
+    if (factory.make_ident(atom_table().intern_name("a", 1)) != a ||
+        empty != factory.make_empty() || factory.size() != 3)
+    {
+        failed = true;
+    }
+
+    // the order and the duplicates of the alternatives do not matter
+    std::vector<const BaseAst *> alts;
+    alts.push_back(factory.make_seq(SEQ_TERMS, std::vector<const BaseAst *>(1, a)));
+    alts.push_back(factory.make_seq(SEQ_TERMS, std::vector<const BaseAst *>(1, b)));
+    const BaseAst *expr1 = factory.make_seq(SEQ_EXPR, alts);
+    alts.push_back(alts[0]);
+    std::swap(alts[0], alts[1]);
+    const BaseAst *expr2 = factory.make_seq(SEQ_EXPR, alts);
+    if (expr1 != expr2 || expr1->get_seq_ast()->size() != 2)
+        failed = true;
+    if (factory.make_unary(UNARY_OPTIONAL, expr1) != factory.make_unary(UNARY_OPTIONAL, expr2))
+        failed = true;
+
+    // the same subtrees are made once
+    SeqAst *rules = do_parse("r1 = x, [y | z]; r2 = [z | y], x | w; r3 = x, [y | (z)];");
+    assert(rules);
+    const size_t before = factory.size();
+    const BaseAst *body1 = factory.intern(ast_get_rule_body(rules, "r1"));
+    const size_t made = factory.size() - before;
+    const BaseAst *body2 = factory.intern(ast_get_rule_body(rules, "r2"));
+    const BaseAst *body3 = factory.intern(ast_get_rule_body(rules, "r3"));
+    if (body1 != body3 || body1 == body2 || factory.size() - before != made + 4)
+        failed = true;
+
+    // RuleIndex finds the same names as ast_add_rule()
+    SeqAst *other = do_parse("n = x, [z | y]; n = w | x, [y | z]; n = v; n = v;");
+    assert(other);
+    SeqAst *copy = static_cast<SeqAst *>(rules->clone());
+    RuleIndex index(copy);
+    for (size_t i = 0; i < other->size(); ++i)
+    {
+        const BaseAst *expr = other->m_vec[i]->get_bin_ast()->m_right;
+        std::string name1 = "r1", name2 = "r1";
+        ast_add_rule(rules, name1, expr);
+        ast_add_rule(index, name2, expr);
+        if (name1 != name2)
+            failed = true;
+    }
+    if (to_dbg_str(rules) != to_dbg_str(copy) || rules->size() != 5)
+        failed = true;
+    delete other;
+    delete copy;
+    delete rules;
+
+    if (failed)
+    {
+        printf("hash cons: FAILED\n");
+        ++g_num_failures;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+// flat_equal() keeps the order of the alternatives, and the specials
+// stay out of the atom table
+static bool do_flat_test(void)
+{
+    using namespace EBNF;
+
+    bool failed = false;
+    SeqAst *rules1 = do_parse("a = ? flat special ? | b, 2 * c;");
+    SeqAst *rules2 = do_parse("a = b, 2 * c | ? flat special ?;");
+    assert(rules1 && rules2);
+
+    FlatAst flat1(rules1), flat2(rules2);
+    if (flat_equal(flat1, flat2) || !ast_equal(rules1, rules2) ||
+        flat_equal(flat1, flat2) != ast_equal(rules1, rules2, true))
+    {
+        failed = true;
+    }
+
+    BaseAst *sorted1 = rules1->sorted_clone();
+    BaseAst *sorted2 = rules2->sorted_clone();
+    FlatAst flat3(sorted1), flat4(sorted2);
+    if (!flat_equal(flat3, flat4))
+        failed = true;
+
+    if (flat1.m_specials.size() != 1 || flat1.m_specials[0] != " flat special " ||
+        atom_table().find(" flat special ") != ATOM_NONE)
+    {
+        failed = true;
+    }
+    BaseAst *back = flat1.to_ast();
+    if (!ast_equal(back, rules1, true))
+        failed = true;
+
+    if (failed)
+    {
+        printf("flat: FAILED\n");
+        ++g_num_failures;
+    }
+    ++g_num_executions;
+    delete back;
+    delete sorted1;
+    delete sorted2;
+    delete rules1;
+    delete rules2;
+    return !failed;
+}
+
+// the digests are stable, and follow the rules wherever they are
+static bool do_digest_test(void)
+{
+    using namespace EBNF;
+
+    bool failed = false;
+    SeqAst *rules1 = do_parse("a = b | c, \"d\" | ? e ? | 3 * {f - g} | [(h)]; x = y;");
+    SeqAst *rules2 = do_parse("x = y; a = [h] | ? e ? | c, 'd' | 3 * {f - g} | b | b;");
+    assert(rules1 && rules2);
+
+    // NOTE: A change of this value breaks the digests stored.
+    std::vector<AstDigest> digests1, digests2;
+    const AstDigest digest1 = ast_digest(rules1, digests1);
+    const AstDigest digest2 = ast_digest(rules2, digests2);
+    if (digests1[0].str() != "eacaf2d16e5fd0b635f62a34e49cd5a8")
+        failed = true;
+    if (digests1[0] != digests2[1] || digests1[1] != digests2[0] || digest1 == digest2)
+        failed = true;
+
+    // a change of a rule
+    rules2->m_vec[0]->get_bin_ast()->m_right->get_expr()->push_back(
+        new SeqAst(SEQ_TERMS, new IdentAst("z")));
+    if (ast_digest(rules2->m_vec[0]) == digests2[0] ||
+        ast_digest(rules2->m_vec[1]) != digests2[1])
+    {
+        failed = true;
+    }
+
+    if (failed)
+    {
+        printf("digest: FAILED\n");
+        ++g_num_failures;
+    }
+    ++g_num_executions;
+    delete rules1;
+    delete rules2;
+    return !failed;
+}
+
 int main(void)
 {
     size_t count = sizeof(g_test_entries) / sizeof(g_test_entries[0]);
@@ -144,6 +506,10 @@ int main(void)
     {
         do_test_entry(&g_test_entries[i]);
     }
+    do_canonical_test();
+    do_hash_cons_test();
+    do_flat_test();
+    do_digest_test();
 
     printf("executions %d, failures %d\n", g_num_executions, g_num_failures);
     if (g_num_failures == 0)
@@ -3,6 +3,13 @@
 /////////////////////////////////////////////////////////////////////////
 
 #include "EBNF.hpp"
+#include "flat_ast.hpp"
+#include "parallel_parser.hpp"
+#include "push_parser.hpp"
+#include "event_parser.hpp"
+#include "lazy_parser.hpp"
+#include "ebnf_document.hpp"
+#include "mapped_file.hpp"
 #include <cstdio>       // for std::puts
 
 static int g_num_executions = 0;       // number of test executions
@@ -15,6 +22,17 @@ enum PARSE_TEST_RETURN
     TR_PARSE_FAIL,
 };
 
+// how the tokens and the AST are stored
+enum PARSE_TEST_MODE
+{
+    TM_OWNED = 0,
+    TM_ZERO_COPY,
+    TM_LAZY,
+    TM_COMPACT,
+    TM_ARENA,
+    TM_ITERATIVE
+};
+
 struct PARSE_TEST_ENTRY
 {
     int entry_number;       // #
@@ -115,14 +133,17 @@ static const PARSE_TEST_ENTRY g_test_entries[] =
 };
 
 static PARSE_TEST_RETURN
-just_do_it(const std::string& str, size_t& num_rules)
+just_do_it(const std::string& str, size_t& num_rules, PARSE_TEST_MODE mode)
 {
     using namespace EBNF;
 
-    StringScanner scanner(str);
+    StringScanner scanner(str.c_str(), str.size());
 
     AuxInfo aux;
     TokenStream stream(scanner, aux);
+    stream.zero_copy(mode != TM_OWNED);
+    stream.lazy(mode == TM_LAZY);
+    stream.compact(mode == TM_COMPACT);
 
     PARSE_TEST_RETURN ret = TR_SCAN_FAIL;
     os_type os;
@@ -136,6 +157,8 @@ just_do_it(const std::string& str, size_t& num_rules)
         stream.to_dbg(os);
 
         Parser parser(stream, aux);
+        parser.use_arena(mode == TM_ARENA);
+        parser.iterative(mode == TM_ITERATIVE);
         if (parser.parse())
         {
             ret = TR_SUCCESS;
@@ -151,6 +174,50 @@ just_do_it(const std::string& str, size_t& num_rules)
                 SeqAst *seq = static_cast<SeqAst *>(ast);
                 num_rules = seq->size();
             }
+
+            // the flat AST must print the same and convert back
+            FlatAst flat(ast);
+            os_type os1, os2;
+            ast->to_ebnf(os1);
+            flat.to_ebnf(os2);
+            BaseAst *back = flat.to_ast();
+            if (os1.str() != os2.str() || !ast_equal(ast, back, true))
+                ret = TR_PARSE_FAIL;
+            delete back;
+
+            // canonicalizing a copy in place must give sorted_clone()
+            if (mode == TM_OWNED || mode == TM_ARENA)
+            {
+                AstArena arena;
+                BaseAst *copy = ast->clone(mode == TM_ARENA ? &arena : NULL);
+                BaseAst *sorted = ast->sorted_clone();
+                ast_canonicalize_in_place(copy);
+                os_type os3, os4;
+                copy->to_dbg(os3);
+                sorted->to_dbg(os4);
+                if (os3.str() != os4.str())
+                    ret = TR_PARSE_FAIL;
+                ast_delete(copy);
+                delete sorted;
+            }
+
+            if (mode == TM_ARENA)
+            {
+                // clone into another arena, then detach the tree
+                AstArena arena;
+                BaseAst *copy = ast->sorted_clone(&arena);
+                AstTree tree = parser.detach_tree();
+                if (copy->m_arena != &arena || tree.get() != ast ||
+                    !ast_equal(tree.get(), copy))
+                {
+                    ret = TR_PARSE_FAIL;
+                }
+            }
+        }
+        else if (stream.failed())
+        {
+            // a lazy stream finds the scan errors while parsing
+            ret = TR_SCAN_FAIL;
         }
     }
     aux.err_out(os);
@@ -161,22 +228,407 @@ just_do_it(const std::string& str, size_t& num_rules)
     return ret;
 }
 
-static bool do_test_entry(const PARSE_TEST_ENTRY *entry)
+static bool same_tokens(const EBNF::TokenStream& s1, const EBNF::TokenStream& s2)
+{
+    if (s1.size() != s2.size())
+        return false;
+
+    for (size_t i = 0; i < s1.size(); ++i)
+    {
+        const EBNF::Token t1 = s1.at(i);
+        const EBNF::Token t2 = s2.at(i);
+        if (t1.m_type != t2.m_type || t1.str() != t2.str() ||
+            t1.m_integer != t2.m_integer || t1.m_line != t2.m_line ||
+            t1.m_begin != t2.m_begin || t1.m_end != t2.m_end)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// extra inputs for the lexers
+static const char * const g_lexer_inputs[] =
+{
+    "(*)*)", "(**)", "(***)", "(* a *", "a(b)c", "x = (", "(", "'a'\"b\"",
+    "12ab", "a-b- c", "a--1", "?", "??", "? a", "\"'\"", "'\"'", "\xE9",
+    "a = b\n; c = 'd\ne';\r\n", "*)", "12 * 3", "", "a = bc", "a = 12", "a = 'x",
+    "a = 12345678901 * \"b\";",
+};
+
+// scan_dfa must be equivalent to scan
+static bool do_dfa_test(int entry_number, const char *input)
 {
+    using namespace EBNF;
+
+    std::string str = input;
+    StringScanner scanner1(str), scanner2(str);
+    AuxInfo aux1, aux2;
+    TokenStream stream1(scanner1, aux1), stream2(scanner2, aux2);
+
+    bool ret1 = stream1.scan();
+    bool ret2 = stream2.scan_dfa();
+
     bool failed = false;
-    size_t num_rules = 0;
-    PARSE_TEST_RETURN ret = just_do_it(entry->input, num_rules);
-    if (ret != entry->ret)
+    if (ret1 != ret2 || aux1.m_errors.size() != aux2.m_errors.size() ||
+        !same_tokens(stream1, stream2))
     {
-        printf("#%d: FAILED: ret expected %d, got %d\n", entry->entry_number, entry->ret, ret);
+        failed = true;
+    }
+
+    // a scan again starts at the first token
+    stream2.next();
+    scanner2.index(0);
+    if (stream2.scan_dfa() != ret2 || stream2.index() != 0 ||
+        !same_tokens(stream1, stream2))
+    {
+        failed = true;
+    }
+
+    // lazy mode pulls the tokens that fixup() leaves
+    StringScanner scanner3(str);
+    AuxInfo aux3;
+    TokenStream stream3(scanner3, aux3);
+    stream3.lazy(true);
+    if (stream3.scan_dfa() && ret1)
+    {
+        stream1.fixup();
+        for (size_t i = 0; i < stream1.size(); ++i, stream3.next())
+        {
+            const Token t1 = stream1.at(i);
+            if (stream3.type() != t1.m_type || stream3.str() != t1.str())
+                failed = true;
+        }
+    }
+
+    if (failed)
+    {
+        printf("#%d: FAILED: scan_dfa differs from scan\n", entry_number);
+        ++g_num_failures;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+// scans and parses data[0, size) in a mode, and prints the result
+static std::string
+scan_and_parse(const char *data, size_t size, PARSE_TEST_MODE mode, bool dfa)
+{
+    using namespace EBNF;
+
+    StringScanner scanner(data, size);
+    AuxInfo aux;
+    TokenStream stream(scanner, aux);
+    stream.zero_copy(mode != TM_OWNED);
+    stream.compact(mode == TM_COMPACT);
+
+    os_type os;
+    bool ret = (dfa ? stream.scan_dfa() : stream.scan());
+    if (ret)
+    {
+        stream.fixup();
+        stream.to_dbg(os);
+        Parser parser(stream, aux);
+        parser.use_arena(mode == TM_ARENA);
+        parser.iterative(mode == TM_ITERATIVE);
+        ret = parser.parse();
+        if (ret)
+            parser.ast()->to_ebnf(os);
+    }
+    os << ret << std::endl;
+    aux.err_out(os);
+    return os.str();
+}
+
+// a buffer that is not NUL-terminated is read up to its size only
+static bool do_unterminated_test(int entry_number, const char *input)
+{
+    std::string str = input;
+    const size_t size = str.size();
+
+    bool failed = false;
+    for (int mode = TM_OWNED; mode <= TM_ITERATIVE; ++mode)
+    {
+        if (mode == TM_LAZY)
+            continue;
+        for (int dfa = 0; dfa <= 1; ++dfa)
+        {
+            // the exact size on the heap, for the address sanitizer
+            char *buf = new char[size ? size : 1];
+            memcpy(buf, str.data(), size);
+            std::string text1 = scan_and_parse(buf, size, PARSE_TEST_MODE(mode), !!dfa);
+            delete[] buf;
+
+            std::string text2 = scan_and_parse(str.c_str(), size, PARSE_TEST_MODE(mode), !!dfa);
+            if (text1 != text2)
+                failed = true;
+        }
+    }
+
+    if (failed)
+    {
+        printf("#%d: FAILED: unterminated buffer differs\n", entry_number);
         ++g_num_failures;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+// a regular file is mapped, and a pipe is read
+static bool do_mapped_test(void)
+{
+    using namespace EBNF;
+
+    bool failed = false;
+    std::string str = "a = b, 'c';\r\nd = (* e *) {a} | ? f ?;\n";
+    const char *filename = "EbnfParseTest.tmp";
+    if (FILE *fp = fopen(filename, "wb"))
+    {
+        fwrite(str.data(), 1, str.size(), fp);
+        fclose(fp);
+    }
+
+    {
+        MappedFile mapped(filename);
+        if (!mapped.is_open() || !mapped.is_mapped() || mapped.size() != str.size() ||
+            scan_and_parse(mapped.data(), mapped.size(), TM_ZERO_COPY, false) !=
+            scan_and_parse(str.c_str(), str.size(), TM_ZERO_COPY, false))
+        {
+            failed = true;
+        }
+    }
+    remove(filename);
+
+    {
+        // an empty file
+        if (FILE *fp = fopen(filename, "wb"))
+            fclose(fp);
+        MappedFile mapped(filename);
+        if (!mapped.is_open() || mapped.is_mapped() || mapped.size() != 0)
+            failed = true;
+        remove(filename);
+    }
+
+#ifndef _WIN32
+    if (mkfifo(filename, 0600) == 0)
+    {
+        std::thread writer([&]() {
+            if (FILE *fp = fopen(filename, "wb"))
+            {
+                fwrite(str.data(), 1, str.size(), fp);
+                fclose(fp);
+            }
+        });
+        MappedFile piped(filename);
+        writer.join();
+        if (!piped.is_open() || piped.is_mapped() ||
+            std::string(piped.data(), piped.size()) != str)
+        {
+            failed = true;
+        }
+        remove(filename);
+    }
+    else
+    {
         failed = true;
     }
+#endif
+
+    if (failed)
+    {
+        printf("mapped file: FAILED\n");
+        ++g_num_failures;
+    }
     ++g_num_executions;
-    if (num_rules != entry->num_rules)
+    return !failed;
+}
+
+// the compact tokens must be equivalent to the tokens
+static bool do_compact_test(int entry_number, const char *input)
+{
+    using namespace EBNF;
+
+    std::string str = input;
+    StringScanner scanner1(str), scanner2(str);
+    AuxInfo aux1, aux2;
+    TokenStream stream1(scanner1, aux1), stream2(scanner2, aux2);
+    stream2.compact(true);
+
+    bool ret1 = stream1.scan();
+    bool ret2 = stream2.scan();
+    stream1.fixup();
+    stream2.fixup();
+
+    bool failed = false;
+    if (ret1 != ret2 || !same_tokens(stream1, stream2))
+        failed = true;
+
+    // the copies don't alias, and the atoms and the positions are kept
+    for (size_t i = 0; i + 1 < stream2.size(); ++i)
     {
-        printf("#%d: FAILED: num_rules expected %u, got %u\n",
-               entry->entry_number, (int)entry->num_rules, (int)num_rules);
+        Token t1 = stream2.at(i), t2 = stream2.at(i + 1);
+        stream1.index(i);
+        stream2.index(i);
+        const atom_type atom = stream2.atom();
+        if (t1.m_begin == t2.m_begin || t1.str() != stream1[i].str() ||
+            stream2.buffer().atom(i) != atom || stream2.atom() != atom ||
+            stream2.at(i).m_atom != atom || stream1.atom() != atom ||
+            stream2.token_line() != stream1.token().m_line ||
+            stream2.token_column() != stream1.get_column(stream1.token()))
+        {
+            failed = true;
+        }
+    }
+
+    // operator[] and token() unpack the tokens
+    const size_t size = stream2.size();
+    if (size && (stream2[size - 1].str() != stream1[size - 1].str() ||
+                 stream2.compact() || stream2.size() != size ||
+                 !same_tokens(stream1, stream2) ||
+                 &stream2.token() != &stream2[stream2.index()]))
+    {
+        failed = true;
+    }
+
+    if (failed)
+    {
+        printf("#%d: FAILED: compact tokens differ\n", entry_number);
+        ++g_num_failures;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+// fixup(true) keeps the comments with their offsets in every mode
+static bool do_trivia_test(void)
+{
+    using namespace EBNF;
+
+    static const struct
+    {
+        const char *text;
+        size_t line, begin, end;
+    } s_comments[] =
+    {
+        { " head ", 1, 0, 10 },
+        { "", 2, 23, 27 },
+        { " tail\nx ", 2, 34, 46 },
+    };
+    const size_t count = sizeof(s_comments) / sizeof(s_comments[0]);
+
+    bool failed = false;
+    std::string str = "(* head *) ab cd = e;\r\n(**) f = g (* tail\nx *);";
+    for (int mode = TM_OWNED; mode <= TM_COMPACT; ++mode)
+    {
+        StringScanner scanner(str);
+        AuxInfo aux;
+        TokenStream stream(scanner, aux);
+        stream.zero_copy(mode != TM_OWNED);
+        stream.compact(mode == TM_COMPACT);
+        if (!stream.scan())
+        {
+            failed = true;
+            continue;
+        }
+        stream.fixup(true);
+
+        if (stream.m_comments.size() != count)
+        {
+            failed = true;
+            continue;
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            const Token& t = stream.m_comments[i];
+            if (t.m_type != TOK_COMMENT || t.str() != s_comments[i].text ||
+                t.m_line != s_comments[i].line ||
+                t.m_begin != s_comments[i].begin ||
+                t.m_end != s_comments[i].end)
+            {
+                failed = true;
+            }
+        }
+
+        // the rest are the words joined and the symbols
+        os_type os;
+        stream.to_dbg(os);
+        if (stream.size() != 9 ||
+            os.str().find("[TOKEN: 0, 'ab-cd']") != 0 ||
+            os.str().find("TOKEN: 4") != std::string::npos)
+        {
+            failed = true;
+        }
+    }
+
+    if (failed)
+    {
+        printf("trivia: FAILED\n");
+        ++g_num_failures;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+static void get_spans(std::vector<size_t>& spans, const EBNF::BaseAst *ast)
+{
+    using namespace EBNF;
+
+    spans.push_back(ast->m_begin);
+    spans.push_back(ast->m_end);
+    if (const UnaryAst *unary = ast->get_unary_ast())
+    {
+        get_spans(spans, unary->m_arg);
+    }
+    else if (const BinaryAst *bin = ast->get_bin_ast())
+    {
+        get_spans(spans, bin->m_left);
+        get_spans(spans, bin->m_right);
+    }
+    else if (const SeqAst *seq = ast->get_seq_ast())
+    {
+        for (size_t i = 0; i < seq->size(); ++i)
+            get_spans(spans, seq->m_vec[i]);
+    }
+}
+
+// the iterative parser must make the same AST, spans and errors
+static bool do_iterative_test(int entry_number, const char *input)
+{
+    using namespace EBNF;
+
+    std::string str = input;
+    StringScanner scanner1(str), scanner2(str);
+    AuxInfo aux1, aux2;
+    TokenStream stream1(scanner1, aux1), stream2(scanner2, aux2);
+    Parser parser1(stream1, aux1), parser2(stream2, aux2);
+    parser2.iterative(true);
+
+    bool ret1 = stream1.scan();
+    bool ret2 = stream2.scan();
+    if (ret1 && ret2)
+    {
+        stream1.fixup();
+        stream2.fixup();
+        ret1 = parser1.parse();
+        ret2 = parser2.parse();
+    }
+
+    os_type os1, os2;
+    aux1.err_out(os1);
+    aux2.err_out(os2);
+    std::vector<size_t> spans1, spans2;
+    if (ret1 && ret2)
+    {
+        parser1.ast()->to_dbg(os1);
+        parser2.ast()->to_dbg(os2);
+        get_spans(spans1, parser1.ast());
+        get_spans(spans2, parser2.ast());
+    }
+
+    bool failed = false;
+    if (ret1 != ret2 || os1.str() != os2.str() || spans1 != spans2)
+    {
+        printf("#%d: FAILED: iterative parser differs\n", entry_number);
         ++g_num_failures;
         failed = true;
     }
@@ -184,13 +636,1124 @@ static bool do_test_entry(const PARSE_TEST_ENTRY *entry)
     return !failed;
 }
 
-int main(void)
+// an integer too long for int is saturated at INT_MAX
+static bool do_long_integer_test(void)
 {
-    size_t count = sizeof(g_test_entries) / sizeof(g_test_entries[0]);
-    for (size_t i = 0; i < count; ++i)
+    using namespace EBNF;
+
+    static const PARSE_TEST_MODE modes[] = { TM_OWNED, TM_ZERO_COPY, TM_COMPACT };
+    static const char *inputs[] =
+    {
+        "a = 12345678901 * \"b\";", "a = 2147483648 * \"b\";",
+        "a = 2147483647 * \"b\";", "a = 000000000000000000007 * \"b\";",
+    };
+    static const int values[] = { INT_MAX, INT_MAX, INT_MAX, 7 };
+
+    bool failed = false;
+    for (size_t k = 0; k < sizeof(modes) / sizeof(modes[0]); ++k)
+    {
+        for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); ++i)
+        {
+            std::string str = inputs[i];
+            StringScanner scanner(str.c_str(), str.size());
+            AuxInfo aux;
+            TokenStream stream(scanner, aux);
+            stream.zero_copy(modes[k] != TM_OWNED);
+            stream.compact(modes[k] == TM_COMPACT);
+            if (!stream.scan() || stream.size() < 3 ||
+                stream.at(2).m_type != TOK_INTEGER ||
+                stream.at(2).m_integer != values[i])
+            {
+                failed = true;
+            }
+        }
+    }
+
+    if (failed)
+    {
+        printf("long integer: FAILED\n");
+        ++g_num_failures;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+// the lines, the columns and the spans on CRLF and LF
+static bool do_position_test(void)
+{
+    using namespace EBNF;
+
+    bool failed = false;
+    std::string str = "ab = c;\r\nd = e;\n\nfg = (h;";
+    StringScanner scanner(str);
+
+    // the line heads are 0, 9, 16 and 17; '\r' is in the line 1
+    static const size_t s_positions[][3] =
+    {
+        // index, line, column
+        { 0, 1, 1 }, { 7, 1, 8 }, { 8, 1, 9 }, { 9, 2, 1 }, { 15, 2, 7 },
+        { 16, 3, 1 }, { 17, 4, 1 }, { 22, 4, 6 }, { 25, 4, 9 },
+    };
+    for (size_t i = 0; i < sizeof(s_positions) / sizeof(s_positions[0]); ++i)
+    {
+        if (scanner.index_to_line(s_positions[i][0]) != s_positions[i][1] ||
+            scanner.index_to_column(s_positions[i][0]) != s_positions[i][2])
+        {
+            failed = true;
+        }
+    }
+    if (scanner.line_to_index(1) != 0 || scanner.line_to_index(2) != 9 ||
+        scanner.line_to_index(3) != 16 || scanner.line_to_index(4) != 17 ||
+        scanner.line_to_index(5) != str.size())
+    {
+        failed = true;
+    }
+
+    // a scanner from the line 2 counts as the whole buffer does
+    ScanOrigin origin = { 9, 9, 2 };
+    StringScanner part(str.data(), str.size(), origin);
+    if (part.index_to_line(11) != 2 || part.index_to_column(11) != 3 ||
+        part.index_to_line(17) != 4 || part.line_to_index(4) != 17)
+    {
+        failed = true;
+    }
+
+    // the line heads are found on demand over LINE_INDEX_STEP, in any order
+    std::string many;
+    for (size_t i = 0; i < 3000; ++i)
+        many += "a = b;\n";     // 7 bytes a line
+    StringScanner many_scanner(many);
+    if (many_scanner.index_to_line(7 * 10 + 2) != 11 ||
+        many_scanner.line_to_index(2500) != 7 * 2499 ||
+        many_scanner.index_to_column(7 * 1000 + 4) != 5 ||
+        many_scanner.index_to_line(7 * 2999 + 6) != 3000 ||
+        many_scanner.index_to_line(many.size()) != 3001 ||
+        many_scanner.line_to_index(3002) != many.size())
+    {
+        failed = true;
+    }
+    StringScanner many_scanner2(many);
+    if (many_scanner2.line_to_index(3001) != many.size() ||
+        many_scanner2.index_to_column(7 * 1234 + 3) != 4)
+    {
+        failed = true;
+    }
+    AuxInfo many_aux;
+    TokenStream many_stream(many_scanner2, many_aux);
+    many_stream.lazy(true);
+    if (!many_stream.scan())
+        failed = true;
+    for (size_t i = 0; i < 4 * 1500; ++i)
+        many_stream.next();
+    if (many_stream.token().m_line != 1501 ||
+        many_stream.get_column(many_stream.token()) != 1)
+    {
+        failed = true;
+    }
+
+    // the tokens and the error message
+    AuxInfo aux;
+    TokenStream stream(scanner, aux);
+    Parser parser(stream, aux);
+    if (!stream.scan())
+        failed = true;
+    stream.fixup();
+    if (parser.parse() || stream.size() < 9 ||
+        stream[4].m_line != 2 || stream.get_column(stream[4]) != 1 ||
+        stream[8].m_line != 4 || stream.get_column(stream[8]) != 1 ||
+        stream[8].m_begin != 17)
+    {
+        failed = true;
+    }
+    os_type os;
+    aux.err_out(os);
+    if (os.str() != "ERROR: ')' unmatched, at line 4, column 8\n")
+        failed = true;
+
+    // the spans of the rules
+    std::string good = "ab = c;\r\nd = e;\n";
+    StringScanner scanner2(good);
+    AuxInfo aux2;
+    TokenStream stream2(scanner2, aux2);
+    Parser parser2(stream2, aux2);
+    if (!stream2.scan())
+        failed = true;
+    stream2.fixup();
+    if (!parser2.parse())
     {
-        do_test_entry(&g_test_entries[i]);
+        failed = true;
     }
+    else
+    {
+        const SeqAst *rules = parser2.ast()->get_seq_ast();
+        if (!rules || rules->size() != 2 ||
+            rules->m_vec[0]->m_begin != 0 || rules->m_vec[0]->m_end != 7 ||
+            rules->m_vec[1]->m_begin != 9 || rules->m_vec[1]->m_end != 15)
+        {
+            failed = true;
+        }
+    }
+
+    if (failed)
+    {
+        printf("positions: FAILED\n");
+        ++g_num_failures;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+// deep brackets are parsed, copied, compared, printed and deleted
+// without recursion, or rejected by the nesting limit
+static bool do_depth_test(size_t depth)
+{
+    using namespace EBNF;
+
+    static const char *const brackets[] = { "()", "[]", "{}" };
+
+    bool failed = false;
+
+    // no limit by default, as the recursive parser had
+    {
+        std::string str = "z = ";
+        str.append(1500, '(');
+        str += "a";
+        str.append(1500, ')');
+        str += ";\n";
+        StringScanner scanner(str);
+        AuxInfo aux;
+        TokenStream stream(scanner, aux);
+        Parser parser(stream, aux);
+        if (parser.max_depth() != 0 || !stream.scan())
+            failed = true;
+        stream.fixup();
+        if (!parser.parse())
+            failed = true;
+    }
+
+    for (size_t k = 0; k < 3 && !failed; ++k)
+    {
+        std::string str = "z = ";
+        str.append(depth, brackets[k][0]);
+        str += "a";
+        str.append(depth, brackets[k][1]);
+        str += ";\n";
+
+        for (int iterative = 0; iterative <= 1; ++iterative)
+        {
+            StringScanner scanner(str);
+            AuxInfo aux;
+            TokenStream stream(scanner, aux);
+            stream.zero_copy(true);
+            Parser parser(stream, aux);
+            parser.iterative(!!iterative);
+            if (!stream.scan())
+            {
+                failed = true;
+                break;
+            }
+            stream.fixup();
+
+            // a limit rejects it
+            parser.max_depth(1000);
+            if (parser.parse() || aux.m_errors.empty())
+                failed = true;
+
+            parser.max_depth(0);
+            if (!iterative)
+                continue;
+
+            stream.index(0);
+            if (!parser.parse())
+            {
+                failed = true;
+                break;
+            }
+            BaseAst *copy = parser.ast()->clone();
+            os_type os;
+            copy->to_ebnf(os);
+            if (!ast_equal(parser.ast(), copy, true) || os.str() != str)
+                failed = true;
+
+            // the groups are flattened, the others are kept
+            BaseAst *sorted = copy->sorted_clone();
+            if (!ast_equal(copy, sorted) || sorted->empty())
+                failed = true;
+            os_type dbg, bnf;
+            sorted->to_dbg(dbg);
+            copy->to_bnf(bnf);
+            if (dbg.str().size() < (k ? depth : 0) || bnf.str().size() < depth * 2)
+                failed = true;
+            delete sorted;
+
+            string_type name = "y";
+            ast_add_rule(copy, name, ast_get_rule_body(copy, "z"));
+            if (name != "z")
+                failed = true;
+            delete copy;
+        }
+    }
+
+    if (failed)
+    {
+        printf("depth %u: FAILED\n", (int)depth);
+        ++g_num_failures;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+// the rules with ';' in the strings, the comments and the specials
+static std::string make_parallel_input(size_t num_rules, size_t bad_rule)
+{
+    std::string str;
+    char buf[128];
+    for (size_t i = 0; i < num_rules; ++i)
+    {
+        sprintf(buf, "rule%u = 'a;b', \"c;d\" (* e; f *)\n", (int)i);
+        str += buf;
+        if (i == bad_rule)
+            sprintf(buf, "    | (?g; h?, rule%u;\n", (int)i + 1);
+        else
+            sprintf(buf, "    | [?g; h?, rule%u]; ", (int)i + 1);
+        str += buf;
+    }
+    return str;
+}
+
+// the parallel parser must make the same AST, spans and errors
+static bool do_parallel_test(size_t num_rules, size_t bad_rule)
+{
+    using namespace EBNF;
+
+    std::string str = make_parallel_input(num_rules, bad_rule);
+
+    StringScanner scanner(str);
+    AuxInfo aux1, aux2;
+    TokenStream stream(scanner, aux1);
+    Parser parser1(stream, aux1);
+    bool ret1 = stream.scan();
+    if (ret1)
+    {
+        stream.fixup();
+        ret1 = parser1.parse();
+    }
+
+    ParallelParser parser2(str.c_str(), str.size(), aux2);
+    parser2.thread_count(4);
+    parser2.min_chunk_size(64);
+    bool ret2 = parser2.parse();
+
+    os_type os1, os2;
+    aux1.err_out(os1);
+    aux2.err_out(os2);
+    std::vector<size_t> spans1, spans2;
+    if (ret1 && ret2)
+    {
+        parser1.ast()->to_dbg(os1);
+        parser2.ast()->to_dbg(os2);
+        get_spans(spans1, parser1.ast());
+        get_spans(spans2, parser2.ast());
+    }
+
+    // parsing again reports the same messages once
+    bool failed = false;
+    const size_t num_errors = aux2.m_errors.size();
+    if (parser2.parse() != ret2 || aux2.m_errors.size() != num_errors)
+        failed = true;
+
+    if (failed || ret1 != ret2 || os1.str() != os2.str() || spans1 != spans2 ||
+        parser2.chunks().size() < 2)
+    {
+        printf("parallel %u: FAILED\n", (int)bad_rule);
+        ++g_num_failures;
+        failed = true;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+// two parallel parsers at once don't disturb each other
+static bool do_parallel_overlap_test(size_t num_rules)
+{
+    using namespace EBNF;
+
+    std::string strs[2] = {
+        make_parallel_input(num_rules, size_t(-1)),
+        make_parallel_input(num_rules, num_rules / 2)
+    };
+    std::string texts[2];
+    bool rets[2] = { false, false };
+    std::vector<std::thread> threads;
+    for (int k = 0; k < 2; ++k)
+    {
+        threads.push_back(std::thread([&strs, &texts, &rets, k]() {
+            for (int n = 0; n < 5; ++n)
+            {
+                AuxInfo aux;
+                ParallelParser parser(strs[k].c_str(), strs[k].size(), aux);
+                parser.thread_count(2);
+                parser.min_chunk_size(64);
+                rets[k] = parser.parse();
+                os_type os;
+                aux.err_out(os);
+                if (rets[k])
+                    parser.ast()->to_ebnf(os);
+                texts[k] = os.str();
+            }
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    bool failed = false;
+    for (int k = 0; k < 2; ++k)
+    {
+        AuxInfo aux;
+        ParallelParser parser(strs[k].c_str(), strs[k].size(), aux);
+        parser.thread_count(1);
+        bool ret = parser.parse();
+        os_type os;
+        aux.err_out(os);
+        if (ret)
+            parser.ast()->to_ebnf(os);
+        if (ret != rets[k] || os.str() != texts[k])
+            failed = true;
+    }
+    if (!rets[0] || rets[1])
+        failed = true;
+
+    if (failed)
+    {
+        printf("parallel overlap: FAILED\n");
+        ++g_num_failures;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+// the readers on two threads share a lazy tree
+static bool do_lazy_thread_test(size_t num_rules)
+{
+    using namespace EBNF;
+
+    std::string str = make_parallel_input(num_rules, num_rules / 2);
+    AuxInfo aux;
+    LazyParser parser(str.c_str(), str.size(), aux);
+    bool failed = !parser.parse();
+
+    std::string texts[2];
+    std::vector<std::thread> threads;
+    for (int k = 0; k < 2 && !failed; ++k)
+    {
+        threads.push_back(std::thread([&parser, &texts, k]() {
+            os_type os;
+            parser.ast()->to_ebnf(os);
+            texts[k] = os.str();
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    if (failed || texts[0].empty() || texts[0] != texts[1])
+        failed = true;
+    else if (parser.parse_bodies() || aux.m_errors.size() != 1)
+        failed = true;
+
+    if (failed)
+    {
+        printf("lazy threads: FAILED\n");
+        ++g_num_failures;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+// two independent parsers on two threads share the atom table
+static bool do_shared_table_test(size_t num_rules)
+{
+    using namespace EBNF;
+
+    std::string strs[2], texts[2];
+    for (int k = 0; k < 2; ++k)
+    {
+        char buf[64];
+        for (size_t i = 0; i < num_rules; ++i)
+        {
+            sprintf(buf, "t%d-r%u = \"t%d s%u\" | t%d-r%u;\n",
+                    k, (int)i, k, (int)i, k, (int)(i + 1));
+            strs[k] += buf;
+        }
+    }
+
+    std::vector<std::thread> threads;
+    for (int k = 0; k < 2; ++k)
+    {
+        threads.push_back(std::thread([&strs, &texts, k]() {
+            StringScanner scanner(strs[k]);
+            AuxInfo aux;
+            TokenStream stream(scanner, aux);
+            stream.zero_copy(true);
+            Parser parser(stream, aux);
+            if (stream.scan())
+            {
+                stream.fixup();
+                if (parser.parse())
+                {
+                    os_type os;
+                    parser.ast()->to_ebnf(os);
+                    texts[k] = os.str();
+                }
+            }
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    bool failed = false;
+    for (int k = 0; k < 2; ++k)
+    {
+        if (texts[k] != strs[k])
+            failed = true;
+    }
+    if (atom_table().str(atom_table().intern("t1 s7")) != "t1 s7")
+        failed = true;
+
+    if (failed)
+    {
+        printf("shared table: FAILED\n");
+        ++g_num_failures;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+// the push parser must make the same AST, spans and errors for any pieces
+static bool do_push_test(int entry_number, const std::string& str, size_t piece)
+{
+    using namespace EBNF;
+
+    StringScanner scanner(str);
+    AuxInfo aux1, aux2;
+    TokenStream stream(scanner, aux1);
+    Parser parser1(stream, aux1);
+    bool ret1 = stream.scan();
+    if (ret1)
+    {
+        stream.fixup();
+        ret1 = parser1.parse();
+    }
+
+    PushParser parser2(aux2);
+    size_t max_buffered = 0;
+    for (size_t i = 0; i < str.size(); i += piece)
+    {
+        size_t size = str.size() - i;
+        if (size > piece)
+            size = piece;
+        if (!parser2.feed(str.c_str() + i, size))
+            break;
+        if (max_buffered < parser2.buffered())
+            max_buffered = parser2.buffered();
+    }
+    bool ret2 = parser2.finish();
+
+    os_type os1, os2;
+    aux1.err_out(os1);
+    aux2.err_out(os2);
+    std::vector<size_t> spans1, spans2;
+    if (ret1 && ret2)
+    {
+        parser1.ast()->to_dbg(os1);
+        parser2.ast()->to_dbg(os2);
+        get_spans(spans1, parser1.ast());
+        get_spans(spans2, parser2.ast());
+    }
+
+    // the text of a rule and a piece at most
+    bool failed = false;
+    if (ret1 != ret2 || os1.str() != os2.str() || spans1 != spans2 ||
+        max_buffered > 256 + piece)
+    {
+        printf("#%d: FAILED: push parser differs (piece %u)\n",
+               entry_number, (int)piece);
+        ++g_num_failures;
+        failed = true;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+// the lazy bodies are parsed on demand into the same AST
+static bool do_lazy_test(int entry_number, const char *input)
+{
+    using namespace EBNF;
+
+    std::string str = input;
+    StringScanner scanner(str);
+    AuxInfo aux1, aux2;
+    TokenStream stream(scanner, aux1);
+    Parser parser1(stream, aux1);
+    bool ret1 = stream.scan();
+    if (ret1)
+    {
+        stream.fixup();
+        ret1 = parser1.parse();
+    }
+    LazyParser parser2(str.c_str(), str.size(), aux2);
+    bool ret2 = parser2.parse();
+
+    bool failed = false;
+    if (ret1 && ret2)
+    {
+        BaseAst *ast1 = parser1.ast(), *ast2 = parser2.ast();
+        names_type names1, names2;
+        ast_get_defined_rule_names(names1, ast1);
+        ast_get_defined_rule_names(names2, ast2);
+        if (names1 != names2)
+            failed = true;
+
+        // no body is parsed until accessed
+        const rules_vector *rules = ast_get_rules_vector(ast2);
+        for (size_t i = 0; i < rules->size(); ++i)
+        {
+            if ((*rules)[i]->m_right->get_lazy_ast()->parsed())
+                failed = true;
+        }
+
+        std::vector<size_t> spans1, spans2;
+        const BaseAst *body = ast_get_rule_body(ast2, names2.back());
+        if (!rules->back()->m_right->get_lazy_ast()->parsed())
+            failed = true;
+        get_spans(spans1, ast_get_rule_body(ast1, names1.back()));
+        get_spans(spans2, body);
+        if (spans1 != spans2)
+            failed = true;
+
+        os_type os1, os2;
+        ast1->to_dbg(os1);
+        ast2->to_dbg(os2);
+        ast1->to_ebnf(os1);
+        ast2->to_ebnf(os2);
+        if (os1.str() != os2.str() || !ast_equal(ast1, ast2) ||
+            !parser2.source()->aux().m_errors.empty())
+        {
+            failed = true;
+        }
+
+        // the parsed bodies are cloned into the arena
+        AstArena arena;
+        BaseAst *copy = ast2->clone(&arena);
+        const rules_vector *copied = ast_get_rules_vector(copy);
+        for (size_t i = 0; i < copied->size(); ++i)
+        {
+            const LazyAst *lazy = (*copied)[i]->m_right->get_lazy_ast();
+            if (!lazy || !lazy->parsed() || lazy->m_body->m_arena != &arena)
+                failed = true;
+        }
+        if (!ast_equal(ast2, copy))
+            failed = true;
+
+        if (!parser2.parse_bodies() || !aux2.m_errors.empty())
+            failed = true;
+    }
+    else if (ret2)
+    {
+        // the error is in a body
+        os_type os;
+        parser2.ast()->to_ebnf(os);
+        if (parser2.source()->aux().m_errors.empty())
+            failed = true;
+        if (parser2.parse_bodies() || aux2.m_errors.empty())
+            failed = true;
+
+        // the failed body is not given
+        const rules_vector *rules = ast_get_rules_vector(parser2.ast());
+        for (size_t i = 0; i < rules->size(); ++i)
+        {
+            const BinaryAst *rule = (*rules)[i];
+            const bool bad = rule->m_right->get_lazy_ast()->failed();
+            if (bad != !ast_get_rule_body(parser2.ast(), ast_get_rule_atom(rule)))
+                failed = true;
+        }
+    }
+    else if (ret1)
+    {
+        failed = true;
+    }
+
+    // parse() again forgets the errors of the last time
+    AuxInfo aux3;
+    LazyParser parser3(str.c_str(), str.size(), aux3);
+    if (parser3.parse() != ret2 || parser2.parse() != ret2 ||
+        aux2.m_errors.size() != aux3.m_errors.size())
+    {
+        failed = true;
+    }
+
+    // a copy of the text outlives the buffer
+    std::string text = str;
+    LazyParser parser4(text.c_str(), text.size(), aux3);
+    parser4.copy_text(true);
+    if (parser4.parse() != ret2)
+        failed = true;
+    text.assign(text.size(), '#');
+    if (ret2)
+    {
+        os_type os2, os4;
+        parser2.ast()->to_ebnf(os2);
+        parser4.ast()->to_ebnf(os4);
+        if (os2.str() != os4.str() || parser2.parse_bodies() != parser4.parse_bodies())
+            failed = true;
+    }
+
+    if (failed)
+    {
+        printf("#%d: FAILED: lazy parser differs\n", entry_number);
+        ++g_num_failures;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+// the document is the same as the text parsed from scratch
+static bool same_as_parsed(EBNF::EbnfDocument& doc)
+{
+    using namespace EBNF;
+
+    // the chunks know their lines and line heads
+    const std::string& text = doc.text();
+    const std::vector<DocChunk>& chunks = doc.chunks();
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+        const DocChunk& chunk = chunks[i];
+        size_t head = text.rfind('\n', chunk.m_begin ? chunk.m_begin - 1 : 0);
+        head = (head == std::string::npos || chunk.m_begin == 0 ? 0 : head + 1);
+        size_t line = 1 + std::count(text.begin(), text.begin() + chunk.m_begin, '\n');
+        if (chunk.m_head != head || chunk.m_line != line ||
+            chunk.m_begin != (i ? chunks[i - 1].m_end : 0))
+        {
+            return false;
+        }
+    }
+
+    StringScanner scanner(doc.text());
+    AuxInfo aux;
+    TokenStream stream(scanner, aux);
+    Parser parser(stream, aux);
+    bool ret = stream.scan();
+    if (ret)
+    {
+        stream.fixup();
+        ret = parser.parse();
+    }
+    if (!ret)
+        return !doc.ok() || doc.text().find_first_not_of(" \n") == std::string::npos;
+    if (!doc.ok())
+        return false;
+
+    // the spans of an unshifted rule are moved by its rule_shift()
+    std::vector<size_t> spans1, spans2, spans3;
+    get_spans(spans1, parser.ast());
+    spans2.push_back(doc.unshifted_ast()->m_begin);
+    spans2.push_back(doc.unshifted_ast()->m_end);
+    const rules_vector *rules = ast_get_rules_vector(doc.unshifted_ast());
+    for (size_t i = 0; i < rules->size(); ++i)
+    {
+        const size_t first = spans2.size();
+        get_spans(spans2, (*rules)[i]);
+        for (size_t k = first; k < spans2.size(); ++k)
+            spans2[k] += doc.rule_shift(i);
+    }
+    if (spans1 != spans2)
+        return false;
+
+    // ast() has the spans moved
+    os_type os1, os2;
+    parser.ast()->to_dbg(os1);
+    doc.ast()->to_dbg(os2);
+    get_spans(spans3, doc.ast());
+    return os1.str() == os2.str() && spans1 == spans3;
+}
+
+// edit the document and compare it with the text parsed from scratch
+static bool do_document_test(int entry_number, const std::string& str)
+{
+    using namespace EBNF;
+
+    static const char * const s_pieces[] =
+    {
+        " x", ";", "(*", "*)", "'", "\"", "?", "\n", "a = b;\n", " | ", "(", "]"
+    };
+    const size_t num_pieces = sizeof(s_pieces) / sizeof(s_pieces[0]);
+
+    EbnfDocument doc;
+    doc.set_text(str);
+    bool failed = !same_as_parsed(doc);
+
+    unsigned int seed = 12345;
+    for (int i = 0; i < 300 && !failed; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        const size_t offset = (seed >> 8) % (doc.text().size() + 1);
+        if (i % 2)
+        {
+            // insert a piece, and undo it at times
+            std::string piece = s_pieces[(seed >> 4) % num_pieces];
+            doc.edit(offset, 0, piece);
+            failed = !same_as_parsed(doc);
+            if (!failed && i % 3)
+            {
+                doc.edit(offset, piece.size(), "");
+                failed = !same_as_parsed(doc);
+            }
+        }
+        else
+        {
+            // remove a part, and put it back
+            size_t removed = (seed >> 16) % 24;
+            if (removed > doc.text().size() - offset)
+                removed = doc.text().size() - offset;
+            std::string part = doc.text().substr(offset, removed);
+            doc.edit(offset, removed, "");
+            failed = !same_as_parsed(doc);
+            if (!failed)
+            {
+                doc.edit(offset, 0, part);
+                failed = !same_as_parsed(doc);
+            }
+        }
+    }
+
+    // renaming a rule in the middle replaces it only
+    if (!failed && doc.set_text(str))
+    {
+        const size_t offset = str.find("rule30 =");
+        doc.edit(offset, 0, "z");
+        const RuleChange& change = doc.last_change();
+        failed = change.m_first != 30 || change.m_removed != 1 ||
+                 change.m_inserted != 1;
+        if (!failed && (doc.rule_shift(31) != 1 || doc.rule_shift(29) != 0))
+            failed = true;
+
+        // ast() moves the spans in place
+        if (!failed && (!same_as_parsed(doc) || doc.rule_shift(31) != 0))
+            failed = true;
+    }
+
+    if (failed)
+    {
+        printf("#%d: FAILED: document differs\n", entry_number);
+        ++g_num_failures;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+// rebuild the AST from the events
+class AstBuilder : public EBNF::EventHandler
+{
+public:
+    EBNF::SeqAst *m_rules;
+
+    AstBuilder() : m_rules(new EBNF::SeqAst(EBNF::SEQ_RULES)), m_name(NULL), m_done(NULL)
+    {
+    }
+    ~AstBuilder()
+    {
+        EBNF::ast_delete(m_rules);
+        EBNF::ast_delete(m_name);
+        EBNF::ast_delete(m_done);
+        for (size_t i = 0; i < m_frames.size(); ++i)
+        {
+            EBNF::ast_delete(m_frames[i].m_expr);
+            EBNF::ast_delete(m_frames[i].m_terms);
+            EBNF::ast_delete(m_frames[i].m_term);
+            EBNF::ast_delete(m_frames[i].m_left);
+        }
+    }
+
+    virtual void begin_rule(EBNF::atom_type name)
+    {
+        m_name = new EBNF::IdentAst(name);
+    }
+    virtual void end_rule()
+    {
+        m_rules->push_back(new EBNF::BinaryAst(EBNF::BINARY_RULE, m_name, m_done));
+        m_name = NULL;
+        m_done = NULL;
+    }
+    virtual void begin_expr()
+    {
+        Frame frame = { new EBNF::SeqAst(EBNF::SEQ_EXPR),
+                        new EBNF::SeqAst(EBNF::SEQ_TERMS), NULL, NULL, false, 0 };
+        m_frames.push_back(frame);
+    }
+    virtual void alternative()
+    {
+        Frame& frame = m_frames.back();
+        concatenate();
+        frame.m_expr->push_back(frame.m_terms);
+        frame.m_terms = new EBNF::SeqAst(EBNF::SEQ_TERMS);
+    }
+    virtual void end_expr()
+    {
+        alternative();
+        Frame& frame = m_frames.back();
+        EBNF::ast_delete(frame.m_terms);
+        m_done = frame.m_expr;
+        m_frames.pop_back();
+    }
+    virtual void concatenate()
+    {
+        Frame& frame = m_frames.back();
+        frame.m_terms->push_back(frame.m_term);
+        frame.m_term = NULL;
+    }
+    virtual void ident(EBNF::atom_type atom)
+    {
+        add(new EBNF::IdentAst(atom));
+    }
+    virtual void terminal(EBNF::atom_type atom)
+    {
+        add(new EBNF::StringAst(atom));
+    }
+    virtual void special(const EBNF::string_type& str)
+    {
+        add(new EBNF::SpecialAst(str));
+    }
+    virtual void empty()
+    {
+        add(new EBNF::EmptyAst());
+    }
+    virtual void end_bracket(EBNF::UnaryType type)
+    {
+        EBNF::BaseAst *expr = m_done;
+        m_done = NULL;
+        add(new EBNF::UnaryAst(type, expr));
+    }
+    virtual void exception()
+    {
+        Frame& frame = m_frames.back();
+        frame.m_left = frame.m_term;
+        frame.m_term = NULL;
+    }
+    virtual void repetition(int count)
+    {
+        m_frames.back().m_has_times = true;
+        m_frames.back().m_times = count;
+    }
+
+protected:
+    struct Frame
+    {
+        EBNF::SeqAst *m_expr;
+        EBNF::SeqAst *m_terms;
+        EBNF::BaseAst *m_term;
+        EBNF::BaseAst *m_left;  // the factor before '-'
+        bool m_has_times;
+        int m_times;
+    };
+    std::vector<Frame> m_frames;
+    EBNF::IdentAst *m_name;
+    EBNF::BaseAst *m_done;      // the last expr ended
+
+    void add(EBNF::BaseAst *ast)
+    {
+        using namespace EBNF;
+        Frame& frame = m_frames.back();
+        if (frame.m_has_times)
+        {
+            ast = new BinaryAst(BINARY_TIMES, new IntegerAst(frame.m_times), ast);
+            frame.m_has_times = false;
+        }
+        if (frame.m_left)
+        {
+            ast = new BinaryAst(BINARY_EXCEPT, frame.m_left, ast);
+            frame.m_left = NULL;
+        }
+        frame.m_term = ast;
+    }
+};
+
+// the events make the same AST and the same errors as Parser
+static bool do_event_test(int entry_number, const char *input)
+{
+    using namespace EBNF;
+
+    std::string str = input;
+    StringScanner scanner1(str), scanner2(str);
+    AuxInfo aux1, aux2;
+    TokenStream stream1(scanner1, aux1), stream2(scanner2, aux2);
+    stream2.lazy(true);
+    Parser parser1(stream1, aux1);
+    AstBuilder builder;
+    EventParser parser2(stream2, aux2, builder);
+
+    bool ret1 = stream1.scan();
+    bool ret2 = stream2.scan();
+    if (ret1)
+    {
+        stream1.fixup();
+        ret1 = parser1.parse();
+    }
+    if (ret2)
+    {
+        ret2 = parser2.parse();
+    }
+
+    os_type os1, os2;
+    aux1.err_out(os1);
+    aux2.err_out(os2);
+    if (ret1 && ret2)
+    {
+        parser1.ast()->to_dbg(os1);
+        builder.m_rules->to_dbg(os2);
+    }
+
+    bool failed = false;
+    if (ret1 != ret2 || os1.str() != os2.str())
+    {
+        printf("#%d: FAILED: event parser differs\n", entry_number);
+        ++g_num_failures;
+        failed = true;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+// a ParseContext reused for all the inputs
+static bool
+do_context_test(EBNF::ParseContext& context, int entry_number, const char *input)
+{
+    using namespace EBNF;
+
+    std::string str = input;
+    StringScanner scanner1(str);
+    AuxInfo aux1;
+    TokenStream stream1(scanner1, aux1);
+    Parser parser1(stream1, aux1);
+    bool ret1 = stream1.scan();
+    if (ret1)
+    {
+        stream1.fixup();
+        ret1 = parser1.parse();
+    }
+
+    context.reset(str.c_str(), str.size());
+    bool ret2 = context.parse();
+
+    os_type os1, os2;
+    aux1.err_out(os1);
+    context.aux().err_out(os2);
+    if (ret1 && ret2)
+    {
+        parser1.ast()->to_dbg(os1);
+        context.ast()->to_dbg(os2);
+    }
+
+    bool failed = false;
+    if (ret1 != ret2 || os1.str() != os2.str())
+    {
+        printf("#%d: FAILED: reused context differs\n", entry_number);
+        ++g_num_failures;
+        failed = true;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+static bool
+do_test_entry(const PARSE_TEST_ENTRY *entry, PARSE_TEST_MODE mode)
+{
+    bool failed = false;
+    size_t num_rules = 0;
+    PARSE_TEST_RETURN ret = just_do_it(entry->input, num_rules, mode);
+    if (ret != entry->ret)
+    {
+        printf("#%d: FAILED: ret expected %d, got %d\n", entry->entry_number, entry->ret, ret);
+        ++g_num_failures;
+        failed = true;
+    }
+    ++g_num_executions;
+    if (num_rules != entry->num_rules)
+    {
+        printf("#%d: FAILED: num_rules expected %u, got %u\n",
+               entry->entry_number, (int)entry->num_rules, (int)num_rules);
+        ++g_num_failures;
+        failed = true;
+    }
+    ++g_num_executions;
+    return !failed;
+}
+
+int main(void)
+{
+    size_t count = sizeof(g_test_entries) / sizeof(g_test_entries[0]);
+    for (size_t i = 0; i < count; ++i)
+    {
+        do_test_entry(&g_test_entries[i], TM_OWNED);
+        do_test_entry(&g_test_entries[i], TM_ZERO_COPY);
+        do_test_entry(&g_test_entries[i], TM_LAZY);
+        do_test_entry(&g_test_entries[i], TM_COMPACT);
+        do_test_entry(&g_test_entries[i], TM_ARENA);
+        do_test_entry(&g_test_entries[i], TM_ITERATIVE);
+        do_dfa_test(g_test_entries[i].entry_number, g_test_entries[i].input);
+        do_compact_test(g_test_entries[i].entry_number, g_test_entries[i].input);
+        do_iterative_test(g_test_entries[i].entry_number, g_test_entries[i].input);
+        do_event_test(g_test_entries[i].entry_number, g_test_entries[i].input);
+        do_lazy_test(g_test_entries[i].entry_number, g_test_entries[i].input);
+        do_push_test(g_test_entries[i].entry_number, g_test_entries[i].input, 1);
+        do_push_test(g_test_entries[i].entry_number, g_test_entries[i].input, 7);
+    }
+    count = sizeof(g_lexer_inputs) / sizeof(g_lexer_inputs[0]);
+    for (size_t i = 0; i < count; ++i)
+    {
+        do_dfa_test(1000 + (int)i, g_lexer_inputs[i]);
+        do_compact_test(1000 + (int)i, g_lexer_inputs[i]);
+        do_iterative_test(1000 + (int)i, g_lexer_inputs[i]);
+        do_event_test(1000 + (int)i, g_lexer_inputs[i]);
+        do_lazy_test(1000 + (int)i, g_lexer_inputs[i]);
+        do_unterminated_test(1000 + (int)i, g_lexer_inputs[i]);
+    }
+    {
+        EBNF::ParseContext context;
+        count = sizeof(g_test_entries) / sizeof(g_test_entries[0]);
+        for (size_t i = 0; i < count; ++i)
+        {
+            do_context_test(context, g_test_entries[i].entry_number,
+                            g_test_entries[i].input);
+        }
+        count = sizeof(g_lexer_inputs) / sizeof(g_lexer_inputs[0]);
+        for (size_t i = 0; i < count; ++i)
+        {
+            do_context_test(context, 1000 + (int)i, g_lexer_inputs[i]);
+        }
+    }
+    do_long_integer_test();
+    do_position_test();
+    do_trivia_test();
+    do_mapped_test();
+    do_depth_test(100000);
+    do_parallel_test(200, size_t(-1));
+    do_parallel_test(200, 123);
+    do_parallel_overlap_test(200);
+    do_lazy_thread_test(200);
+    do_shared_table_test(3000);
+    do_push_test(2000, make_parallel_input(200, size_t(-1)), 1);
+    do_push_test(2001, make_parallel_input(200, size_t(-1)), 100);
+    do_push_test(2002, make_parallel_input(200, 123), 5);
+    do_push_test(2003, "a = b; c = d; e = (f;", 4);
+    do_document_test(3000, make_parallel_input(60, size_t(-1)));
+
+    // nothing holds an atom now
+    EBNF::atom_table().clear();
+    if (EBNF::atom_table().size() != 0 || EBNF::atom_table().intern("a") != 0)
+    {
+        printf("atom table: FAILED\n");
+        ++g_num_failures;
+    }
+    ++g_num_executions;
 
     printf("executions %d, failures %d\n", g_num_executions, g_num_failures);
     if (g_num_failures == 0)
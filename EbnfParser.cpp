@@ -3,18 +3,93 @@
 /////////////////////////////////////////////////////////////////////////
 
 #include "EBNF.hpp"
+#include "mapped_file.hpp"
+#include "parallel_parser.hpp"
+#include "push_parser.hpp"
+#include "ast_digest.hpp"
 #include <fstream>
 #include <cstdio>       // for std::puts
 
-int parse(const std::string& str)
+static bool s_lazy = false;
+static bool s_iterative = false;
+static bool s_parallel = false;
+static bool s_push = false;
+static bool s_digest = false;
+
+// print the digest of each rule, then that of the grammar
+void print_digests(EBNF::os_type& os, const EBNF::BaseAst *ast)
+{
+    using namespace EBNF;
+
+    std::vector<AstDigest> digests;
+    const AstDigest digest = ast_digest(ast, digests);
+    const rules_vector *rules = ast_get_rules_vector(ast);
+    for (size_t i = 0; i < digests.size(); ++i)
+    {
+        os << digests[i].str() << "  " << ast_get_rule_name((*rules)[i]) << "\n";
+    }
+    os << digest.str() << "  (grammar)\n";
+}
+
+// print the AST, or the digests
+void print_ast(EBNF::os_type& os, const EBNF::BaseAst *ast)
+{
+    if (s_digest)
+    {
+        print_digests(os, ast);
+        return;
+    }
+
+    os << "\nto_dbg:\n";
+    ast->to_dbg(os);
+    os << "\n\nto_bnf:\n";
+    ast->to_ebnf(os);
+}
+
+int parse_parallel(const char *data, size_t size)
+{
+    int ret = 0;
+    using namespace EBNF;
+
+    AuxInfo aux;
+    ParallelParser parser(data, size, aux);
+
+    os_type os;
+    if (parser.parse())
+    {
+        print_ast(os, parser.ast());
+    }
+    else if (parser.scan_failed())
+    {
+        ret = 1;
+        os << "scan error\n";
+    }
+    else
+    {
+        ret = 2;
+        os << "parse error\n";
+    }
+    aux.err_out(os);
+
+    puts(os.str().c_str());
+
+    return ret;
+}
+
+int parse(const char *data, size_t size)
 {
+    if (s_parallel)
+        return parse_parallel(data, size);
+
     int ret = 1;
     using namespace EBNF;
 
-    StringScanner scanner(str);
+    StringScanner scanner(data, size);
 
     AuxInfo aux;
     TokenStream stream(scanner, aux);
+    stream.zero_copy(true);
+    stream.lazy(s_lazy);
 
     os_type os;
     if (stream.scan())
@@ -22,18 +97,15 @@ int parse(const std::string& str)
         ret = 2;
         stream.fixup();
 
-        stream.to_dbg(os);
+        if (!s_lazy && !s_digest)
+            stream.to_dbg(os);
 
         Parser parser(stream, aux);
+        parser.iterative(s_iterative);
         if (parser.parse())
         {
             ret = 0;
-            BaseAst *ast = parser.ast();
-
-            os << "\nto_dbg:\n";
-            ast->to_dbg(os);
-            os << "\n\nto_bnf:\n";
-            ast->to_ebnf(os);
+            print_ast(os, parser.ast());
         }
         else
         {
@@ -51,10 +123,57 @@ int parse(const std::string& str)
     return ret;
 }
 
+// feed the file (or stdin for "-") in pieces
+int parse_push(const char *file)
+{
+    int ret = 2;
+    using namespace EBNF;
+
+    FILE *fp = (strcmp(file, "-") == 0 ? stdin : fopen(file, "rb"));
+    if (fp == NULL)
+        return -1;
+
+    AuxInfo aux;
+    PushParser parser(aux);
+
+    char buf[4096];
+    size_t size;
+    while ((size = fread(buf, 1, sizeof(buf), fp)) > 0)
+    {
+        if (!parser.feed(buf, size))
+            break;
+    }
+    if (fp != stdin)
+        fclose(fp);
+
+    os_type os;
+    if (parser.finish())
+    {
+        ret = 0;
+        print_ast(os, parser.ast());
+    }
+    else
+    {
+        os << "parse error\n";
+    }
+    aux.err_out(os);
+
+    puts(os.str().c_str());
+
+    return ret;
+}
+
 void show_help(void)
 {
     printf("Usage: EbnfParser [options] file.txt\n");
+    printf("       EbnfParser --push -\n");
     printf("Options:\n");
+    printf("--mmap       Map the file into memory instead of reading it\n");
+    printf("--lazy       Scan the tokens on demand while parsing\n");
+    printf("--iterative  Parse the nested brackets without recursion\n");
+    printf("--parallel   Parse the rules on the threads\n");
+    printf("--push       Feed the file (or stdin for -) to the parser in pieces\n");
+    printf("--digest     Print the canonical digests of the rules and the grammar\n");
     printf("--version    Show version info\n");
     printf("--help       Show help\n");
 }
@@ -73,6 +192,7 @@ int main(int argc, char **argv)
     }
 
     char *file = NULL;
+    bool use_mmap = false;
     for (int i = 1; i < argc; ++i)
     {
         char *arg = argv[i];
@@ -86,7 +206,37 @@ int main(int argc, char **argv)
             show_version();
             return 0;
         }
-        if (arg[0] == '-')
+        if (strcmp(arg, "--mmap") == 0)
+        {
+            use_mmap = true;
+            continue;
+        }
+        if (strcmp(arg, "--lazy") == 0)
+        {
+            s_lazy = true;
+            continue;
+        }
+        if (strcmp(arg, "--iterative") == 0)
+        {
+            s_iterative = true;
+            continue;
+        }
+        if (strcmp(arg, "--parallel") == 0)
+        {
+            s_parallel = true;
+            continue;
+        }
+        if (strcmp(arg, "--push") == 0)
+        {
+            s_push = true;
+            continue;
+        }
+        if (strcmp(arg, "--digest") == 0)
+        {
+            s_digest = true;
+            continue;
+        }
+        if (arg[0] == '-' && arg[1] != 0)
         {
             printf("ERROR: invalid argument: '%s'\n", arg);
             show_help();
@@ -101,15 +251,35 @@ int main(int argc, char **argv)
             printf("ERROR: multiple input files specified\n");
         }
     }
-
-    std::ifstream ifs(file);
-    if (ifs.fail())
-        return -1;
+    if (file == NULL)
+    {
+        show_help();
+        return 1;
+    }
 
     int ret;
-    std::istreambuf_iterator<char> it(ifs), end;
-    std::string str(it, end);
-    ret = parse(str);
+    if (s_push)
+    {
+        ret = parse_push(file);
+    }
+    else if (use_mmap)
+    {
+        EBNF::MappedFile mapped(file);
+        if (!mapped.is_open())
+            return -1;
+
+        ret = parse(mapped.data(), mapped.size());
+    }
+    else
+    {
+        std::ifstream ifs(file);
+        if (ifs.fail())
+            return -1;
+
+        std::istreambuf_iterator<char> it(ifs), end;
+        std::string str(it, end);
+        ret = parse(str.c_str(), str.size());
+    }
 
     assert(EBNF::BaseAst::alive_count() == 0);
     return ret;
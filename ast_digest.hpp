@@ -0,0 +1,284 @@
+// ast_digest.hpp --- canonical digests of BNF/EBNF notation AST
+// See ReadMe.txt and License.txt.
+/////////////////////////////////////////////////////////////////////////
+
+#ifndef AST_DIGEST_HPP_
+#define AST_DIGEST_HPP_ 1   // Version 1
+
+#include "bnf_ast.hpp"  // for bnf_ast::BaseAst, ...
+#include <cstdint>      // for uint64_t, uint32_t
+#include <cstdio>       // for std::sprintf
+
+/////////////////////////////////////////////////////////////////////////
+
+namespace bnf_ast
+{
+    // a 128-bit digest
+    struct AstDigest
+    {
+        uint64_t    m_hash1;
+        uint64_t    m_hash2;
+
+        bool operator==(const AstDigest& other) const
+        {
+            return m_hash1 == other.m_hash1 && m_hash2 == other.m_hash2;
+        }
+        bool operator!=(const AstDigest& other) const
+        {
+            return !(*this == other);
+        }
+        bool operator<(const AstDigest& other) const
+        {
+            if (m_hash1 != other.m_hash1)
+                return m_hash1 < other.m_hash1;
+            return m_hash2 < other.m_hash2;
+        }
+
+        // 32 hex digits
+        string_type str() const
+        {
+            char buf[40];
+            std::sprintf(buf, "%08x%08x%08x%08x",
+                         unsigned(m_hash1 >> 32), unsigned(m_hash1),
+                         unsigned(m_hash2 >> 32), unsigned(m_hash2));
+            return buf;
+        }
+    };
+
+    // for std::unordered_map and std::unordered_set
+    struct AstDigestHash
+    {
+        size_t operator()(const AstDigest& digest) const
+        {
+            return size_t(digest.m_hash1);
+        }
+    };
+
+    // NOTE: AstDigester makes the digest of the canonical form of a tree,
+    //       i.e. sorted_clone(), in one bottom-up pass on an AstCanonView,
+    //       so digest(a) == digest(b) if ast_equal(a, b). Each node is
+    //       written as its type, its value and the digests of its
+    //       children in little endian, and hashed by MurmurHash3 x64 128.
+    //       The alternatives are hashed in their sorted order. The digests
+    //       do not depend on the atoms, the platform or the source order
+    //       of the alternatives, so they can be stored.
+    class AstDigester
+    {
+    public:
+        AstDigester()
+        {
+        }
+
+        // NOTE: If children is not NULL, it receives the digests of the
+        //       children of the canonical root, e.g. of the rules.
+        AstDigest digest(const BaseAst *ast, std::vector<AstDigest> *children = NULL);
+
+        static AstDigest murmur3(const unsigned char *data, size_t size, uint32_t seed = 0);
+
+    protected:
+        AstCanonView                                            m_view;
+        std::vector<std::pair<AstCanonView::node_type, bool> >  m_stack;
+        std::vector<AstDigest>                                  m_made;
+        std::vector<unsigned char>                              m_buffer;
+
+        AstDigest make(AstCanonView::node_type node, const AstDigest *children,
+                       size_t count);
+
+        void put_u32(uint32_t value)
+        {
+            unsigned char bytes[4];
+            for (int i = 0; i < 4; ++i)
+                bytes[i] = (unsigned char)(value >> (i * 8));
+            m_buffer.insert(m_buffer.end(), bytes, bytes + 4);
+        }
+        void put_u64(uint64_t value)
+        {
+            unsigned char bytes[8];
+            for (int i = 0; i < 8; ++i)
+                bytes[i] = (unsigned char)(value >> (i * 8));
+            m_buffer.insert(m_buffer.end(), bytes, bytes + 8);
+        }
+        void put_str(const string_type& str)
+        {
+            put_u32(uint32_t(str.size()));
+            m_buffer.insert(m_buffer.end(), str.begin(), str.end());
+        }
+
+        static uint64_t rotl64(uint64_t x, int r)
+        {
+            return (x << r) | (x >> (64 - r));
+        }
+        static uint64_t fmix64(uint64_t k)
+        {
+            k ^= k >> 33;
+            k *= 0xFF51AFD7ED558CCDULL;
+            k ^= k >> 33;
+            k *= 0xC4CEB9FE1A85EC53ULL;
+            k ^= k >> 33;
+            return k;
+        }
+        static uint64_t load64(const unsigned char *p)
+        {
+            uint64_t value = 0;
+            for (int i = 8; i-- > 0; )
+                value = (value << 8) | p[i];
+            return value;
+        }
+
+    private:
+        AstDigester(const AstDigester&);
+        AstDigester& operator=(const AstDigester&);
+    };
+
+    // the digest of a tree
+    inline AstDigest ast_digest(const BaseAst *ast)
+    {
+        AstDigester digester;
+        return digester.digest(ast);
+    }
+
+    // the digest of a grammar, and the digests of its rules in order
+    inline AstDigest ast_digest(const BaseAst *rules, std::vector<AstDigest>& rule_digests)
+    {
+        assert(ast_get_rules_vector(rules));
+        AstDigester digester;
+        return digester.digest(rules, &rule_digests);
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    // AstDigester inlines
+
+    inline AstDigest
+    AstDigester::digest(const BaseAst *ast, std::vector<AstDigest> *children)
+    {
+        assert(ast);
+        m_stack.clear();
+        m_made.clear();
+        m_stack.push_back(std::make_pair(m_view.build(ast), false));
+        while (!m_stack.empty())
+        {
+            const AstCanonView::node_type node = m_stack.back().first;
+            const size_t count = m_view.count(node);
+            if (!m_stack.back().second)
+            {
+                m_stack.back().second = true;
+                for (size_t i = count; i-- > 0; )
+                {
+                    m_stack.push_back(std::make_pair(m_view.child(node, i), false));
+                }
+                continue;
+            }
+            m_stack.pop_back();
+
+            const size_t first = m_made.size() - count;
+            const AstDigest made = make(node, m_made.data() + first, count);
+            if (children && m_stack.empty())
+                children->assign(m_made.begin() + first, m_made.end());
+            m_made.resize(first);
+            m_made.push_back(made);
+        }
+
+        assert(m_made.size() == 1);
+        return m_made.back();
+    }
+
+    // NOTE: An empty string is written as EmptyAst, as sorted_clone()
+    //       makes it.
+    inline AstDigest
+    AstDigester::make(AstCanonView::node_type node, const AstDigest *children, size_t count)
+    {
+        const BaseAst *ast = m_view.ast(node);
+        const AstType atype = m_view.atype(node);
+        m_buffer.clear();
+        m_buffer.push_back((unsigned char)atype);
+        switch (atype)
+        {
+        case ATYPE_INTEGER:
+            put_u32(uint32_t(ast->get_int_ast()->m_integer));
+            break;
+        case ATYPE_STRING:
+            put_str(ast->get_str_ast()->m_str);
+            break;
+        case ATYPE_IDENT:
+            put_str(ast->get_ident_ast()->m_name);
+            break;
+        case ATYPE_SPECIAL:
+            put_str(ast->get_special_ast()->m_str);
+            break;
+        case ATYPE_UNARY:
+            m_buffer.push_back((unsigned char)ast->get_unary_ast()->m_type);
+            break;
+        case ATYPE_BINARY:
+            m_buffer.push_back((unsigned char)ast->get_bin_ast()->m_type);
+            break;
+        case ATYPE_SEQ:
+            m_buffer.push_back((unsigned char)ast->get_seq_ast()->m_type);
+            break;
+        case ATYPE_EMPTY:
+        case ATYPE_LAZY:
+            break;
+        }
+
+        put_u32(uint32_t(count));
+        for (size_t i = 0; i < count; ++i)
+        {
+            put_u64(children[i].m_hash1);
+            put_u64(children[i].m_hash2);
+        }
+        return murmur3(m_buffer.data(), m_buffer.size());
+    }
+
+    // MurmurHash3_x64_128 by Austin Appleby (public domain)
+    inline AstDigest
+    AstDigester::murmur3(const unsigned char *data, size_t size, uint32_t seed)
+    {
+        const uint64_t c1 = 0x87C37B91114253D5ULL;
+        const uint64_t c2 = 0x4CF5AD432745937FULL;
+        uint64_t h1 = seed, h2 = seed;
+
+        const size_t nblocks = size / 16;
+        for (size_t i = 0; i < nblocks; ++i)
+        {
+            uint64_t k1 = load64(data + i * 16);
+            uint64_t k2 = load64(data + i * 16 + 8);
+
+            k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+            h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52DCE729;
+
+            k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+            h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495AB5;
+        }
+
+        const unsigned char *tail = data + nblocks * 16;
+        const size_t rest = size & 15;
+        uint64_t k1 = 0, k2 = 0;
+        for (size_t i = rest; i-- > 8; )
+            k2 ^= uint64_t(tail[i]) << ((i - 8) * 8);
+        if (rest > 8)
+        {
+            k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        }
+        for (size_t i = (rest < 8 ? rest : 8); i-- > 0; )
+            k1 ^= uint64_t(tail[i]) << (i * 8);
+        if (rest > 0)
+        {
+            k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        }
+
+        h1 ^= size;
+        h2 ^= size;
+        h1 += h2;
+        h2 += h1;
+        h1 = fmix64(h1);
+        h2 = fmix64(h2);
+        h1 += h2;
+        h2 += h1;
+
+        AstDigest digest = { h1, h2 };
+        return digest;
+    }
+} // namespace bnf_ast
+
+/////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef AST_DIGEST_HPP_
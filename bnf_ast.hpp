@@ -9,7 +9,14 @@
 #include <vector>           // for std::vector
 #include <sstream>          // for std::stringstream
 #include <cassert>          // for assert macro
-#include <algorithm>        // for std::sort
+#include <cstring>          // for std::memcmp
+#include <cstddef>          // for ptrdiff_t
+#include <algorithm>        // for std::sort, std::swap
+#include <utility>          // for std::forward, std::pair
+#include <new>              // for placement new
+#include <mutex>            // for std::mutex, std::lock_guard, std::call_once
+#include <atomic>           // for std::atomic
+#include <memory>           // for std::shared_ptr
 
 /////////////////////////////////////////////////////////////////////////
 
@@ -19,6 +26,156 @@ namespace bnf_ast
     typedef std::stringstream   os_type;
     typedef std::vector<string_type>  names_type;
 
+    /////////////////////////////////////////////////////////////////////////
+    // AtomTable --- the interning table of names and strings
+
+    typedef size_t atom_type;
+    static const atom_type ATOM_NONE = atom_type(-1);
+
+    // NOTE: An atom is a small integer that identifies a string. The same
+    //       string has the same atom, so the atoms are compared in O(1).
+    //       The interned strings never move. The table is split into
+    //       SHARD_COUNT shards by the hash. intern(), intern_name() and
+    //       find() first probe the published buckets of the shard without
+    //       any lock, so a string already interned costs no lock; only a
+    //       new string locks its shard. str(), dashed(), hash() and size()
+    //       never lock. The parsers on several threads can share the table.
+    // NOTE: The table keeps every distinct string since the last clear(),
+    //       so its memory grows with the vocabulary, not with the input.
+    //       A long-running service that parses many inputs calls clear()
+    //       between its batches, once it holds no AST, token stream,
+    //       FlatAst or HashConsFactory of the former batch.
+    class AtomTable
+    {
+    public:
+        AtomTable() : m_size(0)
+        {
+            init();
+        }
+        ~AtomTable()
+        {
+            free_all();
+        }
+
+        atom_type intern(const char *str, size_t len);
+        atom_type intern(const string_type& str)
+        {
+            return intern(str.c_str(), str.size());
+        }
+        // intern_name() interns a meta identifier, with every '-' and ' '
+        // converted to '_' (see IdentAst).
+        atom_type intern_name(const char *str, size_t len);
+        atom_type find(const string_type& str) const;
+
+        const string_type& str(atom_type atom) const
+        {
+            return entry(atom).m_str;
+        }
+        // the name whose every '_' and ' ' is converted to '-'
+        const string_type& dashed(atom_type atom) const
+        {
+            return entry(atom).m_dashed;
+        }
+        size_t hash(atom_type atom) const
+        {
+            return entry(atom).m_hash;
+        }
+        size_t size() const
+        {
+            return m_size.load(std::memory_order_acquire);
+        }
+
+        // NOTE: clear() frees every string. No AST node, token, FlatAst
+        //       or other table may hold an atom then, and no other thread
+        //       may use the table.
+        void clear();
+
+        static size_t hash_of(const char *str, size_t len)
+        {
+            // FNV-1a
+            size_t h = 2166136261U;
+            for (size_t i = 0; i < len; ++i)
+            {
+                h ^= (unsigned char)str[i];
+                h *= 16777619U;
+            }
+            return h;
+        }
+
+    protected:
+        struct Entry
+        {
+            string_type m_str;
+            string_type m_dashed;
+            size_t      m_hash;
+        };
+        // NOTE: The buckets of a shard are replaced, never resized, so a
+        //       reader that loaded the old ones still probes valid memory.
+        //       The old buckets are freed by clear().
+        struct Buckets
+        {
+            size_t                      m_mask;
+            std::atomic<atom_type>     *m_slots;   // open addressing
+        };
+        struct Shard
+        {
+            std::mutex                  m_mutex;
+            std::atomic<Buckets *>      m_buckets;
+            std::vector<Buckets *>      m_old;
+            size_t                      m_count;
+        };
+        // NOTE: The chunk k holds FIRST_CHUNK << k entries. A chunk is
+        //       never moved, and its pointer is published before any atom
+        //       in it is given out, so the readers need no lock.
+        enum
+        {
+            FIRST_CHUNK = 256, CHUNK_COUNT = 48,
+            SHARD_COUNT = 16, SHARD_BITS = 4, FIRST_BUCKETS = 16
+        };
+        std::atomic<Entry *>    m_chunks[CHUNK_COUNT];
+        std::atomic<size_t>     m_size;
+        Shard                   m_shards[SHARD_COUNT];
+        std::mutex              m_chunk_mutex;
+
+        static size_t chunk_of(size_t index, size_t& offset)
+        {
+            size_t n = index / FIRST_CHUNK + 1, chunk = 0;
+            while (n >>= 1)
+                ++chunk;
+            offset = index - FIRST_CHUNK * ((size_t(1) << chunk) - 1);
+            return chunk;
+        }
+        const Entry& entry(atom_type atom) const
+        {
+            size_t offset;
+            const size_t chunk = chunk_of(atom, offset);
+            assert(chunk < CHUNK_COUNT);
+            const Entry *entries = m_chunks[chunk].load(std::memory_order_acquire);
+            assert(entries);
+            return entries[offset];
+        }
+        static Buckets *new_buckets(size_t count);
+        static void delete_buckets(Buckets *buckets);
+        size_t lookup(const Buckets *buckets, const char *str, size_t len,
+                      size_t h) const;
+        atom_type probe(const char *str, size_t len, size_t h) const;
+        atom_type insert(const char *str, size_t len, size_t h);
+        Entry& new_entry(atom_type atom);
+        void rehash(Shard& shard);
+        void init();
+        void free_all();
+
+    private:
+        AtomTable(const AtomTable&);
+        AtomTable& operator=(const AtomTable&);
+    };
+
+    inline AtomTable& atom_table()
+    {
+        static AtomTable s_table;
+        return s_table;
+    }
+
     enum AstType
     {
         ATYPE_INTEGER,
@@ -28,8 +185,85 @@ namespace bnf_ast
         ATYPE_UNARY,
         ATYPE_SEQ,
         ATYPE_SPECIAL,
-        ATYPE_EMPTY
+        ATYPE_EMPTY,
+        ATYPE_LAZY
+    };
+
+    // NOTE: The subtypes are ordered as their names are.
+    enum SeqType
+    {
+        SEQ_EXPR,           // "expr"
+        SEQ_RULES,          // "rules"
+        SEQ_TERMS           // "terms"
     };
+    enum UnaryType
+    {
+        UNARY_STAR,         // "*"
+        UNARY_PLUS,         // "+"
+        UNARY_QUESTION,     // "?"
+        UNARY_GROUP,        // "group"
+        UNARY_OPTIONAL,     // "optional"
+        UNARY_REPEATED      // "repeated"
+    };
+    enum BinaryType
+    {
+        BINARY_TIMES,       // "*"
+        BINARY_EXCEPT,      // "-"
+        BINARY_RULE         // "rule"
+    };
+
+    inline const string_type& seq_type_to_str(SeqType type)
+    {
+        static const string_type s_names[] = { "expr", "rules", "terms" };
+        return s_names[type];
+    }
+    inline const string_type& unary_type_to_str(UnaryType type)
+    {
+        static const string_type s_names[] =
+        {
+            "*", "+", "?", "group", "optional", "repeated"
+        };
+        return s_names[type];
+    }
+    inline const string_type& binary_type_to_str(BinaryType type)
+    {
+        static const string_type s_names[] = { "*", "-", "rule" };
+        return s_names[type];
+    }
+
+    inline SeqType str_to_seq_type(const string_type& str)
+    {
+        if (str == "expr")
+            return SEQ_EXPR;
+        if (str == "rules")
+            return SEQ_RULES;
+        assert(str == "terms");
+        return SEQ_TERMS;
+    }
+    inline UnaryType str_to_unary_type(const string_type& str)
+    {
+        if (str == "*")
+            return UNARY_STAR;
+        if (str == "+")
+            return UNARY_PLUS;
+        if (str == "?")
+            return UNARY_QUESTION;
+        if (str == "group")
+            return UNARY_GROUP;
+        if (str == "optional")
+            return UNARY_OPTIONAL;
+        assert(str == "repeated");
+        return UNARY_REPEATED;
+    }
+    inline BinaryType str_to_binary_type(const string_type& str)
+    {
+        if (str == "*")
+            return BINARY_TIMES;
+        if (str == "-")
+            return BINARY_EXCEPT;
+        assert(str == "rule");
+        return BINARY_RULE;
+    }
 
     struct BaseAst;
         struct IntegerAst;
@@ -40,20 +274,164 @@ namespace bnf_ast
         struct SeqAst;
         struct SpecialAst;
         struct EmptyAst;
+        struct LazyAst;
+
+    // ast_delete() deletes a node unless it belongs to an arena.
+    void ast_delete(BaseAst *ast);
+
+    /////////////////////////////////////////////////////////////////////////
+    // AstArena --- the monotonic allocator of AST nodes
+
+    // NOTE: The nodes made by an arena are released all at once by clear()
+    //       or the destructor, in O(blocks) for the leaves. The nodes that
+    //       may own heap memory (sequences, specials, unary and binary
+    //       nodes) are destructed then. ast_delete() on an arena node does
+    //       nothing; the node lives until the arena is cleared.
+    class AstArena
+    {
+    public:
+        enum { BLOCK_SIZE = 64 * 1024 };
+
+        AstArena() : m_block(0), m_ptr(NULL), m_left(0), m_count(0)
+        {
+        }
+        ~AstArena();
+
+        template <typename T, typename... T_ARGS>
+        T *make(T_ARGS&&... args)
+        {
+            void *ptr = allocate(sizeof(T), alignof(T));
+            T *ast = new(ptr) T(std::forward<T_ARGS>(args)...);
+            ast->m_arena = this;
+            ++m_count;
+            if (needs_finalizer(ast->m_atype))
+                m_finalizers.push_back(ast);
+            return ast;
+        }
+
+        void clear();
+
+        // the number of the nodes made
+        size_t size() const
+        {
+            return m_count;
+        }
+        size_t block_count() const
+        {
+            return m_blocks.size();
+        }
+
+    protected:
+        std::vector<char *>     m_blocks;
+        size_t                  m_block;    // the current block
+        char                   *m_ptr;
+        size_t                  m_left;     // the bytes left in the block
+        size_t                  m_count;
+        std::vector<BaseAst *>  m_finalizers;
+
+        void *allocate(size_t size, size_t align);
+        static bool needs_finalizer(AstType atype)
+        {
+            return atype == ATYPE_SEQ || atype == ATYPE_SPECIAL ||
+                   atype == ATYPE_UNARY || atype == ATYPE_BINARY ||
+                   atype == ATYPE_LAZY;
+        }
+
+    private:
+        AstArena(const AstArena&);
+        AstArena& operator=(const AstArena&);
+    };
+
+    // NOTE: ast_delete(), ast_clone(), ast_sorted_clone(), ast_empty() and
+    //       the printers walk the tree with an explicit stack, so a deeply
+    //       nested tree does not overflow the call stack. The methods of
+    //       the nodes call them.
+    BaseAst *ast_clone(const BaseAst *ast, AstArena *arena = NULL);
+    BaseAst *ast_sorted_clone(const BaseAst *ast, AstArena *arena = NULL);
+    bool ast_empty(const BaseAst *ast);
+    void ast_to_dbg(os_type& os, const BaseAst *ast);
+    void ast_to_bnf(os_type& os, const BaseAst *ast);
+    void ast_to_ebnf(os_type& os, const BaseAst *ast);
+
+    // ast_new() makes a node in the arena if any, or by new.
+    template <typename T, typename... T_ARGS>
+    inline T *ast_new(AstArena *arena, T_ARGS&&... args)
+    {
+        if (arena)
+            return arena->make<T>(std::forward<T_ARGS>(args)...);
+        return new T(std::forward<T_ARGS>(args)...);
+    }
+
+    // AstTree owns a detached tree and its arena (if any).
+    class AstTree
+    {
+    public:
+        AstTree() : m_root(NULL), m_arena(NULL)
+        {
+        }
+        AstTree(BaseAst *root, AstArena *arena) : m_root(root), m_arena(arena)
+        {
+        }
+        AstTree(AstTree&& other) : m_root(other.m_root), m_arena(other.m_arena)
+        {
+            other.m_root = NULL;
+            other.m_arena = NULL;
+        }
+        AstTree& operator=(AstTree&& other)
+        {
+            if (this != &other)
+            {
+                reset();
+                std::swap(m_root, other.m_root);
+                std::swap(m_arena, other.m_arena);
+            }
+            return *this;
+        }
+        ~AstTree()
+        {
+            reset();
+        }
+
+        BaseAst *get() const
+        {
+            return m_root;
+        }
+        BaseAst *operator->() const
+        {
+            return m_root;
+        }
+        AstArena *arena() const
+        {
+            return m_arena;
+        }
+        void reset();
+
+    protected:
+        BaseAst    *m_root;
+        AstArena   *m_arena;   // owned
+
+    private:
+        AstTree(const AstTree&);
+        AstTree& operator=(const AstTree&);
+    };
 
     struct BaseAst
     {
         AstType m_atype;
+        size_t  m_begin;    // source span (offset of the first character)
+        size_t  m_end;      // source span (offset next to the last character)
+        AstArena *m_arena;  // the owner arena, or NULL if allocated by new
 
 #ifndef NDEBUG
-        static int& alive_count()
+        static std::atomic<int>& alive_count()
         {
-            static int s_count = 0;
+            static std::atomic<int> s_count(0);
             return s_count;
         }
 #endif
 
-        BaseAst(AstType atype) : m_atype(atype)
+        BaseAst(AstType atype)
+            : m_atype(atype), m_begin(0), m_end(0), m_arena(NULL)
         {
             #ifndef NDEBUG
                 ++alive_count();
@@ -70,8 +448,9 @@ namespace bnf_ast
         virtual void to_dbg(os_type& os) const = 0;
         virtual void to_bnf(os_type& os) const = 0;
         virtual void to_ebnf(os_type& os) const = 0;
-        virtual BaseAst *clone() const = 0;
-        virtual BaseAst *sorted_clone() const = 0;
+        // The clones are allocated in the arena if any, or by new.
+        virtual BaseAst *clone(AstArena *arena = NULL) const = 0;
+        virtual BaseAst *sorted_clone(AstArena *arena = NULL) const = 0;
 
         template <typename T, AstType atype>
         T *get_ast();
@@ -85,6 +464,7 @@ namespace bnf_ast
         UnaryAst *get_unary_ast();
         SeqAst *get_seq_ast();
         SpecialAst *get_special_ast();
+        LazyAst *get_lazy_ast();
 
         const IntegerAst *get_int_ast() const;
         const StringAst *get_str_ast() const;
@@ -93,6 +473,7 @@ namespace bnf_ast
         const UnaryAst *get_unary_ast() const;
         const SeqAst *get_seq_ast() const;
         const SpecialAst *get_special_ast() const;
+        const LazyAst *get_lazy_ast() const;
 
         SeqAst *get_expr();
         SeqAst *get_terms();
@@ -113,11 +494,13 @@ namespace bnf_ast
     struct IdentAst : public BaseAst
     {
         // NOTE: Every '-' and ' ' will be converted to '_'.
-        string_type     m_name;     // generic name
+        atom_type           m_atom;
+        const string_type&  m_name;     // generic name (atom_table().str(m_atom))
 
         IdentAst(const string_type& name);
-        string_type bnf_name() const;
-        string_type ebnf_name() const;
+        IdentAst(atom_type atom);
+        const string_type& bnf_name() const;
+        const string_type& ebnf_name() const;
 
         virtual bool empty() const
         {
@@ -135,13 +518,13 @@ namespace bnf_ast
         {
             os << ebnf_name();
         }
-        virtual BaseAst *clone() const
+        virtual BaseAst *clone(AstArena *arena = NULL) const
         {
-            return new IdentAst(m_name);
+            return ast_new<IdentAst>(arena, m_atom);
         }
-        virtual BaseAst *sorted_clone() const
+        virtual BaseAst *sorted_clone(AstArena *arena = NULL) const
         {
-            return clone();
+            return clone(arena);
         }
     };
 
@@ -168,21 +551,29 @@ namespace bnf_ast
         {
             os << m_integer;
         }
-        virtual BaseAst *clone() const
+        virtual BaseAst *clone(AstArena *arena = NULL) const
         {
-            return new IntegerAst(m_integer);
+            return ast_new<IntegerAst>(arena, m_integer);
         }
-        virtual BaseAst *sorted_clone() const
+        virtual BaseAst *sorted_clone(AstArena *arena = NULL) const
         {
-            return clone();
+            return clone(arena);
         }
     };
 
     struct StringAst : public BaseAst
     {
-        string_type m_str;  // unquoted string
+        atom_type           m_atom;
+        const string_type&  m_str;  // unquoted string (atom_table().str(m_atom))
 
-        StringAst(const string_type& str) : BaseAst(ATYPE_STRING), m_str(str)
+        StringAst(const string_type& str)
+            : BaseAst(ATYPE_STRING), m_atom(atom_table().intern(str)),
+              m_str(atom_table().str(m_atom))
+        {
+        }
+        StringAst(atom_type atom)
+            : BaseAst(ATYPE_STRING), m_atom(atom),
+              m_str(atom_table().str(m_atom))
         {
         }
         virtual bool empty() const
@@ -211,11 +602,11 @@ namespace bnf_ast
             else
                 os << "'" << m_str << "'";
         }
-        virtual BaseAst *clone() const
+        virtual BaseAst *clone(AstArena *arena = NULL) const
         {
-            return new StringAst(m_str);
+            return ast_new<StringAst>(arena, m_atom);
         }
-        virtual BaseAst *sorted_clone() const;
+        virtual BaseAst *sorted_clone(AstArena *arena = NULL) const;
     };
 
     struct SpecialAst : public BaseAst
@@ -241,29 +632,81 @@ namespace bnf_ast
         {
             os << '?' << m_str << '?';
         }
-        virtual BaseAst *clone() const
+        virtual BaseAst *clone(AstArena *arena = NULL) const
+        {
+            return ast_new<SpecialAst>(arena, m_str);
+        }
+        virtual BaseAst *sorted_clone(AstArena *arena = NULL) const
+        {
+            return clone(arena);
+        }
+    };
+
+    // NOTE: AstCanonMemo is the canonical form that ast_canonical() keeps
+    //       in a UnaryAst, a BinaryAst or a SeqAst. The mutators of these
+    //       nodes call ast_modified(), which drops the forms kept in the
+    //       node and its ancestors. Changing m_arg, m_left, m_right, m_vec
+    //       or a leaf by hand bypasses the memo; call ast_modified() on the
+    //       node changed, or on the parent of the leaf, afterwards. A copy
+    //       of a node keeps nothing.
+    struct AstCanonMemo
+    {
+        BaseAst *m_parent;      // the nearest ancestor with a memo, or NULL
+        BaseAst *m_canonical;   // the canonical form, the node itself, or NULL
+
+        AstCanonMemo() : m_parent(NULL), m_canonical(NULL)
+        {
+        }
+        AstCanonMemo(const AstCanonMemo&) : m_parent(NULL), m_canonical(NULL)
         {
-            return new SpecialAst(m_str);
         }
-        virtual BaseAst *sorted_clone() const
+        AstCanonMemo& operator=(const AstCanonMemo&)
         {
-            return clone();
+            return *this;
+        }
+
+        // drop() deletes the canonical form unless it is the owner itself.
+        void drop(const BaseAst *owner)
+        {
+            if (m_canonical != owner)
+                ast_delete(m_canonical);
+            m_canonical = NULL;
         }
     };
 
+    // the memo of a UnaryAst, a BinaryAst or a SeqAst, or NULL
+    AstCanonMemo *ast_memo(const BaseAst *ast);
+    void ast_set_parent(BaseAst *child, BaseAst *parent);
+
     struct UnaryAst : public BaseAst
     {
-        string_type m_str;  // "+", "*", "?", "optional", "repeated", or "group"
+        UnaryType m_type;
         BaseAst *m_arg;
+        mutable AstCanonMemo m_memo;
 
+        UnaryAst(UnaryType type, BaseAst *arg = NULL)
+            : BaseAst(ATYPE_UNARY), m_type(type), m_arg(arg)
+        {
+            ast_set_parent(m_arg, this);
+        }
         UnaryAst(const string_type& str, BaseAst *arg = NULL)
-            : BaseAst(ATYPE_UNARY), m_str(str), m_arg(arg)
+            : BaseAst(ATYPE_UNARY), m_type(str_to_unary_type(str)), m_arg(arg)
+        {
+            ast_set_parent(m_arg, this);
+        }
+        // "+", "*", "?", "optional", "repeated", or "group"
+        const string_type& str() const
         {
+            return unary_type_to_str(m_type);
         }
         ~UnaryAst()
         {
-            delete m_arg;
+            ast_delete(m_arg);
+            m_memo.drop(this);
         }
+        // NOTE: These functions return the old child, no longer owned,
+        //       and call ast_modified().
+        BaseAst *set_arg(BaseAst *ast);
         virtual bool empty() const
         {
             return false;
@@ -271,41 +714,55 @@ namespace bnf_ast
         virtual void to_dbg(os_type& os) const;
         virtual void to_bnf(os_type& os) const;
         virtual void to_ebnf(os_type& os) const;
-        virtual BaseAst *clone() const
+        virtual BaseAst *clone(AstArena *arena = NULL) const
         {
-            if (m_arg)
-            {
-                return new UnaryAst(m_str, m_arg->clone());
-            }
-            return new UnaryAst(m_str);
+            return ast_clone(this, arena);
         }
-        virtual BaseAst *sorted_clone() const
+        virtual BaseAst *sorted_clone(AstArena *arena = NULL) const
         {
-            if (m_arg)
-            {
-                return new UnaryAst(m_str, m_arg->sorted_clone());
-            }
-            return new UnaryAst(m_str);
+            return ast_sorted_clone(this, arena);
         }
     };
 
     struct BinaryAst : public BaseAst
     {
-        string_type m_str;  // "rule", "-", or "*"
+        BinaryType m_type;
         BaseAst *m_left;
         BaseAst *m_right;
+        mutable AstCanonMemo m_memo;
 
+        BinaryAst(BinaryType type, BaseAst *left, BaseAst *right)
+            : BaseAst(ATYPE_BINARY), m_type(type), m_left(left), m_right(right)
+        {
+            assert(m_left);
+            assert(m_right);
+            ast_set_parent(m_left, this);
+            ast_set_parent(m_right, this);
+        }
         BinaryAst(const string_type& str, BaseAst *left, BaseAst *right)
-            : BaseAst(ATYPE_BINARY), m_str(str), m_left(left), m_right(right)
+            : BaseAst(ATYPE_BINARY), m_type(str_to_binary_type(str)),
+              m_left(left), m_right(right)
         {
             assert(m_left);
             assert(m_right);
+            ast_set_parent(m_left, this);
+            ast_set_parent(m_right, this);
+        }
+        // "rule", "-", or "*"
+        const string_type& str() const
+        {
+            return binary_type_to_str(m_type);
         }
         ~BinaryAst()
         {
-            delete m_left;
-            delete m_right;
+            ast_delete(m_left);
+            ast_delete(m_right);
+            m_memo.drop(this);
         }
+        // NOTE: These functions return the old child, no longer owned,
+        //       and call ast_modified().
+        BaseAst *set_left(BaseAst *ast);
+        BaseAst *set_right(BaseAst *ast);
         virtual bool empty() const
         {
             return false;
@@ -313,53 +770,73 @@ namespace bnf_ast
         virtual void to_dbg(os_type& os) const;
         virtual void to_bnf(os_type& os) const;
         virtual void to_ebnf(os_type& os) const;
-        virtual BaseAst *clone() const
+        virtual BaseAst *clone(AstArena *arena = NULL) const
         {
-            return new BinaryAst(m_str, m_left->clone(), m_right->clone());
+            return ast_clone(this, arena);
         }
-        virtual BaseAst *sorted_clone() const
+        virtual BaseAst *sorted_clone(AstArena *arena = NULL) const
         {
-            BaseAst *left = m_left->sorted_clone();
-            BaseAst *right = m_right->sorted_clone();
-            return new BinaryAst(m_str, left, right);
+            return ast_sorted_clone(this, arena);
         }
     };
     typedef std::vector<BinaryAst *> rules_vector;
 
     struct SeqAst : public BaseAst
     {
-        string_type m_str;  // "rules", "expr", or "terms"
+        SeqType m_type;
         std::vector<BaseAst *> m_vec;
+        mutable AstCanonMemo m_memo;
 
-        SeqAst(const string_type& str) : BaseAst(ATYPE_SEQ), m_str(str)
+        SeqAst(SeqType type) : BaseAst(ATYPE_SEQ), m_type(type)
+        {
+        }
+        SeqAst(const string_type& str)
+            : BaseAst(ATYPE_SEQ), m_type(str_to_seq_type(str))
         {
         }
+        SeqAst(SeqType type, BaseAst *ast) : BaseAst(ATYPE_SEQ), m_type(type)
+        {
+            assert(ast);
+            ast_set_parent(ast, this);
+            m_vec.push_back(ast);
+        }
         SeqAst(const string_type& str, BaseAst *ast)
-            : BaseAst(ATYPE_SEQ), m_str(str)
+            : BaseAst(ATYPE_SEQ), m_type(str_to_seq_type(str))
         {
             assert(ast);
+            ast_set_parent(ast, this);
             m_vec.push_back(ast);
         }
+        // "rules", "expr", or "terms"
+        const string_type& str() const
+        {
+            return seq_type_to_str(m_type);
+        }
         ~SeqAst()
         {
             for (size_t i = 0; i < size(); ++i)
             {
-                delete m_vec[i];
+                ast_delete(m_vec[i]);
             }
+            m_memo.drop(this);
         }
-        void push_back(BaseAst *ast)
-        {
-            assert(ast);
-            m_vec.push_back(ast);
-        }
+        // NOTE: These functions change m_vec, and call ast_modified().
+        void push_back(BaseAst *ast);
+        template <typename T_ITER>
+        void insert(size_t index, T_ITER first, T_ITER last);
+        // erase() deletes the children in [first, last).
+        void erase(size_t first, size_t last);
+        // replace() returns the old child, no longer owned.
+        BaseAst *replace(size_t index, BaseAst *ast);
+
         size_t size() const
         {
             return m_vec.size();
         }
         virtual bool empty() const;
         void unique();
-        virtual BaseAst *clone() const;
-        virtual BaseAst *sorted_clone() const;
+        virtual BaseAst *clone(AstArena *arena = NULL) const;
+        virtual BaseAst *sorted_clone(AstArena *arena = NULL) const;
         virtual void to_dbg(os_type& os) const;
         virtual void to_bnf(os_type& os) const;
         virtual void to_ebnf(os_type& os) const;
@@ -385,19 +862,130 @@ namespace bnf_ast
         virtual void to_ebnf(os_type& os) const
         {
         }
-        virtual BaseAst *clone() const
+        virtual BaseAst *clone(AstArena *arena = NULL) const
+        {
+            return ast_new<EmptyAst>(arena);
+        }
+        virtual BaseAst *sorted_clone(AstArena *arena = NULL) const
+        {
+            return clone(arena);
+        }
+    };
+
+    // LazySource parses the bodies of LazyAst on demand.
+    struct LazySource
+    {
+        virtual ~LazySource()
+        {
+        }
+        // parse_body() returns a new SeqAst("expr"), or NULL on error.
+        virtual BaseAst *parse_body(const LazyAst *lazy) = 0;
+    };
+
+    // NOTE: LazyAst stands for a rule body not parsed yet. m_begin is the
+    //       offset after the '=' and m_end is the offset next to the ';'.
+    //       body() parses the body at the first access and keeps it. A body
+    //       that fails to parse becomes empty and failed() is true. The
+    //       printers and the comparisons see through a LazyAst, and
+    //       ast_get_rule_body() returns NULL for a failed body.
+    //       The body is parsed once by std::call_once, so the readers may
+    //       share a lazy tree between threads. Changing it is not
+    //       thread-safe, as for the other nodes.
+    struct LazyAst : public BaseAst
+    {
+        std::shared_ptr<LazySource> m_source;
+        size_t                      m_line;     // the line of m_begin
+        size_t                      m_head;     // the line head of m_begin
+        mutable BaseAst            *m_body;
+        mutable bool                m_failed;
+        mutable std::atomic<bool>   m_parsed;
+        mutable std::once_flag      m_once;
+
+        LazyAst(const std::shared_ptr<LazySource>& source, size_t begin, size_t end,
+                size_t line, size_t head)
+            : BaseAst(ATYPE_LAZY), m_source(source), m_line(line), m_head(head),
+              m_body(NULL), m_failed(false), m_parsed(false)
+        {
+            m_begin = begin;
+            m_end = end;
+        }
+        ~LazyAst()
+        {
+            ast_delete(m_body);
+        }
+
+        bool parsed() const
+        {
+            return m_parsed.load(std::memory_order_acquire);
+        }
+        bool failed() const
+        {
+            body();
+            return m_failed;
+        }
+        BaseAst *body() const;
+
+        virtual bool empty() const
+        {
+            return ast_empty(body());
+        }
+        virtual void to_dbg(os_type& os) const
+        {
+            ast_to_dbg(os, body());
+        }
+        virtual void to_bnf(os_type& os) const
+        {
+            ast_to_bnf(os, body());
+        }
+        virtual void to_ebnf(os_type& os) const
+        {
+            ast_to_ebnf(os, body());
+        }
+        // NOTE: A clone shares the source, and stays lazy if not parsed.
+        virtual BaseAst *clone(AstArena *arena = NULL) const
         {
-            return new EmptyAst();
+            LazyAst *ret = ast_new<LazyAst>(arena, m_source, m_begin, m_end, m_line, m_head);
+            if (parsed())
+            {
+                ret->m_body = ast_clone(m_body, arena);
+                ret->m_failed = m_failed;
+                ret->m_parsed = true;
+            }
+            return ret;
         }
-        virtual BaseAst *sorted_clone() const
+        virtual BaseAst *sorted_clone(AstArena *arena = NULL) const
         {
-            return clone();
+            return ast_sorted_clone(body(), arena);
         }
+
+    protected:
+        void make_body() const;
     };
 
+    // ast_resolve() returns the body of a LazyAst, or ast itself.
+    inline BaseAst *ast_resolve(BaseAst *ast)
+    {
+        if (LazyAst *lazy = ast->get_lazy_ast())
+            return lazy->body();
+        return ast;
+    }
+    inline const BaseAst *ast_resolve(const BaseAst *ast)
+    {
+        if (const LazyAst *lazy = ast->get_lazy_ast())
+            return lazy->body();
+        return ast;
+    }
+
     /////////////////////////////////////////////////////////////////////////
     // AST functions
 
+    // NOTE: ast_compare() returns a negative value, zero or a positive
+    //       value as ast1 is less than, equal to or greater than ast2. It
+    //       compares the canonical forms, i.e. those that sorted_clone()
+    //       makes, without making them. If already_sorted, the trees are
+    //       compared as they are.
+    int ast_compare(const BaseAst *ast1, const BaseAst *ast2, bool already_sorted = false);
+
     bool ast_equal(const BaseAst *ast1, const BaseAst *ast2, bool already_sorted = false);
     bool ast_less_than(const BaseAst *ast1, const BaseAst *ast2, bool already_sorted = false);
     bool ast_greater_than(const BaseAst *ast1, const BaseAst *ast2, bool already_sorted = false);
@@ -417,246 +1005,1245 @@ namespace bnf_ast
 
     string_type ast_get_first_rule_name(const BaseAst *rules);
     string_type ast_get_rule_name(const BaseAst *rule);
+    atom_type ast_get_rule_atom(const BaseAst *rule);
     void ast_get_defined_rule_names(names_type& names, const BaseAst *rules);
 
+    // NOTE: ast_get_rule_body() returns NULL if the rule is not found or
+    //       its LazyAst body fails to parse.
           BaseAst *ast_get_rule_body(      BaseAst *rules, const string_type& rule_name);
     const BaseAst *ast_get_rule_body(const BaseAst *rules, const string_type& rule_name);
+          BaseAst *ast_get_rule_body(      BaseAst *rules, atom_type rule_atom);
+    const BaseAst *ast_get_rule_body(const BaseAst *rules, atom_type rule_atom);
 
     bool ast_join_joinable_rules(BaseAst *rules);
 
+    // ast_shift_spans() moves the spans of a tree by delta.
+    void ast_shift_spans(BaseAst *ast, ptrdiff_t delta);
+
+    // NOTE: ast_canonical() returns the canonical form of a tree, i.e.
+    //       sorted_clone(), and keeps it in the node (see AstCanonMemo)
+    //       until the tree is modified. A tree already in the form is its
+    //       own canonical form, and a leaf is too. ast_compare() compares
+    //       the forms kept, if both are.
+    const BaseAst *ast_canonical(const BaseAst *ast);
+    // ast_modified() drops the canonical forms kept in a node and in its
+    // ancestors.
+    void ast_modified(BaseAst *ast);
+
+    // NOTE: ast_canonicalize_in_place() makes a tree into the form that
+    //       sorted_clone() makes, without copying it. The groups are
+    //       flattened, and the alternatives are sorted and made unique.
+    //       The nodes taken off are deleted. A leaf at the root is left
+    //       as it is.
+    void ast_canonicalize_in_place(BaseAst *ast);
+
     void name_increment(string_type& name);
 
     void ast_add_rule(BaseAst *rules, string_type& name, const BaseAst *rule_expr);
 
+    /////////////////////////////////////////////////////////////////////////
+    // AST comparison
+
+    // NOTE: AstSmallStack keeps the first N items in place, so that a walk
+    //       on a small tree allocates nothing.
+    template <typename T, size_t N>
+    class AstSmallStack
+    {
+    public:
+        AstSmallStack() : m_size(0)
+        {
+        }
+        bool empty() const
+        {
+            return m_size == 0;
+        }
+        void push(const T& item)
+        {
+            if (m_size < N)
+                m_local[m_size] = item;
+            else
+                m_more.push_back(item);
+            ++m_size;
+        }
+        T pop()
+        {
+            --m_size;
+            if (m_size < N)
+                return m_local[m_size];
+            T item = m_more.back();
+            m_more.pop_back();
+            return item;
+        }
+
+    protected:
+        T               m_local[N];
+        std::vector<T>  m_more;
+        size_t          m_size;
+    };
+
+    // the children of the nodes as they are, for ast_compare_walk()
+    struct AstSortedTree
+    {
+        typedef const BaseAst *node_type;
+
+        const BaseAst *resolve(node_type node) const
+        {
+            return ast_resolve(node);
+        }
+        const BaseAst *ast(node_type node) const
+        {
+            return node;
+        }
+        // an empty string is compared as EmptyAst
+        AstType atype(node_type node) const
+        {
+            if (node->m_atype == ATYPE_STRING && node->empty())
+                return ATYPE_EMPTY;
+            return node->m_atype;
+        }
+        size_t count(node_type node) const;
+        node_type child(node_type node, size_t i) const;
+    };
+
+    // NOTE: AstCanonView is the canonical form of a tree, the form that
+    //       sorted_clone() makes, as an index of the nodes of the tree
+    //       instead of a copy. The groups are flattened, and the
+    //       alternatives are sorted and unique. build() reuses the memory
+    //       of the last build, and returns the root.
+    class AstCanonView
+    {
+    public:
+        typedef size_t node_type;
+
+        AstCanonView()
+        {
+        }
+
+        node_type build(const BaseAst *ast);
+
+        node_type resolve(node_type node) const
+        {
+            return node;
+        }
+        const BaseAst *ast(node_type node) const
+        {
+            return m_nodes[node].m_ast;
+        }
+        AstType atype(node_type node) const
+        {
+            return m_nodes[node].m_atype;
+        }
+        size_t count(node_type node) const
+        {
+            return m_nodes[node].m_count;
+        }
+        node_type child(node_type node, size_t i) const
+        {
+            return m_children[m_nodes[node].m_first + i];
+        }
+
+    protected:
+        struct Node
+        {
+            const BaseAst  *m_ast;
+            AstType         m_atype;    // ATYPE_EMPTY for an empty string
+            size_t          m_first;    // the first child in m_children
+            size_t          m_count;
+        };
+        struct Frame
+        {
+            const BaseAst  *m_ast;
+            bool            m_splice;   // the children go to the parent
+            bool            m_pushed;   // the children are pushed
+            size_t          m_made;     // the size of m_made at the push
+        };
+        struct Made
+        {
+            node_type       m_node;
+            bool            m_splice;
+        };
+        struct Less
+        {
+            const AstCanonView *m_view;
+            bool operator()(node_type node1, node_type node2) const;
+        };
+
+        std::vector<Node>       m_nodes;
+        std::vector<node_type>  m_children;
+        std::vector<Frame>      m_stack;
+        std::vector<Made>       m_made;
+
+        void push(const BaseAst *ast, bool splice)
+        {
+            Frame frame = { ast_resolve(ast), splice, false, 0 };
+            m_stack.push_back(frame);
+        }
+        void push_children(const BaseAst *ast);
+        void make(const Frame& frame);
+
+    private:
+        AstCanonView(const AstCanonView&);
+        AstCanonView& operator=(const AstCanonView&);
+    };
+
     /////////////////////////////////////////////////////////////////////////
     // AST function inlines
 
-    inline bool ast_equal(const BaseAst *ast1, const BaseAst *ast2, bool already_sorted)
+    template <typename T>
+    inline int ast_compare_values(const T& value1, const T& value2)
     {
-        assert(ast1);
-        assert(ast2);
+        if (value1 < value2)
+            return -1;
+        if (value2 < value1)
+            return 1;
+        return 0;
+    }
 
-        if (ast1->m_atype != ast2->m_atype)
-            return false;
+    // compare the nodes but their children
+    inline int ast_compare_head(const BaseAst *ast1, AstType atype1,
+                                const BaseAst *ast2, AstType atype2)
+    {
+        if (atype1 != atype2)
+            return ast_compare_values(atype1, atype2);
 
-        switch (ast1->m_atype)
+        switch (atype1)
         {
         case ATYPE_INTEGER:
-            {
-                const IntegerAst *i1 = ast1->get_int_ast();
-                const IntegerAst *i2 = ast2->get_int_ast();
-                return i1->m_integer == i2->m_integer;
-            }
-        case ATYPE_STRING:
+            return ast_compare_values(ast1->get_int_ast()->m_integer,
+                                      ast2->get_int_ast()->m_integer);
+        case ATYPE_STRING:
             {
                 const StringAst *s1 = ast1->get_str_ast();
                 const StringAst *s2 = ast2->get_str_ast();
-                return s1->m_str == s2->m_str;
+                if (s1->m_atom == s2->m_atom)
+                    return 0;
+                return s1->m_str.compare(s2->m_str);
             }
         case ATYPE_BINARY:
-            {
-                const BinaryAst *b1 = ast1->get_bin_ast();
-                const BinaryAst *b2 = ast2->get_bin_ast();
-                if (b1->m_str != b2->m_str)
-                    return false;
-                return ast_equal(b1->m_left, b2->m_left, already_sorted) &&
-                       ast_equal(b1->m_right, b2->m_right, already_sorted);
-            }
+            return ast_compare_values(ast1->get_bin_ast()->m_type,
+                                      ast2->get_bin_ast()->m_type);
         case ATYPE_IDENT:
             {
                 const IdentAst *i1 = ast1->get_ident_ast();
                 const IdentAst *i2 = ast2->get_ident_ast();
-                return i1->m_name == i2->m_name;
+                if (i1->m_atom == i2->m_atom)
+                    return 0;
+                return i1->m_name.compare(i2->m_name);
             }
         case ATYPE_UNARY:
+            return ast_compare_values(ast1->get_unary_ast()->m_type,
+                                      ast2->get_unary_ast()->m_type);
+        case ATYPE_SEQ:
+            return ast_compare_values(ast1->get_seq_ast()->m_type,
+                                      ast2->get_seq_ast()->m_type);
+        case ATYPE_SPECIAL:
+            return ast_compare_values(ast1->get_special_ast()->m_str,
+                                      ast2->get_special_ast()->m_str);
+        case ATYPE_EMPTY:
+        case ATYPE_LAZY:
+            break;
+        }
+        return 0;
+    }
+
+    // NOTE: The nodes are compared in pre-order, and the children of a
+    //       pair are compared as the strings are. A pair of child counts
+    //       is stacked under the children if they differ.
+    template <typename T_TREE>
+    inline int ast_compare_walk(const T_TREE& tree1, typename T_TREE::node_type node1,
+                                const T_TREE& tree2, typename T_TREE::node_type node2)
+    {
+        typedef typename T_TREE::node_type node_type;
+        struct Item
+        {
+            node_type   m_node1;
+            node_type   m_node2;
+            size_t      m_count1;
+            size_t      m_count2;
+            bool        m_counts;   // compare the counts only
+        };
+        AstSmallStack<Item, 64> stack;
+        Item item = { node1, node2, 0, 0, false };
+        stack.push(item);
+
+        while (!stack.empty())
+        {
+            item = stack.pop();
+            if (item.m_counts)
             {
-                const UnaryAst *u1 = ast1->get_unary_ast();
-                const UnaryAst *u2 = ast1->get_unary_ast();
-                if (u1->m_str != u2->m_str)
-                    return false;
-                if (!u1->m_arg != !u2->m_arg)
-                    return false;
-                return ast_equal(u1->m_arg, u2->m_arg, already_sorted);
+                if (int ret = ast_compare_values(item.m_count1, item.m_count2))
+                    return ret;
+                continue;
             }
+
+            node1 = tree1.resolve(item.m_node1);
+            node2 = tree2.resolve(item.m_node2);
+            // a shared subtree, e.g. of a HashConsFactory
+            if (&tree1 == &tree2 && node1 == node2)
+                continue;
+            if (int ret = ast_compare_head(tree1.ast(node1), tree1.atype(node1),
+                                           tree2.ast(node2), tree2.atype(node2)))
+            {
+                return ret;
+            }
+
+            const size_t count1 = tree1.count(node1);
+            const size_t count2 = tree2.count(node2);
+            if (count1 != count2)
+            {
+                Item counts = { node1, node2, count1, count2, true };
+                stack.push(counts);
+            }
+            for (size_t i = (count1 < count2 ? count1 : count2); i-- > 0; )
+            {
+                Item child = { tree1.child(node1, i), tree2.child(node2, i), 0, 0, false };
+                stack.push(child);
+            }
+        }
+        return 0;
+    }
+
+    inline AstCanonMemo *ast_memo(const BaseAst *ast)
+    {
+        switch (ast->m_atype)
+        {
+        case ATYPE_UNARY:
+            return &ast->get_unary_ast()->m_memo;
+        case ATYPE_BINARY:
+            return &ast->get_bin_ast()->m_memo;
         case ATYPE_SEQ:
+            return &ast->get_seq_ast()->m_memo;
+        default:
+            return NULL;
+        }
+    }
+
+    inline void ast_set_parent(BaseAst *child, BaseAst *parent)
+    {
+        if (child == NULL)
+            return;
+        if (AstCanonMemo *memo = ast_memo(child))
+            memo->m_parent = parent;
+    }
+
+    // NOTE: The parents of the descendants are set, so that ast_modified()
+    //       finds the node from them. The body of a LazyAst gets the
+    //       parent of the LazyAst.
+    inline const BaseAst *ast_canonical(const BaseAst *ast)
+    {
+        assert(ast);
+        ast = ast_resolve(ast);
+        AstCanonMemo *memo = ast_memo(ast);
+        if (memo == NULL)
+            return ast;
+        if (memo->m_canonical)
+            return memo->m_canonical;
+
+        BaseAst *canonical = ast->sorted_clone();
+        AstSortedTree tree;
+        if (ast_compare_walk(tree, ast, tree, (const BaseAst *)canonical) == 0)
+        {
+            // a tree already in the form keeps no copy
+            ast_delete(canonical);
+            canonical = const_cast<BaseAst *>(ast);
+        }
+        memo->m_canonical = canonical;
+
+        // a node and its nearest ancestor with a memo
+        typedef std::pair<const BaseAst *, BaseAst *> item_type;
+        std::vector<item_type> stack(1, item_type(ast, memo->m_parent));
+        while (!stack.empty())
+        {
+            const BaseAst *node = stack.back().first;
+            BaseAst *owner = stack.back().second;
+            stack.pop_back();
+            if (ast_memo(node))
+                owner = const_cast<BaseAst *>(node);
+
+            BaseAst *children[2] = { NULL, NULL };
+            const std::vector<BaseAst *> *vec = NULL;
+            switch (node->m_atype)
             {
-                const SeqAst *s1 = ast1->get_seq_ast();
-                const SeqAst *s2 = ast2->get_seq_ast();
-                if (s1->m_str != s2->m_str)
-                    return false;
-                if (s1->size() != s2->size())
-                    return false;
-                if (already_sorted)
+            case ATYPE_UNARY:
+                children[0] = node->get_unary_ast()->m_arg;
+                break;
+            case ATYPE_BINARY:
+                children[0] = node->get_bin_ast()->m_left;
+                children[1] = node->get_bin_ast()->m_right;
+                break;
+            case ATYPE_SEQ:
+                vec = &node->get_seq_ast()->m_vec;
+                break;
+            case ATYPE_LAZY:
+                children[0] = node->get_lazy_ast()->body();
+                break;
+            default:
+                break;
+            }
+
+            const size_t count = (vec ? vec->size() : 2);
+            for (size_t i = 0; i < count; ++i)
+            {
+                BaseAst *child = (vec ? (*vec)[i] : children[i]);
+                if (child == NULL)
+                    continue;
+                ast_set_parent(child, owner);
+                stack.push_back(item_type(child, owner));
+            }
+        }
+        return canonical;
+    }
+
+    inline void ast_modified(BaseAst *ast)
+    {
+        while (ast)
+        {
+            AstCanonMemo *memo = ast_memo(ast);
+            if (memo == NULL)
+                break;
+            memo->drop(ast);
+            ast = memo->m_parent;
+        }
+    }
+
+    // NOTE: The nodes are done in post-order. What to do with each child
+    //       of a sequence is decided before the children are done, on the
+    //       tree as it was, as sorted_clone() decides. A group to flatten
+    //       is skipped; its inner sequence is done and spliced instead.
+    inline void ast_canonicalize_in_place(BaseAst *ast)
+    {
+        assert(ast);
+
+        enum ChildAction
+        {
+            CA_KEEP,
+            CA_SPLICE,
+            CA_DROP
+        };
+        struct Action
+        {
+            ChildAction m_action;
+            BaseAst    *m_target;   // the inner sequence for CA_SPLICE
+        };
+        struct Frame
+        {
+            BaseAst    *m_ast;
+            bool        m_pushed;
+            size_t      m_actions;  // the first action of the children
+        };
+        std::vector<Frame> stack;
+        std::vector<Action> actions;
+        std::vector<BaseAst *> items;
+
+        Frame frame = { ast, false, 0 };
+        stack.push_back(frame);
+        while (!stack.empty())
+        {
+            frame = stack.back();
+            BaseAst *node = frame.m_ast;
+            if (!frame.m_pushed)
+            {
+                stack.back().m_pushed = true;
+                stack.back().m_actions = actions.size();
+
+                Frame child = { NULL, false, 0 };
+                switch (node->m_atype)
                 {
-                    for (size_t i = 0; i < s1->size(); ++i)
+                case ATYPE_UNARY:
+                    child.m_ast = node->get_unary_ast()->m_arg;
+                    if (child.m_ast)
+                        stack.push_back(child);
+                    break;
+                case ATYPE_BINARY:
+                    child.m_ast = node->get_bin_ast()->m_left;
+                    stack.push_back(child);
+                    child.m_ast = node->get_bin_ast()->m_right;
+                    stack.push_back(child);
+                    break;
+                case ATYPE_LAZY:
+                    child.m_ast = node->get_lazy_ast()->body();
+                    stack.push_back(child);
+                    break;
+                case ATYPE_SEQ:
                     {
-                        if (!ast_equal(s1->m_vec[i], s2->m_vec[i], true))
+                        SeqAst *seq = node->get_seq_ast();
+                        for (size_t i = 0; i < seq->size(); ++i)
                         {
-                            return false;
+                            BaseAst *item = seq->m_vec[i];
+                            Action action = { CA_KEEP, item };
+                            if (seq->m_type == SEQ_TERMS)
+                            {
+                                if (item->empty())
+                                {
+                                    action.m_action = CA_DROP;
+                                }
+                                else if (UnaryAst *unary = item->get_group())
+                                {
+                                    SeqAst *expr = unary->m_arg->get_expr();
+                                    if (expr->size() == 1)
+                                    {
+                                        SeqAst *terms = expr->m_vec[0]->get_terms();
+                                        action.m_action = (terms->empty() ? CA_DROP : CA_SPLICE);
+                                        action.m_target = terms;
+                                    }
+                                }
+                            }
+                            else if (seq->m_type == SEQ_EXPR)
+                            {
+                                SeqAst *terms = item->get_terms();
+                                if (terms && terms->size() == 1)
+                                {
+                                    if (UnaryAst *unary = terms->m_vec[0]->get_group())
+                                    {
+                                        action.m_action = CA_SPLICE;
+                                        action.m_target = unary->m_arg->get_expr();
+                                    }
+                                }
+                            }
+                            actions.push_back(action);
+                            if (action.m_action != CA_DROP)
+                            {
+                                child.m_ast = action.m_target;
+                                stack.push_back(child);
+                            }
                         }
                     }
-                    return true;
+                    break;
+                default:
+                    break;
                 }
+                continue;
+            }
+            stack.pop_back();
 
-                SeqAst *seq1 = s1->sorted_clone()->get_seq_ast();
-                SeqAst *seq2 = s2->sorted_clone()->get_seq_ast();
-                for (size_t i = 0; i < s1->size(); ++i)
+            if (AstCanonMemo *memo = ast_memo(node))
+                memo->drop(node);
+
+            if (BinaryAst *bin = node->get_bin_ast())
+            {
+                // an empty string is EmptyAst
+                if (bin->m_left->m_atype == ATYPE_STRING && bin->m_left->empty())
                 {
-                    if (!ast_equal(seq1->m_vec[i], seq2->m_vec[i], true))
-                    {
-                        delete seq1;
-                        delete seq2;
-                        return false;
-                    }
+                    ast_delete(bin->m_left);
+                    bin->m_left = ast_new<EmptyAst>(bin->m_arena);
+                }
+                if (bin->m_right->m_atype == ATYPE_STRING && bin->m_right->empty())
+                {
+                    ast_delete(bin->m_right);
+                    bin->m_right = ast_new<EmptyAst>(bin->m_arena);
                 }
-                delete seq1;
-                delete seq2;
-                return true;
             }
-        case ATYPE_SPECIAL:
+            else if (SeqAst *seq = node->get_seq_ast())
             {
-                const SpecialAst *spe1 = ast1->get_special_ast();
-                const SpecialAst *spe2 = ast2->get_special_ast();
-                return spe1->m_str == spe2->m_str;
+                items.clear();
+                for (size_t i = 0; i < seq->size(); ++i)
+                {
+                    const Action& action = actions[frame.m_actions + i];
+                    switch (action.m_action)
+                    {
+                    case CA_KEEP:
+                        items.push_back(seq->m_vec[i]);
+                        break;
+                    case CA_SPLICE:
+                        {
+                            SeqAst *inner = action.m_target->get_seq_ast();
+                            items.insert(items.end(), inner->m_vec.begin(), inner->m_vec.end());
+                            inner->m_vec.clear();
+                            ast_delete(seq->m_vec[i]);
+                        }
+                        break;
+                    case CA_DROP:
+                        ast_delete(seq->m_vec[i]);
+                        break;
+                    }
+                }
+                actions.resize(frame.m_actions);
+
+                seq->m_vec.swap(items);
+                for (size_t i = 0; i < seq->size(); ++i)
+                {
+                    ast_set_parent(seq->m_vec[i], seq);
+                }
+                if (seq->m_type == SEQ_EXPR)
+                {
+                    std::sort(seq->m_vec.begin(), seq->m_vec.end(), ast_less_than_sorted);
+                    seq->unique();
+                }
             }
-        case ATYPE_EMPTY:
-            return true;
         }
+
+        ast_modified(ast);
     }
 
-    inline bool ast_less_than(const BaseAst *ast1, const BaseAst *ast2, bool already_sorted)
+    inline int ast_compare(const BaseAst *ast1, const BaseAst *ast2, bool already_sorted)
     {
         assert(ast1);
         assert(ast2);
 
-        if (ast1->m_atype < ast2->m_atype)
-            return true;
-        if (ast1->m_atype > ast2->m_atype)
-            return false;
+        AstSortedTree tree;
+        if (already_sorted)
+            return ast_compare_walk(tree, ast1, tree, ast2);
 
-        switch (ast1->m_atype)
+        // the canonical forms kept by ast_canonical()
+        const AstCanonMemo *memo1 = ast_memo(ast_resolve(ast1));
+        const AstCanonMemo *memo2 = ast_memo(ast_resolve(ast2));
+        if (memo1 && memo1->m_canonical && memo2 && memo2->m_canonical)
         {
-        case ATYPE_INTEGER:
-            {
-                const IntegerAst *i1 = ast1->get_int_ast();
-                const IntegerAst *i2 = ast2->get_int_ast();
-                return i1->m_integer < i2->m_integer;
-            }
-        case ATYPE_STRING:
+            const BaseAst *canonical1 = memo1->m_canonical;
+            return ast_compare_walk(tree, canonical1, tree, (const BaseAst *)memo2->m_canonical);
+        }
+
+        // the views are kept per thread to reuse their memory
+        static thread_local AstCanonView s_view1, s_view2;
+        const AstCanonView::node_type root1 = s_view1.build(ast1);
+        const AstCanonView::node_type root2 = s_view2.build(ast2);
+        return ast_compare_walk(s_view1, root1, s_view2, root2);
+    }
+
+    inline bool ast_equal(const BaseAst *ast1, const BaseAst *ast2, bool already_sorted)
+    {
+        return ast_compare(ast1, ast2, already_sorted) == 0;
+    }
+
+    inline bool ast_less_than(const BaseAst *ast1, const BaseAst *ast2, bool already_sorted)
+    {
+        return ast_compare(ast1, ast2, already_sorted) < 0;
+    }
+
+    inline bool ast_greater_than(const BaseAst *ast1, const BaseAst *ast2, bool already_sorted)
+    {
+        return ast_compare(ast1, ast2, already_sorted) > 0;
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    // AstSortedTree inlines
+
+    inline size_t AstSortedTree::count(node_type node) const
+    {
+        switch (node->m_atype)
+        {
+        case ATYPE_BINARY:
+            return 2;
+        case ATYPE_UNARY:
+            return node->get_unary_ast()->m_arg ? 1 : 0;
+        case ATYPE_SEQ:
+            return node->get_seq_ast()->size();
+        default:
+            return 0;
+        }
+    }
+
+    inline AstSortedTree::node_type
+    AstSortedTree::child(node_type node, size_t i) const
+    {
+        switch (node->m_atype)
+        {
+        case ATYPE_BINARY:
+            return i ? node->get_bin_ast()->m_right : node->get_bin_ast()->m_left;
+        case ATYPE_UNARY:
+            return node->get_unary_ast()->m_arg;
+        default:
+            return node->get_seq_ast()->m_vec[i];
+        }
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    // AstCanonView inlines
+
+    inline bool AstCanonView::Less::operator()(node_type node1, node_type node2) const
+    {
+        return ast_compare_walk(*m_view, node1, *m_view, node2) < 0;
+    }
+
+    // NOTE: The nodes are made in post-order, as ast_clone() does. A
+    //       group that sorted_clone() flattens is made and marked to
+    //       splice; its children are copied into its parent.
+    inline AstCanonView::node_type AstCanonView::build(const BaseAst *ast)
+    {
+        assert(ast);
+        m_nodes.clear();
+        m_children.clear();
+        m_stack.clear();
+        m_made.clear();
+
+        push(ast, false);
+        while (!m_stack.empty())
+        {
+            Frame& frame = m_stack.back();
+            if (!frame.m_pushed)
             {
-                const StringAst *s1 = ast1->get_str_ast();
-                const StringAst *s2 = ast2->get_str_ast();
-                return s1->m_str < s2->m_str;
+                frame.m_pushed = true;
+                frame.m_made = m_made.size();
+                push_children(frame.m_ast);
+                continue;
             }
+            const Frame done = frame;
+            m_stack.pop_back();
+            make(done);
+        }
+
+        assert(m_made.size() == 1);
+        return m_made.back().m_node;
+    }
+
+    // push the children to be made, in reverse order
+    inline void AstCanonView::push_children(const BaseAst *ast)
+    {
+        switch (ast->m_atype)
+        {
+        case ATYPE_UNARY:
+            if (const BaseAst *arg = ast->get_unary_ast()->m_arg)
+                push(arg, false);
+            break;
         case ATYPE_BINARY:
+            push(ast->get_bin_ast()->m_right, false);
+            push(ast->get_bin_ast()->m_left, false);
+            break;
+        case ATYPE_SEQ:
             {
-                const BinaryAst *b1 = ast1->get_bin_ast();
-                const BinaryAst *b2 = ast2->get_bin_ast();
-                if (b1->m_str < b2->m_str)
-                    return true;
-                if (b1->m_str > b2->m_str)
-                    return false;
-                if (ast_less_than(b1->m_left, b2->m_left, already_sorted))
-                    return true;
-                if (!ast_equal(b1->m_left, b2->m_left, already_sorted))
-                    return false;
-                return ast_less_than(b1->m_right, b2->m_right, already_sorted);
+                const SeqAst *seq = ast->get_seq_ast();
+                for (size_t i = seq->size(); i-- > 0; )
+                {
+                    const BaseAst *item = seq->m_vec[i];
+                    if (seq->m_type == SEQ_TERMS)
+                    {
+                        if (item->empty())
+                            continue;
+
+                        if (const UnaryAst *unary = item->get_group())
+                        {
+                            const SeqAst *expr = unary->m_arg->get_expr();
+                            if (expr->size() == 1)
+                            {
+                                const SeqAst *terms = expr->m_vec[0]->get_terms();
+                                if (!terms->empty())
+                                    push(terms, true);
+                                continue;
+                            }
+                        }
+                    }
+                    else if (seq->m_type == SEQ_EXPR)
+                    {
+                        const SeqAst *terms = item->get_terms();
+                        if (terms && terms->size() == 1)
+                        {
+                            if (const UnaryAst *unary = terms->m_vec[0]->get_group())
+                            {
+                                push(unary->m_arg->get_expr(), true);
+                                continue;
+                            }
+                        }
+                    }
+                    push(item, false);
+                }
             }
-        case ATYPE_IDENT:
+            break;
+        default:
+            break;
+        }
+    }
+
+    inline void AstCanonView::make(const Frame& frame)
+    {
+        const BaseAst *ast = frame.m_ast;
+        Node node;
+        node.m_ast = ast;
+        node.m_atype = ast->m_atype;
+        if (ast->m_atype == ATYPE_STRING && ast->empty())
+            node.m_atype = ATYPE_EMPTY;
+        node.m_first = m_children.size();
+
+        for (size_t i = frame.m_made; i < m_made.size(); ++i)
+        {
+            const Made& made = m_made[i];
+            if (!made.m_splice)
             {
-                const IdentAst *i1 = ast1->get_ident_ast();
-                const IdentAst *i2 = ast2->get_ident_ast();
-                return i1->m_name < i2->m_name;
+                m_children.push_back(made.m_node);
+                continue;
             }
-        case ATYPE_UNARY:
+            const Node& spliced = m_nodes[made.m_node];
+            for (size_t k = 0; k < spliced.m_count; ++k)
             {
-                const UnaryAst *u1 = ast1->get_unary_ast();
-                const UnaryAst *u2 = ast2->get_unary_ast();
-                if (u1->m_str < u2->m_str)
-                    return true;
-                if (u1->m_str > u2->m_str)
-                    return false;
-                if (!!u1->m_arg < !!u2->m_arg)
-                    return true;
-                if (!!u1->m_arg > !!u2->m_arg)
-                    return false;
-                return ast_less_than(u1->m_arg, u2->m_arg, already_sorted);
+                const node_type child = m_children[spliced.m_first + k];
+                m_children.push_back(child);
             }
-        case ATYPE_SEQ:
+        }
+        m_made.resize(frame.m_made);
+
+        if (ast->m_atype == ATYPE_SEQ && ast->get_seq_ast()->m_type == SEQ_EXPR)
+        {
+            // sort and unique the alternatives
+            Less less = { this };
+            std::vector<node_type>::iterator first = m_children.begin() + node.m_first;
+            std::sort(first, m_children.end(), less);
+            std::vector<node_type>::iterator last = first;
+            for (std::vector<node_type>::iterator it = first; it != m_children.end(); ++it)
             {
-                const SeqAst *s1 = ast1->get_seq_ast();
-                const SeqAst *s2 = ast2->get_seq_ast();
-                if (s1->m_str < s2->m_str)
-                    return true;
-                if (s1->m_str > s2->m_str)
-                    return false;
+                if (last == first || less(*(last - 1), *it))
+                    *last++ = *it;
+            }
+            m_children.erase(last, m_children.end());
+        }
+        node.m_count = m_children.size() - node.m_first;
 
-                size_t count;
-                if (s1->size() < s2->size())
-                    count = s1->size();
-                else
-                    count = s2->size();
+        Made made = { m_nodes.size(), frame.m_splice };
+        m_nodes.push_back(node);
+        m_made.push_back(made);
+    }
 
-                if (already_sorted)
+    // NOTE: The nodes are made in post-order; the results of the children
+    //       are stacked left to right until their parent is made.
+    inline BaseAst *ast_clone(const BaseAst *ast, AstArena *arena)
+    {
+        assert(ast);
+
+        // (node, whether its children are pushed)
+        std::vector<std::pair<const BaseAst *, bool> > stack;
+        std::vector<BaseAst *> made;
+        stack.push_back(std::make_pair(ast, false));
+        while (!stack.empty())
+        {
+            ast = stack.back().first;
+            if (!stack.back().second)
+            {
+                stack.back().second = true;
+                switch (ast->m_atype)
                 {
-                    for (size_t i = 0; i < count; ++i)
+                case ATYPE_UNARY:
+                    if (const BaseAst *arg = ast->get_unary_ast()->m_arg)
+                        stack.push_back(std::make_pair(arg, false));
+                    continue;
+                case ATYPE_BINARY:
+                    {
+                        const BinaryAst *bin = ast->get_bin_ast();
+                        stack.push_back(std::make_pair(bin->m_right, false));
+                        stack.push_back(std::make_pair(bin->m_left, false));
+                    }
+                    continue;
+                case ATYPE_SEQ:
                     {
-                        if (ast_equal(s1->m_vec[i], s2->m_vec[i], true))
+                        const SeqAst *seq = ast->get_seq_ast();
+                        for (size_t i = seq->size(); i-- > 0; )
                         {
-                            continue;
+                            stack.push_back(std::make_pair(seq->m_vec[i], false));
                         }
-                        return ast_less_than(s1->m_vec[i], s2->m_vec[i], true);
                     }
-                    return s1->size() < s2->size();
+                    continue;
+                default:
+                    break;
                 }
+            }
+            stack.pop_back();
 
-                SeqAst *seq1 = s1->sorted_clone()->get_seq_ast();
-                SeqAst *seq2 = s2->sorted_clone()->get_seq_ast();
-
-                for (size_t i = 0; i < count; ++i)
+            switch (ast->m_atype)
+            {
+            case ATYPE_UNARY:
                 {
-                    if (ast_equal(seq1->m_vec[i], seq2->m_vec[i], true))
+                    const UnaryAst *unary = ast->get_unary_ast();
+                    BaseAst *arg = NULL;
+                    if (unary->m_arg)
                     {
-                        continue;
+                        arg = made.back();
+                        made.pop_back();
                     }
+                    made.push_back(ast_new<UnaryAst>(arena, unary->m_type, arg));
+                }
+                break;
+            case ATYPE_BINARY:
+                {
+                    BaseAst *right = made.back();
+                    made.pop_back();
+                    BaseAst *left = made.back();
+                    made.pop_back();
+                    made.push_back(ast_new<BinaryAst>(arena, ast->get_bin_ast()->m_type,
+                                                      left, right));
+                }
+                break;
+            case ATYPE_SEQ:
+                {
+                    const SeqAst *seq = ast->get_seq_ast();
+                    SeqAst *cloned = ast_new<SeqAst>(arena, seq->m_type);
+                    cloned->insert(0, made.end() - seq->size(), made.end());
+                    made.resize(made.size() - seq->size());
+                    made.push_back(cloned);
+                }
+                break;
+            default:
+                made.push_back(ast->clone(arena));
+                break;
+            }
+        }
 
-                    bool ret = ast_less_than(seq1->m_vec[i], seq2->m_vec[i], true);
-                    delete seq1;
-                    delete seq2;
-                    return ret;
+        assert(made.size() == 1);
+        return made[0];
+    }
+
+    // NOTE: The canonical form is made from an AstCanonView in post-order.
+    //       A leaf makes its own sorted_clone(), so an empty string becomes
+    //       EmptyAst.
+    inline BaseAst *ast_sorted_clone(const BaseAst *ast, AstArena *arena)
+    {
+        assert(ast);
+
+        AstCanonView view;
+        std::vector<std::pair<AstCanonView::node_type, bool> > stack;
+        std::vector<BaseAst *> made;
+        stack.push_back(std::make_pair(view.build(ast), false));
+        while (!stack.empty())
+        {
+            const AstCanonView::node_type node = stack.back().first;
+            const size_t count = view.count(node);
+            if (!stack.back().second)
+            {
+                stack.back().second = true;
+                for (size_t i = count; i-- > 0; )
+                {
+                    stack.push_back(std::make_pair(view.child(node, i), false));
                 }
+                continue;
+            }
+            stack.pop_back();
 
-                bool less_than = seq1->size() < seq2->size();
-                delete seq1;
-                delete seq2;
-                return less_than;
+            ast = view.ast(node);
+            const size_t first = made.size() - count;
+            BaseAst *cloned;
+            switch (view.atype(node))
+            {
+            case ATYPE_UNARY:
+                cloned = ast_new<UnaryAst>(arena, ast->get_unary_ast()->m_type,
+                                           count ? made[first] : NULL);
+                break;
+            case ATYPE_BINARY:
+                cloned = ast_new<BinaryAst>(arena, ast->get_bin_ast()->m_type,
+                                            made[first], made[first + 1]);
+                break;
+            case ATYPE_SEQ:
+                {
+                    SeqAst *seq = ast_new<SeqAst>(arena, ast->get_seq_ast()->m_type);
+                    seq->insert(0, made.begin() + first, made.end());
+                    cloned = seq;
+                }
+                break;
+            default:
+                cloned = ast->sorted_clone(arena);
+                break;
             }
-        case ATYPE_SPECIAL:
+            made.resize(first);
+            made.push_back(cloned);
+        }
+
+        assert(made.size() == 1);
+        return made[0];
+    }
+
+    // NOTE: A sequence but the rules is empty if all of its items are.
+    inline bool ast_empty(const BaseAst *ast)
+    {
+        assert(ast);
+
+        std::vector<const BaseAst *> stack;
+        stack.push_back(ast);
+        while (!stack.empty())
+        {
+            ast = ast_resolve(stack.back());
+            stack.pop_back();
+            if (ast->m_atype != ATYPE_SEQ)
             {
-                const SpecialAst *spe1 = ast1->get_special_ast();
-                const SpecialAst *spe2 = ast2->get_special_ast();
-                return spe1->m_str < spe2->m_str;
+                if (!ast->empty())
+                    return false;
+                continue;
             }
-        case ATYPE_EMPTY:
-            return false;
+
+            const SeqAst *seq = ast->get_seq_ast();
+            if (seq->m_type == SEQ_RULES)
+                return false;
+            stack.insert(stack.end(), seq->m_vec.begin(), seq->m_vec.end());
         }
+        return true;
     }
 
-    inline bool ast_greater_than(const BaseAst *ast1, const BaseAst *ast2, bool already_sorted)
+    // NOTE: An item of the stack is either a node or a text to write.
+    inline void ast_to_dbg(os_type& os, const BaseAst *ast)
     {
-        BaseAst *cloned1 = ast1->sorted_clone();
-        BaseAst *cloned2 = ast2->sorted_clone();
-        bool ret = !ast_equal(ast1, ast2, true) && !ast_less_than(ast1, ast2, true);
-        delete cloned1;
-        delete cloned2;
-        return ret;
+        assert(ast);
+
+        typedef std::pair<const BaseAst *, const char *> item_type;
+        std::vector<item_type> stack;
+        stack.push_back(item_type(ast, NULL));
+        while (!stack.empty())
+        {
+            ast = stack.back().first;
+            const char *text = stack.back().second;
+            stack.pop_back();
+            if (text)
+            {
+                os << text;
+                continue;
+            }
+
+            switch (ast->m_atype)
+            {
+            case ATYPE_UNARY:
+                {
+                    const UnaryAst *unary = ast->get_unary_ast();
+                    os << "[UNARY " << unary->str() << ": ";
+                    stack.push_back(item_type(NULL, "]"));
+                    if (unary->m_arg)
+                        stack.push_back(item_type(unary->m_arg, NULL));
+                }
+                break;
+            case ATYPE_BINARY:
+                {
+                    const BinaryAst *bin = ast->get_bin_ast();
+                    os << "[BINARY " << bin->str() << ": ";
+                    stack.push_back(item_type(NULL, "]"));
+                    stack.push_back(item_type(bin->m_right, NULL));
+                    stack.push_back(item_type(NULL, ", "));
+                    stack.push_back(item_type(bin->m_left, NULL));
+                }
+                break;
+            case ATYPE_SEQ:
+                {
+                    const SeqAst *seq = ast->get_seq_ast();
+                    os << "[SEQ " << seq->str() << ": ";
+                    stack.push_back(item_type(NULL, "]"));
+                    for (size_t i = seq->size(); i-- > 0; )
+                    {
+                        stack.push_back(item_type(seq->m_vec[i], NULL));
+                        if (i > 0)
+                            stack.push_back(item_type(NULL, ", "));
+                    }
+                }
+                break;
+            case ATYPE_LAZY:
+                stack.push_back(item_type(ast_resolve(ast), NULL));
+                break;
+            default:
+                ast->to_dbg(os);
+                break;
+            }
+        }
+    }
+
+    // NOTE: An item of the stack is either a node or a text to write.
+    inline void ast_to_bnf(os_type& os, const BaseAst *ast)
+    {
+        assert(ast);
+
+        typedef std::pair<const BaseAst *, const char *> item_type;
+        std::vector<item_type> stack;
+        stack.push_back(item_type(ast, NULL));
+        while (!stack.empty())
+        {
+            ast = stack.back().first;
+            const char *text = stack.back().second;
+            stack.pop_back();
+            if (text)
+            {
+                os << text;
+                continue;
+            }
+
+            switch (ast->m_atype)
+            {
+            case ATYPE_UNARY:
+                {
+                    const UnaryAst *unary = ast->get_unary_ast();
+                    switch (unary->m_type)
+                    {
+                    case UNARY_OPTIONAL:
+                        os << '[';
+                        stack.push_back(item_type(NULL, "]"));
+                        break;
+                    case UNARY_REPEATED:
+                        os << '{';
+                        stack.push_back(item_type(NULL, "}"));
+                        break;
+                    case UNARY_GROUP:
+                        os << '(';
+                        stack.push_back(item_type(NULL, ")"));
+                        break;
+                    case UNARY_PLUS:
+                    case UNARY_STAR:
+                    case UNARY_QUESTION:
+                        stack.push_back(item_type(NULL, unary->str().c_str()));
+                        break;
+                    }
+                    stack.push_back(item_type(unary->m_arg, NULL));
+                }
+                break;
+            case ATYPE_BINARY:
+                {
+                    const BinaryAst *bin = ast->get_bin_ast();
+                    switch (bin->m_type)
+                    {
+                    case BINARY_RULE:
+                        stack.push_back(item_type(NULL, "\n"));
+                        stack.push_back(item_type(bin->m_right, NULL));
+                        stack.push_back(item_type(NULL, " ::= "));
+                        stack.push_back(item_type(bin->m_left, NULL));
+                        break;
+                    case BINARY_EXCEPT:
+                        stack.push_back(item_type(bin->m_right, NULL));
+                        stack.push_back(item_type(NULL, " - "));
+                        stack.push_back(item_type(bin->m_left, NULL));
+                        break;
+                    case BINARY_TIMES:
+                        if (const int n = bin->m_left->get_int_ast()->m_integer)
+                        {
+                            stack.push_back(item_type(bin->m_right, NULL));
+                            for (int i = 1; i < n; ++i)
+                            {
+                                stack.push_back(item_type(NULL, " "));
+                                stack.push_back(item_type(bin->m_right, NULL));
+                            }
+                        }
+                        else
+                        {
+                            os << "\"\"";
+                        }
+                        break;
+                    }
+                }
+                break;
+            case ATYPE_SEQ:
+                {
+                    const SeqAst *seq = ast->get_seq_ast();
+                    const char *sep = NULL;
+                    if (seq->m_type == SEQ_EXPR)
+                        sep = " | ";
+                    else if (seq->m_type == SEQ_TERMS)
+                        sep = " ";
+                    if (sep && ast_empty(seq))
+                    {
+                        os << "\"\"";
+                        break;
+                    }
+                    for (size_t i = seq->size(); i-- > 0; )
+                    {
+                        stack.push_back(item_type(seq->m_vec[i], NULL));
+                        if (sep && i > 0)
+                            stack.push_back(item_type(NULL, sep));
+                    }
+                }
+                break;
+            case ATYPE_LAZY:
+                stack.push_back(item_type(ast_resolve(ast), NULL));
+                break;
+            default:
+                ast->to_bnf(os);
+                break;
+            }
+        }
+    }
+
+    // NOTE: An item of the stack is either a node or a text to write.
+    inline void ast_to_ebnf(os_type& os, const BaseAst *ast)
+    {
+        assert(ast);
+
+        typedef std::pair<const BaseAst *, const char *> item_type;
+        std::vector<item_type> stack;
+        stack.push_back(item_type(ast, NULL));
+        while (!stack.empty())
+        {
+            ast = stack.back().first;
+            const char *text = stack.back().second;
+            stack.pop_back();
+            if (text)
+            {
+                os << text;
+                continue;
+            }
+
+            switch (ast->m_atype)
+            {
+            case ATYPE_UNARY:
+                {
+                    const UnaryAst *unary = ast->get_unary_ast();
+                    assert(unary->m_arg);
+                    switch (unary->m_type)
+                    {
+                    case UNARY_OPTIONAL:
+                    case UNARY_QUESTION:
+                        os << '[';
+                        stack.push_back(item_type(NULL, "]"));
+                        break;
+                    case UNARY_REPEATED:
+                    case UNARY_STAR:
+                        os << '{';
+                        stack.push_back(item_type(NULL, "}"));
+                        break;
+                    case UNARY_GROUP:
+                        os << '(';
+                        stack.push_back(item_type(NULL, ")"));
+                        break;
+                    case UNARY_PLUS:
+                        os << '(';
+                        stack.push_back(item_type(NULL, "}"));
+                        stack.push_back(item_type(unary->m_arg, NULL));
+                        stack.push_back(item_type(NULL, "), {"));
+                        break;
+                    }
+                    stack.push_back(item_type(unary->m_arg, NULL));
+                }
+                break;
+            case ATYPE_BINARY:
+                {
+                    const BinaryAst *bin = ast->get_bin_ast();
+                    const char *op = NULL;
+                    switch (bin->m_type)
+                    {
+                    case BINARY_RULE:
+                        stack.push_back(item_type(NULL, ";\n"));
+                        op = " = ";
+                        break;
+                    case BINARY_EXCEPT:
+                        op = " - ";
+                        break;
+                    case BINARY_TIMES:
+                        assert(bin->m_left->get_int_ast());
+                        op = " * ";
+                        break;
+                    }
+                    stack.push_back(item_type(bin->m_right, NULL));
+                    stack.push_back(item_type(NULL, op));
+                    stack.push_back(item_type(bin->m_left, NULL));
+                }
+                break;
+            case ATYPE_SEQ:
+                {
+                    const SeqAst *seq = ast->get_seq_ast();
+                    const char *sep = NULL;
+                    if (seq->m_type == SEQ_EXPR)
+                        sep = " | ";
+                    else if (seq->m_type == SEQ_TERMS)
+                        sep = ", ";
+                    if (sep && seq->empty())
+                        break;
+                    for (size_t i = seq->size(); i-- > 0; )
+                    {
+                        stack.push_back(item_type(seq->m_vec[i], NULL));
+                        if (sep && i > 0)
+                            stack.push_back(item_type(NULL, sep));
+                    }
+                }
+                break;
+            case ATYPE_LAZY:
+                stack.push_back(item_type(ast_resolve(ast), NULL));
+                break;
+            default:
+                ast->to_ebnf(os);
+                break;
+            }
+        }
     }
 
     inline const rules_vector *ast_get_rules_vector(const BaseAst *rules)
     {
         assert(rules->m_atype == ATYPE_SEQ);
         const SeqAst *seq = rules->get_seq_ast();
-        assert(seq && seq->m_str == "rules");
+        assert(seq && seq->m_type == SEQ_RULES);
         return reinterpret_cast<const rules_vector *>(&seq->m_vec);
     }
 
@@ -664,7 +2251,7 @@ namespace bnf_ast
     {
         assert(rules->m_atype == ATYPE_SEQ);
         SeqAst *seq = rules->get_seq_ast();
-        assert(seq && seq->m_str == "rules");
+        assert(seq && seq->m_type == SEQ_RULES);
         return reinterpret_cast<rules_vector *>(&seq->m_vec);
     }
 
@@ -680,13 +2267,23 @@ namespace bnf_ast
     inline string_type ast_get_rule_name(const BaseAst *rule)
     {
         const BinaryAst *bin = rule->get_bin_ast();
-        assert(bin && bin->m_str == "rule");
+        assert(bin && bin->m_type == BINARY_RULE);
 
         const IdentAst *ident = bin->m_left->get_ident_ast();
         assert(ident);
         return ident->m_name;
     }
 
+    inline atom_type ast_get_rule_atom(const BaseAst *rule)
+    {
+        const BinaryAst *bin = rule->get_bin_ast();
+        assert(bin && bin->m_type == BINARY_RULE);
+
+        const IdentAst *ident = bin->m_left->get_ident_ast();
+        assert(ident);
+        return ident->m_atom;
+    }
+
     inline void ast_get_defined_rule_names(names_type& names, const BaseAst *rules)
     {
         names.clear();
@@ -699,30 +2296,55 @@ namespace bnf_ast
     }
 
     inline const BaseAst *
-    ast_get_rule_body(const BaseAst *rules, const string_type& rule_name)
+    ast_get_rule_body(const BaseAst *rules, atom_type rule_atom)
     {
         const rules_vector *pvec = ast_get_rules_vector(rules);
         for (size_t i = 0; i < (*pvec).size(); ++i)
         {
             const BinaryAst *bin = (*pvec)[i];
-            if (ast_get_rule_name(bin) == rule_name)
-                return bin->m_right;
+            if (ast_get_rule_atom(bin) != rule_atom)
+                continue;
+            const LazyAst *lazy = bin->m_right->get_lazy_ast();
+            if (lazy && lazy->failed())
+                return NULL;
+            return ast_resolve(bin->m_right);
         }
         return NULL;
     }
 
-    inline BaseAst *ast_get_rule_body(BaseAst *rules, const string_type& rule_name)
+    inline BaseAst *ast_get_rule_body(BaseAst *rules, atom_type rule_atom)
     {
         rules_vector *pvec = ast_get_rules_vector(rules);
         for (size_t i = 0; i < (*pvec).size(); ++i)
         {
             BinaryAst *bin = (*pvec)[i];
-            if (ast_get_rule_name(bin) == rule_name)
-                return bin->m_right;
+            if (ast_get_rule_atom(bin) != rule_atom)
+                continue;
+            const LazyAst *lazy = bin->m_right->get_lazy_ast();
+            if (lazy && lazy->failed())
+                return NULL;
+            return ast_resolve(bin->m_right);
         }
         return NULL;
     }
 
+    inline const BaseAst *
+    ast_get_rule_body(const BaseAst *rules, const string_type& rule_name)
+    {
+        atom_type rule_atom = atom_table().find(rule_name);
+        if (rule_atom == ATOM_NONE)
+            return NULL;
+        return ast_get_rule_body(rules, rule_atom);
+    }
+
+    inline BaseAst *ast_get_rule_body(BaseAst *rules, const string_type& rule_name)
+    {
+        atom_type rule_atom = atom_table().find(rule_name);
+        if (rule_atom == ATOM_NONE)
+            return NULL;
+        return ast_get_rule_body(rules, rule_atom);
+    }
+
     inline bool ast_join_joinable_rules(BaseAst *rules)
     {
         bool ret = false;
@@ -732,136 +2354,477 @@ namespace bnf_ast
         if (pvec->size() == 0)
             return false;
 
-        for (size_t i = 0; i < (*pvec).size() - 1; ++i)
+        for (size_t i = 0; i < (*pvec).size() - 1; ++i)
+        {
+            BinaryAst *bin1 = (*pvec)[i];
+            assert(bin1->m_atype == ATYPE_BINARY);
+            atom_type name1 = ast_get_rule_atom(bin1);
+
+            for (size_t k = i + 1; k < (*pvec).size(); ++k)
+            {
+                BinaryAst *bin2 = (*pvec)[k];
+                assert(bin2->m_atype == ATYPE_BINARY);
+                atom_type name2 = ast_get_rule_atom(bin2);
+
+                if (name1 != name2)
+                    continue;
+
+                SeqAst *seq1 = ast_resolve(bin1->m_right)->get_seq_ast();
+                SeqAst *seq2 = ast_resolve(bin2->m_right)->get_seq_ast();
+
+                assert(seq1 && seq1->m_type == SEQ_EXPR);
+                assert(seq2 && seq2->m_type == SEQ_EXPR);
+
+                seq1->insert(seq1->size(), seq2->m_vec.begin(), seq2->m_vec.end());
+                seq2->m_vec.clear();
+
+                rules->get_seq_ast()->erase(k, k + 1);
+                --k;
+                ret = true;
+            }
+        }
+
+        return ret;
+    }
+
+    inline void ast_shift_spans(BaseAst *ast, ptrdiff_t delta)
+    {
+        std::vector<BaseAst *> stack(1, ast);
+        while (!stack.empty())
+        {
+            ast = stack.back();
+            stack.pop_back();
+            ast->m_begin += delta;
+            ast->m_end += delta;
+            if (UnaryAst *unary = ast->get_unary_ast())
+            {
+                if (unary->m_arg)
+                    stack.push_back(unary->m_arg);
+            }
+            else if (BinaryAst *bin = ast->get_bin_ast())
+            {
+                stack.push_back(bin->m_left);
+                stack.push_back(bin->m_right);
+            }
+            else if (SeqAst *seq = ast->get_seq_ast())
+            {
+                stack.insert(stack.end(), seq->m_vec.begin(), seq->m_vec.end());
+            }
+        }
+    }
+
+    inline void name_increment(string_type& name)
+    {
+        size_t i = name.find_last_not_of("0123456789");
+        if (i == string_type::npos || i == name.size() - 1)
+        {
+            name += "_02";
+            return;
+        }
+        ++i;
+        string_type str = name.substr(0, i);
+        int n = atoi(name.substr(i).c_str());
+        name = str;
+        char buf[32];
+        std::sprintf(buf, "%02u", n + 1);
+        name += buf;
+    }
+
+    inline void ast_add_rule(BaseAst *rules, string_type& name, const BaseAst *rule_expr)
+    {
+        assert(!ast_join_joinable_rules(rules));
+
+        rules_vector *pvec = ast_get_rules_vector(rules);
+        assert(pvec);
+
+        // the canonical forms of the bodies are kept for the next calls
+        assert(rule_expr->get_expr());
+        BaseAst *sorted = rule_expr->sorted_clone();
+        for (size_t i = 0; i < pvec->size(); ++i)
+        {
+            BinaryAst *bin = (*pvec)[i];
+            if (ast_equal(ast_canonical(bin->m_right), sorted, true))
+            {
+                IdentAst *ident = bin->m_left->get_ident_ast();
+                name = ident->m_name;
+                ast_delete(sorted);
+                return;
+            }
+        }
+
+        for (;;)
+        {
+            bool flag = false;
+            for (size_t i = 0; i < pvec->size(); ++i)
+            {
+                BinaryAst *bin = (*pvec)[i];
+                IdentAst *ident = bin->m_left->get_ident_ast();
+                if (name == ident->m_name)
+                {
+                    flag = true;
+                    break;
+                }
+            }
+            if (!flag)
+                break;
+
+            name_increment(name);
+        }
+
+        IdentAst *ident = ast_new<IdentAst>(rules->m_arena, name);
+        if (rules->m_arena)
+        {
+            ast_delete(sorted);
+            sorted = rule_expr->sorted_clone(rules->m_arena);
+        }
+        SeqAst *expr = sorted->get_expr();
+        assert(expr);
+        BinaryAst *bin = ast_new<BinaryAst>(rules->m_arena, BINARY_RULE, ident, expr);
+        rules->get_seq_ast()->push_back(bin);
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    // AST method inlines
+
+    inline BaseAst *LazyAst::body() const
+    {
+        std::call_once(m_once, &LazyAst::make_body, this);
+        return m_body;
+    }
+
+    // NOTE: A clone may have its body already.
+    inline void LazyAst::make_body() const
+    {
+        if (m_body == NULL)
+        {
+            m_body = m_source->parse_body(this);
+            if (m_body == NULL)
+            {
+                // the body of "rule = ;"
+                m_failed = true;
+                m_body = new SeqAst(SEQ_EXPR, new SeqAst(SEQ_TERMS, new EmptyAst()));
+            }
+        }
+        m_parsed.store(true, std::memory_order_release);
+    }
+
+    inline IdentAst::IdentAst(const string_type& name)
+        : BaseAst(ATYPE_IDENT),
+          m_atom(atom_table().intern_name(name.c_str(), name.size())),
+          m_name(atom_table().str(m_atom))
+    {
+    }
+    inline IdentAst::IdentAst(atom_type atom)
+        : BaseAst(ATYPE_IDENT), m_atom(atom), m_name(atom_table().str(m_atom))
+    {
+        assert(m_name.find_first_of("- ") == string_type::npos);
+    }
+    inline const string_type& IdentAst::bnf_name() const
+    {
+        return atom_table().dashed(m_atom);
+    }
+    inline const string_type& IdentAst::ebnf_name() const
+    {
+        return atom_table().dashed(m_atom);
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    // AstArena inlines
+
+    inline void ast_delete(BaseAst *ast)
+    {
+        if (ast == NULL || ast->m_arena)
+            return;
+
+        if (ast->m_atype != ATYPE_UNARY && ast->m_atype != ATYPE_BINARY &&
+            ast->m_atype != ATYPE_SEQ)
+        {
+            delete ast;
+            return;
+        }
+
+        // take the children off before deleting a node
+        std::vector<BaseAst *> stack(1, ast);
+        while (!stack.empty())
+        {
+            ast = stack.back();
+            stack.pop_back();
+            if (ast == NULL || ast->m_arena)
+                continue;
+
+            switch (ast->m_atype)
+            {
+            case ATYPE_UNARY:
+                {
+                    UnaryAst *unary = ast->get_unary_ast();
+                    stack.push_back(unary->m_arg);
+                    unary->m_arg = NULL;
+                }
+                break;
+            case ATYPE_BINARY:
+                {
+                    BinaryAst *bin = ast->get_bin_ast();
+                    stack.push_back(bin->m_left);
+                    stack.push_back(bin->m_right);
+                    bin->m_left = bin->m_right = NULL;
+                }
+                break;
+            case ATYPE_SEQ:
+                {
+                    SeqAst *seq = ast->get_seq_ast();
+                    stack.insert(stack.end(), seq->m_vec.begin(), seq->m_vec.end());
+                    seq->m_vec.clear();
+                }
+                break;
+            default:
+                break;
+            }
+            delete ast;
+        }
+    }
+
+    inline AstArena::~AstArena()
+    {
+        clear();
+        for (size_t i = 0; i < m_blocks.size(); ++i)
+        {
+            ::operator delete(m_blocks[i]);
+        }
+    }
+
+    // NOTE: clear() keeps the blocks for reuse.
+    inline void AstArena::clear()
+    {
+#ifndef NDEBUG
+        // the leaves are not destructed
+        BaseAst::alive_count() -= int(m_count - m_finalizers.size());
+#endif
+        for (size_t i = 0; i < m_finalizers.size(); ++i)
+        {
+            m_finalizers[i]->~BaseAst();
+        }
+        m_finalizers.clear();
+        m_count = 0;
+
+        m_block = 0;
+        if (m_blocks.size())
+        {
+            m_ptr = m_blocks[0];
+            m_left = BLOCK_SIZE;
+        }
+    }
+
+    inline void *AstArena::allocate(size_t size, size_t align)
+    {
+        assert(size <= BLOCK_SIZE);
+        size_t pad = (align - (size_t)m_ptr % align) % align;
+        if (m_ptr == NULL || pad + size > m_left)
         {
-            BinaryAst *bin1 = (*pvec)[i];
-            assert(bin1->m_atype == ATYPE_BINARY);
-            string_type name1 = ast_get_rule_name(bin1);
+            if (m_ptr != NULL)
+                ++m_block;
+            if (m_block == m_blocks.size())
+                m_blocks.push_back((char *)::operator new(BLOCK_SIZE));
+            m_ptr = m_blocks[m_block];
+            m_left = BLOCK_SIZE;
+            pad = 0;
+        }
+        void *ret = m_ptr + pad;
+        m_ptr += pad + size;
+        m_left -= pad + size;
+        return ret;
+    }
 
-            for (size_t k = i + 1; k < (*pvec).size(); ++k)
-            {
-                BinaryAst *bin2 = (*pvec)[k];
-                assert(bin2->m_atype == ATYPE_BINARY);
-                string_type name2 = ast_get_rule_name(bin2);
+    inline void AstTree::reset()
+    {
+        ast_delete(m_root);
+        delete m_arena;
+        m_root = NULL;
+        m_arena = NULL;
+    }
 
-                if (name1 != name2)
-                    continue;
+    /////////////////////////////////////////////////////////////////////////
+    // AtomTable inlines
 
-                SeqAst *seq1 = bin1->m_right->get_seq_ast();
-                SeqAst *seq2 = bin2->m_right->get_seq_ast();
+    inline AtomTable::Buckets *AtomTable::new_buckets(size_t count)
+    {
+        Buckets *buckets = new Buckets;
+        buckets->m_mask = count - 1;
+        buckets->m_slots = new std::atomic<atom_type>[count];
+        for (size_t i = 0; i < count; ++i)
+            buckets->m_slots[i].store(ATOM_NONE, std::memory_order_relaxed);
+        return buckets;
+    }
 
-                assert(seq1 && seq1->m_str == "expr");
-                assert(seq2 && seq2->m_str == "expr");
+    inline void AtomTable::delete_buckets(Buckets *buckets)
+    {
+        delete[] buckets->m_slots;
+        delete buckets;
+    }
 
-                seq1->m_vec.insert(seq1->m_vec.end(), seq2->m_vec.begin(), seq2->m_vec.end());
-                seq2->m_vec.clear();
+    inline size_t
+    AtomTable::lookup(const Buckets *buckets, const char *str, size_t len,
+                      size_t h) const
+    {
+        const size_t mask = buckets->m_mask;
+        for (size_t i = (h >> SHARD_BITS) & mask;; i = (i + 1) & mask)
+        {
+            const atom_type atom =
+                buckets->m_slots[i].load(std::memory_order_acquire);
+            if (atom == ATOM_NONE)
+                return i;
 
-                delete bin2;
-                (*pvec)[k] = NULL;
-                pvec->erase(pvec->begin() + k);
-                --k;
-                ret = true;
+            const Entry& e = entry(atom);
+            if (e.m_hash == h && e.m_str.size() == len &&
+                std::memcmp(e.m_str.data(), str, len) == 0)
+            {
+                return i;
             }
         }
+    }
 
-        return ret;
+    inline atom_type
+    AtomTable::probe(const char *str, size_t len, size_t h) const
+    {
+        const Shard& shard = m_shards[h & (SHARD_COUNT - 1)];
+        const Buckets *buckets = shard.m_buckets.load(std::memory_order_acquire);
+        const size_t i = lookup(buckets, str, len, h);
+        return buckets->m_slots[i].load(std::memory_order_acquire);
     }
 
-    inline void name_increment(string_type& name)
+    inline void AtomTable::rehash(Shard& shard)
     {
-        size_t i = name.find_last_not_of("0123456789");
-        if (i == string_type::npos || i == name.size() - 1)
+        const Buckets *old = shard.m_buckets.load(std::memory_order_relaxed);
+        Buckets *buckets = new_buckets((old->m_mask + 1) * 2);
+        const size_t mask = buckets->m_mask;
+        for (size_t k = 0; k <= old->m_mask; ++k)
         {
-            name += "_02";
-            return;
+            const atom_type atom = old->m_slots[k].load(std::memory_order_relaxed);
+            if (atom == ATOM_NONE)
+                continue;
+            size_t i = (entry(atom).m_hash >> SHARD_BITS) & mask;
+            while (buckets->m_slots[i].load(std::memory_order_relaxed) != ATOM_NONE)
+                i = (i + 1) & mask;
+            buckets->m_slots[i].store(atom, std::memory_order_relaxed);
         }
-        ++i;
-        string_type str = name.substr(0, i);
-        int n = atoi(name.substr(i).c_str());
-        name = str;
-        char buf[32];
-        std::sprintf(buf, "%02u", n + 1);
-        name += buf;
+        // the readers may still probe the old buckets
+        shard.m_old.push_back(const_cast<Buckets *>(old));
+        shard.m_buckets.store(buckets, std::memory_order_release);
     }
 
-    inline void ast_add_rule(BaseAst *rules, string_type& name, const BaseAst *rule_expr)
+    inline AtomTable::Entry& AtomTable::new_entry(atom_type atom)
     {
-        assert(!ast_join_joinable_rules(rules));
-
-        rules_vector *pvec = ast_get_rules_vector(rules);
-        assert(pvec);
-
-        assert(rule_expr->get_expr());
-        for (size_t i = 0; i < pvec->size(); ++i)
+        size_t offset;
+        const size_t chunk = chunk_of(atom, offset);
+        assert(chunk < CHUNK_COUNT);
+        Entry *entries = m_chunks[chunk].load(std::memory_order_acquire);
+        if (entries == NULL)
         {
-            BinaryAst *bin = (*pvec)[i];
-            if (ast_equal(bin->m_right, rule_expr))
+            std::lock_guard<std::mutex> guard(m_chunk_mutex);
+            entries = m_chunks[chunk].load(std::memory_order_relaxed);
+            if (entries == NULL)
             {
-                IdentAst *ident = bin->m_left->get_ident_ast();
-                name = ident->m_name;
-                return;
+                entries = new Entry[size_t(FIRST_CHUNK) << chunk];
+                m_chunks[chunk].store(entries, std::memory_order_release);
             }
         }
+        return entries[offset];
+    }
 
-        for (;;)
-        {
-            bool flag = false;
-            for (size_t i = 0; i < pvec->size(); ++i)
-            {
-                BinaryAst *bin = (*pvec)[i];
-                IdentAst *ident = bin->m_left->get_ident_ast();
-                if (name == ident->m_name)
-                {
-                    flag = true;
-                    break;
-                }
-            }
-            if (!flag)
-                break;
+    inline atom_type
+    AtomTable::insert(const char *str, size_t len, size_t h)
+    {
+        Shard& shard = m_shards[h & (SHARD_COUNT - 1)];
+        std::lock_guard<std::mutex> guard(shard.m_mutex);
 
-            name_increment(name);
+        // another thread may have interned it since the probe
+        Buckets *buckets = shard.m_buckets.load(std::memory_order_relaxed);
+        const size_t i = lookup(buckets, str, len, h);
+        atom_type atom = buckets->m_slots[i].load(std::memory_order_relaxed);
+        if (atom != ATOM_NONE)
+            return atom;
+
+        atom = m_size.fetch_add(1, std::memory_order_acq_rel);
+        Entry& e = new_entry(atom);
+        e.m_str.assign(str, len);
+        e.m_dashed = e.m_str;
+        for (size_t k = 0; k < len; ++k)
+        {
+            if (e.m_dashed[k] == '_' || e.m_dashed[k] == ' ')
+                e.m_dashed[k] = '-';
         }
+        e.m_hash = h;
+        buckets->m_slots[i].store(atom, std::memory_order_release);
 
-        IdentAst *ident = new IdentAst(name);
-        SeqAst *expr = rule_expr->sorted_clone()->get_expr();
-        assert(expr);
-        BinaryAst *bin = new BinaryAst("rule", ident, expr);
-        pvec->push_back(bin);
+        // keep the load factor of the shard under 1/2
+        if (++shard.m_count * 2 > buckets->m_mask + 1)
+            rehash(shard);
+        return atom;
     }
 
-    /////////////////////////////////////////////////////////////////////////
-    // AST method inlines
+    inline atom_type AtomTable::intern(const char *str, size_t len)
+    {
+        const size_t h = hash_of(str, len);
+        const atom_type atom = probe(str, len, h);
+        if (atom != ATOM_NONE)
+            return atom;
+        return insert(str, len, h);
+    }
 
-    inline IdentAst::IdentAst(const string_type& name)
-        : BaseAst(ATYPE_IDENT), m_name(name)
+    inline atom_type AtomTable::intern_name(const char *str, size_t len)
     {
-        for (size_t i = 0; i < m_name.size(); ++i)
+        // the converted name of this thread
+        static thread_local string_type s_name;
+        s_name.assign(str, len);
+        for (size_t i = 0; i < len; ++i)
         {
-            if (m_name[i] == '-' || m_name[i] == ' ')
-            {
-                m_name[i] = '_';
-            }
+            if (s_name[i] == '-' || s_name[i] == ' ')
+                s_name[i] = '_';
         }
+        return intern(s_name.c_str(), len);
+    }
+
+    inline atom_type AtomTable::find(const string_type& str) const
+    {
+        return probe(str.c_str(), str.size(), hash_of(str.c_str(), str.size()));
     }
-    inline string_type IdentAst::bnf_name() const
+
+    inline void AtomTable::clear()
+    {
+        // the nodes refer to the strings
+        assert(BaseAst::alive_count() == 0);
+        free_all();
+        m_size.store(0, std::memory_order_release);
+        init();
+    }
+
+    inline void AtomTable::init()
     {
-        string_type ret = m_name;
-        for (size_t i = 0; i < ret.size(); ++i)
+        for (size_t i = 0; i < CHUNK_COUNT; ++i)
+            m_chunks[i].store(NULL, std::memory_order_relaxed);
+        for (size_t i = 0; i < SHARD_COUNT; ++i)
         {
-            if (ret[i] == '_' || ret[i] == ' ')
-                ret[i] = '-';
+            m_shards[i].m_buckets.store(new_buckets(FIRST_BUCKETS),
+                                        std::memory_order_release);
+            m_shards[i].m_count = 0;
         }
-        return ret;
     }
-    inline string_type IdentAst::ebnf_name() const
+
+    inline void AtomTable::free_all()
     {
-        string_type ret = m_name;
-        for (size_t i = 0; i < ret.size(); ++i)
+        for (size_t i = 0; i < CHUNK_COUNT; ++i)
         {
-            if (ret[i] == '_' || ret[i] == ' ')
-                ret[i] = '-';
+            delete[] m_chunks[i].load(std::memory_order_relaxed);
+            m_chunks[i].store(NULL, std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < SHARD_COUNT; ++i)
+        {
+            Shard& shard = m_shards[i];
+            delete_buckets(shard.m_buckets.load(std::memory_order_relaxed));
+            shard.m_buckets.store(NULL, std::memory_order_relaxed);
+            for (size_t k = 0; k < shard.m_old.size(); ++k)
+                delete_buckets(shard.m_old[k]);
+            std::vector<Buckets *>().swap(shard.m_old);
         }
-        return ret;
     }
 
     template <typename T, AstType atype>
@@ -907,6 +2870,10 @@ namespace bnf_ast
     {
         return get_ast<SpecialAst, ATYPE_SPECIAL>();
     }
+    inline LazyAst *BaseAst::get_lazy_ast()
+    {
+        return get_ast<LazyAst, ATYPE_LAZY>();
+    }
 
     inline const IntegerAst *BaseAst::get_int_ast() const
     {
@@ -936,39 +2903,43 @@ namespace bnf_ast
     {
         return get_ast<SpecialAst, ATYPE_SPECIAL>();
     }
+    inline const LazyAst *BaseAst::get_lazy_ast() const
+    {
+        return get_ast<LazyAst, ATYPE_LAZY>();
+    }
 
     inline SeqAst *BaseAst::get_expr()
     {
         SeqAst *ret = get_seq_ast();
-        if (ret && ret->m_str == "expr")
+        if (ret && ret->m_type == SEQ_EXPR)
             return ret;
         return NULL;
     }
     inline SeqAst *BaseAst::get_terms()
     {
         SeqAst *ret = get_seq_ast();
-        if (ret && ret->m_str == "terms")
+        if (ret && ret->m_type == SEQ_TERMS)
             return ret;
         return NULL;
     }
     inline UnaryAst *BaseAst::get_group()
     {
         UnaryAst *ret = get_unary_ast();
-        if (ret && ret->m_str == "group")
+        if (ret && ret->m_type == UNARY_GROUP)
             return ret;
         return NULL;
     }
     inline UnaryAst *BaseAst::get_repeated()
     {
         UnaryAst *ret = get_unary_ast();
-        if (ret && ret->m_str == "repeated")
+        if (ret && ret->m_type == UNARY_REPEATED)
             return ret;
         return NULL;
     }
     inline UnaryAst *BaseAst::get_optional()
     {
         UnaryAst *ret = get_unary_ast();
-        if (ret && ret->m_str == "optional")
+        if (ret && ret->m_type == UNARY_OPTIONAL)
             return ret;
         return NULL;
     }
@@ -976,407 +2947,201 @@ namespace bnf_ast
     inline const SeqAst *BaseAst::get_expr() const
     {
         const SeqAst *ret = get_seq_ast();
-        if (ret && ret->m_str == "expr")
+        if (ret && ret->m_type == SEQ_EXPR)
             return ret;
         return NULL;
     }
     inline const SeqAst *BaseAst::get_terms() const
     {
         const SeqAst *ret = get_seq_ast();
-        if (ret && ret->m_str == "terms")
+        if (ret && ret->m_type == SEQ_TERMS)
             return ret;
         return NULL;
     }
     inline const UnaryAst *BaseAst::get_group() const
     {
         const UnaryAst *ret = get_unary_ast();
-        if (ret && ret->m_str == "group")
+        if (ret && ret->m_type == UNARY_GROUP)
             return ret;
         return NULL;
     }
     inline const UnaryAst *BaseAst::get_repeated() const
     {
         const UnaryAst *ret = get_unary_ast();
-        if (ret && ret->m_str == "repeated")
+        if (ret && ret->m_type == UNARY_REPEATED)
             return ret;
         return NULL;
     }
     inline const UnaryAst *BaseAst::get_optional() const
     {
         const UnaryAst *ret = get_unary_ast();
-        if (ret && ret->m_str == "optional")
+        if (ret && ret->m_type == UNARY_OPTIONAL)
             return ret;
         return NULL;
     }
 
+    inline BaseAst *UnaryAst::set_arg(BaseAst *ast)
+    {
+        BaseAst *old = m_arg;
+        ast_set_parent(old, NULL);
+        ast_set_parent(ast, this);
+        m_arg = ast;
+        ast_modified(this);
+        return old;
+    }
+
     inline void UnaryAst::to_dbg(os_type& os) const
     {
-        os << "[UNARY " << m_str << ": ";
-        if (m_arg)
-        {
-            m_arg->to_dbg(os);
-        }
-        os << "]";
+        ast_to_dbg(os, this);
     }
 
     inline void UnaryAst::to_bnf(os_type& os) const
     {
-        if (m_str == "optional")
-        {
-            os << '[';
-            m_arg->to_bnf(os);
-            os << ']';
-            return;
-        }
-        if (m_str == "repeated")
-        {
-            os << '{';
-            m_arg->to_bnf(os);
-            os << '}';
-            return;
-        }
-        if (m_str == "group")
-        {
-            os << '(';
-            m_arg->to_bnf(os);
-            os << ')';
-            return;
-        }
-        if (m_str == "+" || m_str == "*" || m_str == "?")
-        {
-            m_arg->to_bnf(os);
-            os << m_str;
-            return;
-        }
-        assert(0);
+        ast_to_bnf(os, this);
     }
 
     inline void UnaryAst::to_ebnf(os_type& os) const
     {
-        if (m_str == "optional" || m_str == "?")
-        {
-            os << '[';
-            m_arg->to_ebnf(os);
-            os << ']';
-            return;
-        }
-        if (m_str == "repeated" || m_str == "*")
-        {
-            os << '{';
-            m_arg->to_ebnf(os);
-            os << '}';
-            return;
-        }
-        if (m_str == "group")
-        {
-            os << '(';
-            m_arg->to_ebnf(os);
-            os << ')';
-            return;
-        }
-        if (m_str == "+")
-        {
-            os << '(';
-            m_arg->to_ebnf(os);
-            os << "), {";
-            m_arg->to_ebnf(os);
-            os << '}';
-            return;
-        }
-        assert(0);
+        ast_to_ebnf(os, this);
     }
 
-    inline BaseAst *StringAst::sorted_clone() const
+    inline BaseAst *StringAst::sorted_clone(AstArena *arena) const
     {
         if (m_str.empty())
-            return new EmptyAst();
+            return ast_new<EmptyAst>(arena);
+
+        return ast_new<StringAst>(arena, m_atom);
+    }
 
-        return new StringAst(m_str);
+    inline BaseAst *BinaryAst::set_left(BaseAst *ast)
+    {
+        assert(ast);
+        BaseAst *old = m_left;
+        ast_set_parent(old, NULL);
+        ast_set_parent(ast, this);
+        m_left = ast;
+        ast_modified(this);
+        return old;
+    }
+
+    inline BaseAst *BinaryAst::set_right(BaseAst *ast)
+    {
+        assert(ast);
+        BaseAst *old = m_right;
+        ast_set_parent(old, NULL);
+        ast_set_parent(ast, this);
+        m_right = ast;
+        ast_modified(this);
+        return old;
     }
 
     inline void BinaryAst::to_dbg(os_type& os) const
     {
-        os << "[BINARY " << m_str << ": ";
-        m_left->to_dbg(os);
-        os << ", ";
-        m_right->to_dbg(os);
-        os << "]";
+        ast_to_dbg(os, this);
     }
 
     inline void BinaryAst::to_bnf(os_type& os) const
     {
-        if (m_str == "rule")
-        {
-            m_left->to_bnf(os);
-            os << " ::= ";
-            m_right->to_bnf(os);
-            os << "\n";
-            return;
-        }
-        if (m_str == "-")
-        {
-            m_left->to_bnf(os);
-            os << " - ";
-            m_right->to_bnf(os);
-            return;
-        }
-        if (m_str == "*")
-        {
-            const IntegerAst *integer = m_left->get_int_ast();
-            if (const int n = integer->m_integer)
-            {
-                m_right->to_bnf(os);
-                for (int i = 1; i < n; ++i)
-                {
-                    os << " ";
-                    m_right->to_bnf(os);
-                }
-            }
-            else
-            {
-                os << "\"\"";
-            }
-            return;
-        }
-        assert(0);
+        ast_to_bnf(os, this);
     }
 
     inline void BinaryAst::to_ebnf(os_type& os) const
     {
-        if (m_str == "rule")
-        {
-            m_left->to_ebnf(os);
-            os << " = ";
-            m_right->to_ebnf(os);
-            os << ";\n";
-            return;
-        }
-        if (m_str == "-")
-        {
-            m_left->to_ebnf(os);
-            os << " - ";
-            m_right->to_ebnf(os);
-            return;
-        }
-        if (m_str == "*")
-        {
-            assert(m_left->get_int_ast());
-            m_left->to_ebnf(os);
-            os << " * ";
-            m_right->to_ebnf(os);
-            return;
-        }
-        assert(0);
+        ast_to_ebnf(os, this);
     }
 
-    inline BaseAst *SeqAst::clone() const
+    inline BaseAst *SeqAst::clone(AstArena *arena) const
     {
-        SeqAst *ast = new SeqAst(m_str);
-        for (size_t i = 0; i < size(); ++i)
-        {
-            ast->push_back(m_vec[i]->clone());
-        }
-        return ast;
+        return ast_clone(this, arena);
     }
 
-    inline BaseAst *SeqAst::sorted_clone() const
+    inline BaseAst *SeqAst::sorted_clone(AstArena *arena) const
     {
-        SeqAst *ast = new SeqAst(m_str);
-        if (m_str == "terms")
-        {
-            for (size_t i = 0; i < size(); ++i)
-            {
-                if (m_vec[i]->empty())
-                    continue;
+        return ast_sorted_clone(this, arena);
+    }
 
-                if (const UnaryAst *unary = m_vec[i]->get_group())
-                {
-                    const SeqAst *expr = unary->m_arg->get_expr();
-                    if (expr->size() == 1)
-                    {
-                        const SeqAst *terms = expr->m_vec[0]->get_terms();
-                        if (terms->empty())
-                            continue;
+    inline bool SeqAst::empty() const
+    {
+        return ast_empty(this);
+    }
 
-                        SeqAst *cloned_terms = terms->sorted_clone()->get_terms();
-                        ast->m_vec.insert(ast->m_vec.end(),
-                                          cloned_terms->m_vec.begin(),
-                                          cloned_terms->m_vec.end());
-                        cloned_terms->m_vec.clear();
-                        delete cloned_terms;
-                        continue;
-                    }
-                }
+    // NOTE: The first of the equal neighbors is kept, in one pass.
+    inline void SeqAst::unique()
+    {
+        if (m_vec.empty())
+            return;
 
-                BaseAst *cloned = m_vec[i]->sorted_clone();
-                ast->push_back(cloned);
-            }
-        }
-        else if (m_str == "expr")
+        size_t last = 0;
+        for (size_t i = 1; i < size(); ++i)
         {
-            for (size_t i = 0; i < size(); ++i)
-            {
-                const SeqAst *terms = m_vec[i]->get_terms();
-                if (terms && terms->size() == 1)
-                {
-                    if (const UnaryAst *unary = terms->m_vec[0]->get_group())
-                    {
-                        const SeqAst *expr = unary->m_arg->get_expr();
-                        SeqAst *cloned_expr = expr->sorted_clone()->get_expr();
-                        ast->m_vec.insert(ast->m_vec.end(),
-                                          cloned_expr->m_vec.begin(),
-                                          cloned_expr->m_vec.end());
-                        cloned_expr->m_vec.clear();
-                        delete cloned_expr;
-                        continue;
-                    }
-                }
-
-                BaseAst *cloned = m_vec[i]->sorted_clone();
-                ast->push_back(cloned);
-            }
-            std::sort(ast->m_vec.begin(), ast->m_vec.end(), ast_less_than_sorted);
-            ast->unique();
+            if (ast_equal(m_vec[last], m_vec[i], true))
+                ast_delete(m_vec[i]);
+            else
+                m_vec[++last] = m_vec[i];
         }
-        else if (m_str == "rules")
+        if (last + 1 < size())
         {
-            for (size_t i = 0; i < size(); ++i)
-            {
-                BaseAst *cloned = m_vec[i]->sorted_clone();
-                ast->push_back(cloned);
-            }
+            m_vec.resize(last + 1);
+            ast_modified(this);
         }
-        return ast;
     }
 
-    inline bool SeqAst::empty() const
+    inline void SeqAst::push_back(BaseAst *ast)
     {
-        if (m_str == "rules")
-            return false;
+        assert(ast);
+        ast_set_parent(ast, this);
+        m_vec.push_back(ast);
+        ast_modified(this);
+    }
 
-        for (size_t i = 0; i < size(); ++i)
+    template <typename T_ITER>
+    inline void SeqAst::insert(size_t index, T_ITER first, T_ITER last)
+    {
+        assert(index <= size());
+        for (T_ITER it = first; it != last; ++it)
         {
-            if (!m_vec[i]->empty())
-                return false;
+            assert(*it);
+            ast_set_parent(*it, this);
         }
-        return true;
+        m_vec.insert(m_vec.begin() + index, first, last);
+        ast_modified(this);
     }
 
-    inline void SeqAst::unique()
+    inline void SeqAst::erase(size_t first, size_t last)
     {
-        for (size_t i = 0; i < size() - 1; )
+        assert(first <= last && last <= size());
+        for (size_t i = first; i < last; ++i)
         {
-            if (ast_equal(m_vec[i], m_vec[i + 1], true))
-            {
-                delete m_vec[i];
-                m_vec.erase(m_vec.begin() + i);
-            }
-            else
-            {
-                ++i;
-            }
+            ast_delete(m_vec[i]);
         }
+        m_vec.erase(m_vec.begin() + first, m_vec.begin() + last);
+        ast_modified(this);
+    }
+
+    inline BaseAst *SeqAst::replace(size_t index, BaseAst *ast)
+    {
+        assert(index < size() && ast);
+        BaseAst *old = m_vec[index];
+        ast_set_parent(old, NULL);
+        ast_set_parent(ast, this);
+        m_vec[index] = ast;
+        ast_modified(this);
+        return old;
     }
 
     inline void SeqAst::to_dbg(os_type& os) const
     {
-        os << "[SEQ " << m_str << ": ";
-        if (size())
-        {
-            m_vec[0]->to_dbg(os);
-            for (size_t i = 1; i < size(); ++i)
-            {
-                os << ", ";
-                m_vec[i]->to_dbg(os);
-            }
-        }
-        os << "]";
+        ast_to_dbg(os, this);
     }
 
     inline void SeqAst::to_bnf(os_type& os) const
     {
-        if (m_str == "rules")
-        {
-            for (size_t i = 0; i < size(); ++i)
-            {
-                m_vec[i]->to_bnf(os);
-            }
-            return;
-        }
-        if (m_str == "expr")
-        {
-            if (empty())
-            {
-                os << "\"\"";
-            }
-            else
-            {
-                m_vec[0]->to_bnf(os);
-                for (size_t i = 1; i < size(); ++i)
-                {
-                    os << " | ";
-                    m_vec[i]->to_bnf(os);
-                }
-            }
-            return;
-        }
-        if (m_str == "terms")
-        {
-            if (empty())
-            {
-                os << "\"\"";
-            }
-            else
-            {
-                m_vec[0]->to_bnf(os);
-                for (size_t i = 1; i < size(); ++i)
-                {
-                    os << " ";
-                    m_vec[i]->to_bnf(os);
-                }
-            }
-            return;
-        }
-        assert(0);
+        ast_to_bnf(os, this);
     }
 
     inline void SeqAst::to_ebnf(os_type& os) const
     {
-        if (m_str == "rules")
-        {
-            for (size_t i = 0; i < size(); ++i)
-            {
-                m_vec[i]->to_ebnf(os);
-            }
-            return;
-        }
-        if (m_str == "expr")
-        {
-            if (!empty())
-            {
-                m_vec[0]->to_ebnf(os);
-                for (size_t i = 1; i < size(); ++i)
-                {
-                    os << " | ";
-                    m_vec[i]->to_ebnf(os);
-                }
-            }
-            return;
-        }
-        if (m_str == "terms")
-        {
-            if (!empty())
-            {
-                m_vec[0]->to_ebnf(os);
-                for (size_t i = 1; i < size(); ++i)
-                {
-                    os << ", ";
-                    m_vec[i]->to_ebnf(os);
-                }
-            }
-            return;
-        }
-        assert(0);
+        ast_to_ebnf(os, this);
     }
 } // namespace bnf_ast
 
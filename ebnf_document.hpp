@@ -0,0 +1,400 @@
+// ebnf_document.hpp --- incrementally parsed ISO EBNF notation text
+// See ReadMe.txt and License.txt.
+/////////////////////////////////////////////////////////////////////////
+
+#ifndef EBNF_DOCUMENT_HPP_
+#define EBNF_DOCUMENT_HPP_  1   // Version 1
+
+#include "parallel_parser.hpp"  // for EBNF::RuleSplitter
+
+/////////////////////////////////////////////////////////////////////////
+
+namespace EBNF
+{
+    // a part of the text that ends at a rule end, or the rest of the text
+    struct DocChunk : RuleChunk
+    {
+        bool                    m_rule_end; // false for the rest
+        BaseAst                *m_rule;     // NULL if failed or trivia
+        bool                    m_moved;    // moved since its messages were made
+        std::vector<AuxItem>    m_errors;
+        std::vector<AuxItem>    m_warnings;
+    };
+
+    // the rules replaced by the last edit
+    struct RuleChange
+    {
+        size_t  m_first;        // the index of the first rule replaced
+        size_t  m_removed;      // the number of the old rules
+        size_t  m_inserted;     // the number of the new rules
+    };
+
+    // NOTE: EbnfDocument keeps the text split at the rule ends, and parses
+    //       each chunk by itself. edit() splits the text again from the
+    //       chunk that the edit touches, until a rule end meets an old one
+    //       after the edit, and parses only the new chunks. Their rules
+    //       are spliced into ast(), and last_change() tells which rules
+    //       were replaced. The chunks after the edit are moved, not parsed
+    //       again, unless they have errors.
+    //       ast() holds the rules that are parsed successfully. The errors
+    //       of all the chunks are in aux().
+    //       edit() does not move the spans of the rules after the edit; it
+    //       records rule_shift(i) of the i-th rule instead. ast() moves the
+    //       spans first, in time of the nodes of the rules moved, so its
+    //       spans are always right. unshifted_ast() is the opt-in that
+    //       skips it: the text of its i-th rule is at its spans plus
+    //       rule_shift(i), so an edit costs no node walk.
+    class EbnfDocument
+    {
+    public:
+        EbnfDocument() : m_rules(new SeqAst(SEQ_RULES))
+        {
+            clear();
+        }
+        ~EbnfDocument()
+        {
+            ast_delete(m_rules);
+        }
+
+        bool set_text(const string_type& text)
+        {
+            clear();
+            return edit(0, 0, text);
+        }
+        // replace text[offset, offset + removed) with inserted
+        bool edit(size_t offset, size_t removed, const string_type& inserted);
+
+        const string_type& text() const
+        {
+            return m_text;
+        }
+        // whether the whole text is parsed without errors
+        bool ok() const
+        {
+            return m_error_chunks == 0;
+        }
+        // NOTE: aux() catches up with the edits first, in time of the
+        //       chunks if any have messages.
+        const AuxInfo& aux()
+        {
+            flush();
+            return m_aux;
+        }
+        BaseAst *ast()
+        {
+            shift_spans();
+            return unshifted_ast();
+        }
+        BaseAst *unshifted_ast()
+        {
+            const std::vector<BaseAst *>& vec = m_rules->m_vec;
+            if (vec.empty())
+            {
+                m_rules->m_begin = m_rules->m_end = 0;
+            }
+            else
+            {
+                m_rules->m_begin = vec.front()->m_begin + m_shifts.front();
+                m_rules->m_end = vec.back()->m_end + m_shifts.back();
+            }
+            return m_rules;
+        }
+        // the move of the spans of the i-th rule not done yet
+        ptrdiff_t rule_shift(size_t index) const
+        {
+            return m_shifts[index];
+        }
+        // shift_spans() moves the spans of the rules by their rule_shift().
+        void shift_spans();
+        const RuleChange& last_change() const
+        {
+            return m_change;
+        }
+        const std::vector<DocChunk>& chunks() const
+        {
+            return m_chunks;
+        }
+
+    protected:
+        string_type             m_text;
+        std::vector<DocChunk>   m_chunks;
+        SeqAst                 *m_rules;
+        std::vector<ptrdiff_t>  m_shifts;   // the moves of the rules not done yet
+        AuxInfo                 m_aux;
+        RuleChange              m_change;
+
+        size_t                  m_error_chunks;
+        size_t                  m_message_chunks;   // with errors or warnings
+        bool                    m_moved;    // flush() is needed
+        bool                    m_shifted;  // a rule_shift() may be nonzero
+
+        void clear();
+        void parse_chunk(DocChunk& chunk) const;
+        void flush();
+
+    private:
+        EbnfDocument(const EbnfDocument&);
+        EbnfDocument& operator=(const EbnfDocument&);
+    };
+
+    /////////////////////////////////////////////////////////////////////////
+    // EbnfDocument inlines
+
+    inline void EbnfDocument::clear()
+    {
+        m_text.clear();
+        ast_delete(m_rules);
+        m_rules = new SeqAst(SEQ_RULES);
+        m_shifts.clear();
+        m_aux.m_errors.clear();
+        m_aux.m_warnings.clear();
+
+        DocChunk chunk;
+        chunk.m_begin = chunk.m_head = chunk.m_end = 0;
+        chunk.m_line = 1;
+        chunk.m_rule_end = false;
+        chunk.m_rule = NULL;
+        chunk.m_moved = false;
+        m_chunks.assign(1, chunk);
+        m_error_chunks = m_message_chunks = 0;
+        m_moved = m_shifted = false;
+
+        RuleChange change = { 0, 0, 0 };
+        m_change = change;
+    }
+
+    // NOTE: A chunk that ends at a rule end holds one rule at most.
+    inline void EbnfDocument::parse_chunk(DocChunk& chunk) const
+    {
+        chunk.m_rule = NULL;
+
+        StringScanner scanner(m_text.c_str(), chunk.m_end, chunk);
+        AuxInfo aux;
+        TokenStream stream(scanner, aux);
+        stream.zero_copy(true);
+        if (stream.scan())
+        {
+            stream.fixup();
+
+            // only the trivia after the last rule
+            if (chunk.m_rule_end || stream.size() != 1)
+            {
+                Parser parser(stream, aux);
+                if (parser.parse())
+                {
+                    BaseAst *ast = parser.detach();
+                    SeqAst *seq = ast->get_seq_ast();
+                    assert(seq->size() == 1);
+                    chunk.m_rule = seq->m_vec[0];
+                    ast_set_parent(chunk.m_rule, NULL);
+                    seq->m_vec.clear();
+                    ast_delete(ast);
+                }
+            }
+        }
+
+        chunk.m_errors.swap(aux.m_errors);
+        chunk.m_warnings.swap(aux.m_warnings);
+        chunk.m_moved = false;
+    }
+
+    inline bool
+    EbnfDocument::edit(size_t offset, size_t removed, const string_type& inserted)
+    {
+        assert(offset <= m_text.size() && removed <= m_text.size() - offset);
+        const size_t old_end = offset + removed;
+        const size_t new_end = offset + inserted.size();
+        const ptrdiff_t delta = ptrdiff_t(inserted.size()) - ptrdiff_t(removed);
+        const ptrdiff_t line_delta =
+            std::count(inserted.begin(), inserted.end(), '\n') -
+            std::count(m_text.begin() + offset, m_text.begin() + old_end, '\n');
+        m_text.replace(offset, removed, inserted);
+
+        // the first chunk that may be touched
+        size_t first = 0, last = m_chunks.size() - 1;
+        while (first < last)
+        {
+            const size_t mid = (first + last) / 2;
+            if (m_chunks[mid].m_end < offset)
+                first = mid + 1;
+            else
+                last = mid;
+        }
+
+        // split again until a rule end after the edit meets an old one
+        RuleSplitter splitter(m_text.c_str(), m_text.size(), m_chunks[first]);
+        std::vector<DocChunk> made;
+        DocChunk chunk;
+        static_cast<ScanOrigin&>(chunk) = m_chunks[first];
+        chunk.m_rule = NULL;
+        chunk.m_moved = false;
+        last = first;
+        for (;;)
+        {
+            chunk.m_end = splitter.cut(splitter.index());
+            if (chunk.m_end == 0)
+            {
+                chunk.m_end = m_text.size();
+                chunk.m_rule_end = false;
+                made.push_back(chunk);
+                last = m_chunks.size();
+                break;
+            }
+            chunk.m_rule_end = true;
+            made.push_back(chunk);
+
+            if (chunk.m_end > new_end)
+            {
+                const size_t old_pos = chunk.m_end - new_end + old_end;
+                while (last < m_chunks.size() && m_chunks[last].m_end < old_pos)
+                    ++last;
+                if (last < m_chunks.size() && m_chunks[last].m_end == old_pos &&
+                    m_chunks[last].m_rule_end)
+                {
+                    ++last;
+                    break;
+                }
+            }
+
+            chunk.m_begin = chunk.m_end;
+            chunk.m_head = splitter.head();
+            chunk.m_line = splitter.line();
+        }
+
+        // replace the chunks [first, last) with the new ones
+        m_change.m_first = m_change.m_removed = m_change.m_inserted = 0;
+        for (size_t i = 0; i < first; ++i)
+        {
+            if (m_chunks[i].m_rule)
+                ++m_change.m_first;
+        }
+        for (size_t i = first; i < last; ++i)
+        {
+            if (m_chunks[i].m_rule)
+                ++m_change.m_removed;
+            if (!m_chunks[i].m_errors.empty())
+                --m_error_chunks;
+            if (!m_chunks[i].m_errors.empty() || !m_chunks[i].m_warnings.empty())
+                --m_message_chunks;
+        }
+
+        std::vector<BaseAst *> new_rules;
+        for (size_t i = 0; i < made.size(); ++i)
+        {
+            parse_chunk(made[i]);
+            if (made[i].m_rule)
+                new_rules.push_back(made[i].m_rule);
+            if (!made[i].m_errors.empty())
+                ++m_error_chunks;
+            if (!made[i].m_errors.empty() || !made[i].m_warnings.empty())
+                ++m_message_chunks;
+        }
+        m_change.m_inserted = new_rules.size();
+
+        const size_t index = m_change.m_first;
+        m_rules->erase(index, index + m_change.m_removed);
+        m_rules->insert(index, new_rules.begin(), new_rules.end());
+        m_shifts.erase(m_shifts.begin() + index,
+                       m_shifts.begin() + index + m_change.m_removed);
+        m_shifts.insert(m_shifts.begin() + index, new_rules.size(), 0);
+        for (size_t i = index + new_rules.size(); i < m_shifts.size(); ++i)
+        {
+            m_shifts[i] += delta;
+            m_shifted = true;
+        }
+
+        if (made.size() == last - first)
+        {
+            std::swap_ranges(made.begin(), made.end(), m_chunks.begin() + first);
+        }
+        else
+        {
+            m_chunks.erase(m_chunks.begin() + first, m_chunks.begin() + last);
+            m_chunks.insert(m_chunks.begin() + first, made.begin(), made.end());
+        }
+
+        // move the chunks after the edit
+        for (size_t i = first + made.size(); i < m_chunks.size(); ++i)
+        {
+            DocChunk& moved = m_chunks[i];
+            moved.m_begin += delta;
+            moved.m_end += delta;
+            moved.m_line += line_delta;
+            // a line head before the edit end is on the line of the last rule end
+            if (moved.m_head > old_end)
+                moved.m_head += delta;
+            else
+                moved.m_head = splitter.head();
+            moved.m_moved = true;
+        }
+        m_moved = true;
+
+        return ok();
+    }
+
+    // NOTE: This parses again the moved chunks with messages for their
+    //       positions, and gathers the messages.
+    inline void EbnfDocument::flush()
+    {
+        if (!m_moved)
+            return;
+
+        m_aux.m_errors.clear();
+        m_aux.m_warnings.clear();
+        m_moved = false;
+        if (m_message_chunks == 0)
+            return;
+
+        size_t index = 0;
+        for (size_t i = 0; i < m_chunks.size(); ++i)
+        {
+            DocChunk& chunk = m_chunks[i];
+            if (chunk.m_errors.empty() && chunk.m_warnings.empty())
+            {
+                if (chunk.m_rule)
+                    ++index;
+                continue;
+            }
+
+            if (chunk.m_moved)
+            {
+                BaseAst *rule = chunk.m_rule;
+                parse_chunk(chunk);
+                assert(!rule == !chunk.m_rule);
+                if (rule)
+                {
+                    ast_delete(m_rules->replace(index, chunk.m_rule));
+                    m_shifts[index] = 0;
+                }
+            }
+            if (chunk.m_rule)
+                ++index;
+
+            m_aux.m_errors.insert(m_aux.m_errors.end(),
+                                  chunk.m_errors.begin(), chunk.m_errors.end());
+            m_aux.m_warnings.insert(m_aux.m_warnings.end(),
+                                    chunk.m_warnings.begin(), chunk.m_warnings.end());
+        }
+    }
+
+    inline void EbnfDocument::shift_spans()
+    {
+        if (!m_shifted)
+            return;
+
+        m_shifted = false;
+        const std::vector<BaseAst *>& vec = m_rules->m_vec;
+        for (size_t i = 0; i < vec.size(); ++i)
+        {
+            if (m_shifts[i])
+            {
+                ast_shift_spans(vec[i], m_shifts[i]);
+                m_shifts[i] = 0;
+            }
+        }
+    }
+} // namespace EBNF
+
+/////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef EBNF_DOCUMENT_HPP_
@@ -0,0 +1,368 @@
+// event_parser.hpp --- event-driven ISO EBNF notation parser
+// See ReadMe.txt and License.txt.
+/////////////////////////////////////////////////////////////////////////
+
+#ifndef EVENT_PARSER_HPP_
+#define EVENT_PARSER_HPP_   1   // Version 1
+
+#include "EBNF.hpp"     // for EBNF::TokenStream, ...
+
+/////////////////////////////////////////////////////////////////////////
+
+namespace EBNF
+{
+    // NOTE: EventHandler receives the events of EventParser. The events
+    //       of a rule body come in the source order:
+    //
+    //         begin_expr, {term, alternative}, term, end_expr
+    //       where term is:
+    //         factor, [exception, factor], {concatenate, term}
+    //       and factor is:
+    //         [repetition], (ident | terminal | special | empty |
+    //          begin_bracket, begin_expr, ..., end_expr, end_bracket)
+    //
+    //       The default handler does nothing.
+    class EventHandler
+    {
+    public:
+        virtual ~EventHandler()
+        {
+        }
+
+        virtual void begin_rule(atom_type /* name */)
+        {
+        }
+        virtual void end_rule()
+        {
+        }
+
+        // definitions_list
+        virtual void begin_expr()
+        {
+        }
+        // '|' between single_definitions
+        virtual void alternative()
+        {
+        }
+        virtual void end_expr()
+        {
+        }
+        // ',' between terms
+        virtual void concatenate()
+        {
+        }
+
+        virtual void ident(atom_type /* atom */)
+        {
+        }
+        virtual void terminal(atom_type /* atom */)
+        {
+        }
+        virtual void special(const string_type& /* str */)
+        {
+        }
+        virtual void empty()
+        {
+        }
+
+        // type is UNARY_OPTIONAL, UNARY_REPEATED or UNARY_GROUP
+        virtual void begin_bracket(UnaryType /* type */)
+        {
+        }
+        virtual void end_bracket(UnaryType /* type */)
+        {
+        }
+
+        // '-' after the factor; the exception factor follows
+        virtual void exception()
+        {
+        }
+        // integer '*'; the primary follows
+        virtual void repetition(int /* count */)
+        {
+        }
+    };
+
+    // NOTE: EventParser parses as Parser does, with the same errors, but
+    //       it makes no AST. Instead, it calls the EventHandler on each
+    //       production. With a lazy TokenStream, it runs in the memory of
+    //       the deepest bracket only.
+    class EventParser
+    {
+    public:
+        EventParser(TokenStream& stream, AuxInfo& aux, EventHandler& handler)
+            : m_stream(stream), m_aux(aux), m_handler(handler), m_depth(0),
+              m_max_depth(Parser::DEFAULT_MAX_DEPTH)
+        {
+        }
+
+        // NOTE: A max_depth of zero means no limit. See Parser::max_depth.
+        size_t max_depth() const
+        {
+            return m_max_depth;
+        }
+        void max_depth(size_t depth)
+        {
+            m_max_depth = depth;
+        }
+
+        bool parse();
+
+        bool visit_syntax();
+        bool visit_syntax_rule();
+        bool visit_definitions_list();
+        bool visit_single_definition();
+        bool visit_term();
+        bool visit_factor();
+        bool visit_primary();
+        bool visit_bracket(UnaryType type, SymbolType close, const char *unmatched);
+
+    protected:
+        TokenStream&    m_stream;
+        AuxInfo&        m_aux;
+        EventHandler&   m_handler;
+        size_t          m_depth;
+        size_t          m_max_depth;
+
+        bool next()
+        {
+            return m_stream.next();
+        }
+        TokenType type() const
+        {
+            return m_stream.type();
+        }
+        bool is_symbol(SymbolType sym) const
+        {
+            return m_stream.symbol() == sym;
+        }
+        size_t get_line() const
+        {
+            return m_stream.token_line();
+        }
+        size_t get_column() const
+        {
+            return m_stream.token_column();
+        }
+
+    private:
+        EventParser(const EventParser&);
+        EventParser& operator=(const EventParser&);
+    };
+
+    /////////////////////////////////////////////////////////////////////////
+    // EventParser inlines
+
+    inline bool EventParser::parse()
+    {
+        if (m_stream.size() == 0 || m_stream.failed())
+            return false;
+
+        m_depth = 0;
+        return visit_syntax() && type() == TOK_EOF && !m_stream.failed();
+    }
+
+    // syntax = syntax_rule, {syntax_rule};
+    inline bool EventParser::visit_syntax()
+    {
+        PRINT_FUNCTION();
+
+        do
+        {
+            if (!visit_syntax_rule())
+                return false;
+        } while (type() != TOK_EOF);
+        return true;
+    }
+
+    // syntax_rule = meta_identifier, '=', definitions_list, ';';
+    inline bool EventParser::visit_syntax_rule()
+    {
+        PRINT_FUNCTION();
+
+        if (type() != TOK_IDENT)
+        {
+            m_aux.add_error("expected TOK_IDENT", get_line(), get_column());
+            return false;
+        }
+        const atom_type name = m_stream.atom();
+        next();
+        if (!is_symbol(SYM_DEFINING))
+        {
+            m_aux.add_error("expected '='", get_line(), get_column());
+            return false;
+        }
+        next();
+
+        m_handler.begin_rule(name);
+        if (!visit_definitions_list())
+            return false;
+        if (!is_symbol(SYM_TERMINATOR))
+        {
+            m_aux.add_error("expected ';' or ','", get_line(), get_column());
+            return false;
+        }
+        next();
+        m_handler.end_rule();
+        return true;
+    }
+
+    // definitions_list = single_definition, {'|', single_definition};
+    inline bool EventParser::visit_definitions_list()
+    {
+        PRINT_FUNCTION();
+
+        m_handler.begin_expr();
+        if (!visit_single_definition())
+            return false;
+        while (is_symbol(SYM_SEPARATOR))
+        {
+            next();
+            m_handler.alternative();
+            if (!visit_single_definition())
+                return false;
+        }
+        m_handler.end_expr();
+        return true;
+    }
+
+    // single_definition = term, {',', term};
+    inline bool EventParser::visit_single_definition()
+    {
+        PRINT_FUNCTION();
+
+        if (!visit_term())
+            return false;
+        while (is_symbol(SYM_CONCATENATE))
+        {
+            next();
+            m_handler.concatenate();
+            if (!visit_term())
+                return false;
+        }
+        return true;
+    }
+
+    // term = factor, ['-', exception];
+    // exception = factor;
+    inline bool EventParser::visit_term()
+    {
+        PRINT_FUNCTION();
+
+        if (!visit_factor())
+            return false;
+        if (is_symbol(SYM_EXCEPT))
+        {
+            next();
+            m_handler.exception();
+            return visit_factor();
+        }
+        return true;
+    }
+
+    // factor = [integer, '*'], primary;
+    inline bool EventParser::visit_factor()
+    {
+        PRINT_FUNCTION();
+
+        if (type() == TOK_INTEGER)
+        {
+            int inte = m_stream.integer();
+            next();
+            if (is_symbol(SYM_REPETITION))
+            {
+                next();
+                m_handler.repetition(inte);
+                if (visit_primary())
+                    return true;
+            }
+            m_aux.add_error("expected '*'", get_line(), get_column());
+            return false;
+        }
+
+        return visit_primary();
+    }
+
+    // primary = optional_sequence | repeated_sequence |
+    //           special_sequence | grouped_sequence |
+    //           meta_identifier | terminal_string | empty;
+    inline bool EventParser::visit_primary()
+    {
+        PRINT_FUNCTION();
+
+        switch (type())
+        {
+        case TOK_STRING:
+            m_handler.terminal(m_stream.atom());
+            next();
+            return true;
+        case TOK_IDENT:
+            m_handler.ident(m_stream.atom());
+            next();
+            return true;
+        case TOK_SPECIAL:
+            m_handler.special(m_stream.str());
+            next();
+            return true;
+        case TOK_SYMBOL:
+            switch (m_stream.symbol())
+            {
+            case SYM_START_OPTION:
+                return visit_bracket(UNARY_OPTIONAL, SYM_END_OPTION, "']' unmatched");
+            case SYM_START_REPEAT:
+                return visit_bracket(UNARY_REPEATED, SYM_END_REPEAT, "'}' unmatched");
+            case SYM_START_GROUP:
+                return visit_bracket(UNARY_GROUP, SYM_END_GROUP, "')' unmatched");
+            case SYM_TERMINATOR:
+            case SYM_SEPARATOR:
+            case SYM_CONCATENATE:
+            case SYM_END_GROUP:
+            case SYM_END_REPEAT:
+            case SYM_END_OPTION:
+                m_handler.empty();
+                return true;
+            default:
+                return false;
+            }
+        default:
+            return false;
+        }
+    }
+
+    // optional_sequence = '[', definitions_list, ']';
+    // repeated_sequence = '{', definitions_list, '}';
+    // grouped_sequence = '(', definitions_list, ')';
+    inline bool
+    EventParser::visit_bracket(UnaryType type, SymbolType close, const char *unmatched)
+    {
+        PRINT_FUNCTION();
+
+        if (m_max_depth && m_depth >= m_max_depth)
+        {
+            m_aux.add_error("brackets nested too deeply", get_line(), get_column());
+            return false;
+        }
+        ++m_depth;
+
+        next();
+        m_handler.begin_bracket(type);
+        bool ok = visit_definitions_list();
+        if (ok && !is_symbol(close))
+        {
+            m_aux.add_error(unmatched, get_line(), get_column());
+            ok = false;
+        }
+        if (ok)
+        {
+            next();
+            m_handler.end_bracket(type);
+        }
+
+        --m_depth;
+        return ok;
+    }
+} // namespace EBNF
+
+/////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef EVENT_PARSER_HPP_
@@ -0,0 +1,435 @@
+// flat_ast.hpp --- flat index-based BNF/EBNF notation AST
+// See ReadMe.txt and License.txt.
+/////////////////////////////////////////////////////////////////////////
+
+#ifndef FLAT_AST_HPP_
+#define FLAT_AST_HPP_   1   // Version 1
+
+#include "bnf_ast.hpp"  // for bnf_ast::BaseAst, ...
+#include <cstdint>      // for uint32_t, int32_t
+#include <utility>      // for std::pair
+
+/////////////////////////////////////////////////////////////////////////
+
+namespace bnf_ast
+{
+    typedef uint32_t flat_index;
+    static const flat_index FLAT_NONE = flat_index(-1);
+
+    // NOTE: A flat node is 16 bytes. The children of a node are contiguous
+    //       in the node array, from m_first to m_first + m_count - 1.
+    //       m_value is the atom of an identifier or a string, the index of
+    //       a special in FlatAst::m_specials, or the value of an integer.
+    struct FlatNode
+    {
+        unsigned char   m_kind;     // AstType
+        unsigned char   m_subkind;  // SeqType, UnaryType or BinaryType
+        flat_index      m_first;    // the first child
+        uint32_t        m_count;    // the number of the children
+        uint32_t        m_value;
+
+        AstType kind() const
+        {
+            return AstType(m_kind);
+        }
+        SeqType seq_type() const
+        {
+            return SeqType(m_subkind);
+        }
+        UnaryType unary_type() const
+        {
+            return UnaryType(m_subkind);
+        }
+        BinaryType binary_type() const
+        {
+            return BinaryType(m_subkind);
+        }
+        atom_type atom() const
+        {
+            return m_value;
+        }
+        size_t special() const
+        {
+            return m_value;
+        }
+        int integer() const
+        {
+            return (int32_t)m_value;
+        }
+    };
+
+    // NOTE: The root is at index 0. The nodes are laid out breadth first,
+    //       so the same trees have the same node arrays. The specials are
+    //       kept in m_specials, not in the atom table. from_ast() asserts
+    //       that the atoms and the sizes fit in 32 bits.
+    class FlatAst
+    {
+    public:
+        std::vector<FlatNode>       m_nodes;
+        std::vector<string_type>    m_specials;
+
+        FlatAst()
+        {
+        }
+        FlatAst(const BaseAst *ast)
+        {
+            from_ast(ast);
+        }
+
+        void from_ast(const BaseAst *ast);
+        BaseAst *to_ast(flat_index node = 0, AstArena *arena = NULL) const;
+
+        void clear()
+        {
+            m_nodes.clear();
+            m_specials.clear();
+        }
+        size_t size() const
+        {
+            return m_nodes.size();
+        }
+        const FlatNode& operator[](flat_index i) const
+        {
+            assert(i < m_nodes.size());
+            return m_nodes[i];
+        }
+
+        bool empty(flat_index node) const;
+        void to_ebnf(os_type& os, flat_index node = 0) const;
+
+        flat_index get_rule_body(atom_type rule_atom) const;
+        flat_index get_rule_body(const string_type& rule_name) const;
+
+        const string_type& special(const FlatNode& node) const
+        {
+            assert(node.kind() == ATYPE_SPECIAL && node.special() < m_specials.size());
+            return m_specials[node.special()];
+        }
+
+    protected:
+        static uint32_t narrow(size_t value)
+        {
+            assert(value < FLAT_NONE);
+            return (uint32_t)value;
+        }
+    };
+
+    // NOTE: flat_equal() is not canonical. It compares as
+    //       ast_equal(ast1, ast2, true) does, i.e. the alternatives must
+    //       be in the same order. Make the FlatAst's of sorted_clone()'s
+    //       to compare as ast_equal(ast1, ast2) does.
+    bool flat_equal(const FlatAst& flat1, flat_index node1,
+                    const FlatAst& flat2, flat_index node2);
+
+    inline bool flat_equal(const FlatAst& flat1, const FlatAst& flat2)
+    {
+        return flat_equal(flat1, 0, flat2, 0);
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    // FlatAst inlines
+
+    inline void FlatAst::from_ast(const BaseAst *ast)
+    {
+        assert(ast);
+        clear();
+
+        // the node i is made from queue[i]
+        std::vector<const BaseAst *> queue;
+        queue.push_back(ast);
+        m_nodes.push_back(FlatNode());
+        for (size_t i = 0; i < queue.size(); ++i)
+        {
+            ast = ast_resolve(queue[i]);
+
+            FlatNode node;
+            node.m_kind = (unsigned char)ast->m_atype;
+            node.m_subkind = 0;
+            node.m_first = narrow(m_nodes.size());
+            node.m_count = 0;
+            node.m_value = 0;
+
+            switch (ast->m_atype)
+            {
+            case ATYPE_INTEGER:
+                {
+                    const int integer = ast->get_int_ast()->m_integer;
+                    assert(integer == (int32_t)integer);
+                    node.m_value = (uint32_t)(int32_t)integer;
+                }
+                break;
+            case ATYPE_STRING:
+                node.m_value = narrow(ast->get_str_ast()->m_atom);
+                break;
+            case ATYPE_IDENT:
+                node.m_value = narrow(ast->get_ident_ast()->m_atom);
+                break;
+            case ATYPE_SPECIAL:
+                node.m_value = narrow(m_specials.size());
+                m_specials.push_back(ast->get_special_ast()->m_str);
+                break;
+            case ATYPE_BINARY:
+                {
+                    const BinaryAst *bin = ast->get_bin_ast();
+                    node.m_subkind = (unsigned char)bin->m_type;
+                    queue.push_back(bin->m_left);
+                    queue.push_back(bin->m_right);
+                    node.m_count = 2;
+                }
+                break;
+            case ATYPE_UNARY:
+                {
+                    const UnaryAst *unary = ast->get_unary_ast();
+                    node.m_subkind = (unsigned char)unary->m_type;
+                    if (unary->m_arg)
+                    {
+                        queue.push_back(unary->m_arg);
+                        node.m_count = 1;
+                    }
+                }
+                break;
+            case ATYPE_SEQ:
+                {
+                    const SeqAst *seq = ast->get_seq_ast();
+                    node.m_subkind = (unsigned char)seq->m_type;
+                    queue.insert(queue.end(), seq->m_vec.begin(), seq->m_vec.end());
+                    node.m_count = narrow(seq->size());
+                }
+                break;
+            case ATYPE_EMPTY:
+            case ATYPE_LAZY:
+                break;
+            }
+
+            m_nodes[i] = node;
+            m_nodes.resize(queue.size());
+        }
+    }
+
+    inline BaseAst *FlatAst::to_ast(flat_index i, AstArena *arena) const
+    {
+        const FlatNode& node = (*this)[i];
+        switch (node.kind())
+        {
+        case ATYPE_INTEGER:
+            return ast_new<IntegerAst>(arena, node.integer());
+        case ATYPE_STRING:
+            return ast_new<StringAst>(arena, node.atom());
+        case ATYPE_IDENT:
+            return ast_new<IdentAst>(arena, node.atom());
+        case ATYPE_SPECIAL:
+            return ast_new<SpecialAst>(arena, special(node));
+        case ATYPE_BINARY:
+            {
+                BaseAst *left = to_ast(node.m_first, arena);
+                BaseAst *right = to_ast(node.m_first + 1, arena);
+                return ast_new<BinaryAst>(arena, node.binary_type(), left, right);
+            }
+        case ATYPE_UNARY:
+            {
+                const UnaryType type = node.unary_type();
+                if (node.m_count)
+                    return ast_new<UnaryAst>(arena, type, to_ast(node.m_first, arena));
+                return ast_new<UnaryAst>(arena, type);
+            }
+        case ATYPE_SEQ:
+            {
+                SeqAst *seq = ast_new<SeqAst>(arena, node.seq_type());
+                seq->m_vec.reserve(node.m_count);
+                for (uint32_t k = 0; k < node.m_count; ++k)
+                {
+                    seq->push_back(to_ast(node.m_first + k, arena));
+                }
+                return seq;
+            }
+        case ATYPE_EMPTY:
+        case ATYPE_LAZY:
+            break;
+        }
+        return ast_new<EmptyAst>(arena);
+    }
+
+    inline bool FlatAst::empty(flat_index i) const
+    {
+        const FlatNode& node = (*this)[i];
+        switch (node.kind())
+        {
+        case ATYPE_STRING:
+            return atom_table().str(node.atom()).empty();
+        case ATYPE_SEQ:
+            if (node.seq_type() == SEQ_RULES)
+                return false;
+            for (uint32_t k = 0; k < node.m_count; ++k)
+            {
+                if (!empty(node.m_first + k))
+                    return false;
+            }
+            return true;
+        case ATYPE_EMPTY:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // NOTE: This prints the same as BaseAst::to_ebnf.
+    inline void FlatAst::to_ebnf(os_type& os, flat_index i) const
+    {
+        const FlatNode& node = (*this)[i];
+        switch (node.kind())
+        {
+        case ATYPE_INTEGER:
+            os << node.integer();
+            break;
+        case ATYPE_STRING:
+            {
+                const string_type& str = atom_table().str(node.atom());
+                if (str.find('"') == string_type::npos)
+                    os << '"' << str << '"';
+                else
+                    os << "'" << str << "'";
+            }
+            break;
+        case ATYPE_IDENT:
+            os << atom_table().dashed(node.atom());
+            break;
+        case ATYPE_SPECIAL:
+            os << '?' << special(node) << '?';
+            break;
+        case ATYPE_BINARY:
+            to_ebnf(os, node.m_first);
+            switch (node.binary_type())
+            {
+            case BINARY_RULE:
+                os << " = ";
+                to_ebnf(os, node.m_first + 1);
+                os << ";\n";
+                break;
+            case BINARY_EXCEPT:
+                os << " - ";
+                to_ebnf(os, node.m_first + 1);
+                break;
+            case BINARY_TIMES:
+                os << " * ";
+                to_ebnf(os, node.m_first + 1);
+                break;
+            }
+            break;
+        case ATYPE_UNARY:
+            switch (node.unary_type())
+            {
+            case UNARY_OPTIONAL:
+            case UNARY_QUESTION:
+                os << '[';
+                to_ebnf(os, node.m_first);
+                os << ']';
+                break;
+            case UNARY_REPEATED:
+            case UNARY_STAR:
+                os << '{';
+                to_ebnf(os, node.m_first);
+                os << '}';
+                break;
+            case UNARY_GROUP:
+                os << '(';
+                to_ebnf(os, node.m_first);
+                os << ')';
+                break;
+            case UNARY_PLUS:
+                os << '(';
+                to_ebnf(os, node.m_first);
+                os << "), {";
+                to_ebnf(os, node.m_first);
+                os << '}';
+                break;
+            }
+            break;
+        case ATYPE_SEQ:
+            {
+                const char *sep = "";
+                if (node.seq_type() == SEQ_EXPR)
+                    sep = " | ";
+                else if (node.seq_type() == SEQ_TERMS)
+                    sep = ", ";
+                else
+                    assert(node.seq_type() == SEQ_RULES);
+
+                if (!empty(i))
+                {
+                    for (uint32_t k = 0; k < node.m_count; ++k)
+                    {
+                        if (k)
+                            os << sep;
+                        to_ebnf(os, node.m_first + k);
+                    }
+                }
+            }
+            break;
+        case ATYPE_EMPTY:
+        case ATYPE_LAZY:
+            break;
+        }
+    }
+
+    inline flat_index FlatAst::get_rule_body(atom_type rule_atom) const
+    {
+        const FlatNode& rules = (*this)[0];
+        assert(rules.kind() == ATYPE_SEQ && rules.seq_type() == SEQ_RULES);
+        for (uint32_t k = 0; k < rules.m_count; ++k)
+        {
+            const FlatNode& rule = (*this)[rules.m_first + k];
+            assert(rule.kind() == ATYPE_BINARY);
+            if ((*this)[rule.m_first].atom() == rule_atom)
+                return rule.m_first + 1;
+        }
+        return FLAT_NONE;
+    }
+
+    inline flat_index FlatAst::get_rule_body(const string_type& rule_name) const
+    {
+        atom_type rule_atom = atom_table().find(rule_name);
+        if (rule_atom == ATOM_NONE)
+            return FLAT_NONE;
+        return get_rule_body(rule_atom);
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    // flat AST functions
+
+    inline bool flat_equal(const FlatAst& flat1, flat_index node1,
+                           const FlatAst& flat2, flat_index node2)
+    {
+        std::vector<std::pair<flat_index, flat_index> > stack;
+        stack.push_back(std::make_pair(node1, node2));
+        while (!stack.empty())
+        {
+            const FlatNode& n1 = flat1[stack.back().first];
+            const FlatNode& n2 = flat2[stack.back().second];
+            stack.pop_back();
+
+            if (n1.m_kind != n2.m_kind || n1.m_subkind != n2.m_subkind ||
+                n1.m_count != n2.m_count)
+            {
+                return false;
+            }
+            if (n1.kind() == ATYPE_SPECIAL)
+            {
+                if (flat1.special(n1) != flat2.special(n2))
+                    return false;
+            }
+            else if (n1.m_value != n2.m_value)
+            {
+                return false;
+            }
+            for (uint32_t k = 0; k < n1.m_count; ++k)
+            {
+                stack.push_back(std::make_pair(n1.m_first + k, n2.m_first + k));
+            }
+        }
+        return true;
+    }
+} // namespace bnf_ast
+
+/////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef FLAT_AST_HPP_
@@ -0,0 +1,505 @@
+// hash_cons.hpp --- hash-consed BNF/EBNF notation AST
+// See ReadMe.txt and License.txt.
+/////////////////////////////////////////////////////////////////////////
+
+#ifndef HASH_CONS_HPP_
+#define HASH_CONS_HPP_  1   // Version 1
+
+#include "bnf_ast.hpp"      // for bnf_ast::BaseAst, ...
+#include <unordered_map>    // for std::unordered_map
+#include <unordered_set>    // for std::unordered_set
+
+/////////////////////////////////////////////////////////////////////////
+
+namespace bnf_ast
+{
+    // NOTE: HashConsFactory makes each node structure once. The same
+    //       children are shared by the parents, so the nodes make a DAG,
+    //       and two nodes of a factory are equal if and only if they are
+    //       the same pointer. The structural hash of a node is computed
+    //       when it is made. The alternatives of SEQ_EXPR are sorted and
+    //       made unique, so the hash does not depend on their order.
+    //       intern() returns the node of the canonical form of a tree,
+    //       i.e. sorted_clone(), so intern(a) == intern(b) if and only if
+    //       ast_equal(a, b).
+    //       The nodes live in the arena of the factory until clear() or
+    //       the destructor. They are shared and must not be modified, nor
+    //       given to ast_canonical() or ast_modified(), since a node
+    //       keeps one parent only (see AstCanonMemo).
+    class HashConsFactory
+    {
+    public:
+        HashConsFactory() : m_buckets(64, Bucket()), m_count(0)
+        {
+        }
+
+        const BaseAst *make_empty();
+        const BaseAst *make_integer(int integer);
+        // an empty string is made as make_empty()
+        const BaseAst *make_string(atom_type atom);
+        const BaseAst *make_ident(atom_type atom);
+        const BaseAst *make_special(const string_type& str);
+        // arg may be NULL
+        const BaseAst *make_unary(UnaryType type, const BaseAst *arg);
+        const BaseAst *make_binary(BinaryType type, const BaseAst *left,
+                                   const BaseAst *right);
+        const BaseAst *make_seq(SeqType type, const std::vector<const BaseAst *>& children)
+        {
+            return make_seq(type, children.data(), children.size());
+        }
+        const BaseAst *make_seq(SeqType type, const BaseAst *const *children, size_t count);
+
+        const BaseAst *intern(const BaseAst *ast);
+
+        // the structural hash of a node of the factory
+        size_t hash(const BaseAst *node) const
+        {
+            std::unordered_map<const BaseAst *, size_t>::const_iterator it = m_hashes.find(node);
+            assert(it != m_hashes.end());
+            return it->second;
+        }
+        bool owns(const BaseAst *node) const
+        {
+            return m_hashes.count(node) != 0;
+        }
+        // the number of the nodes made
+        size_t size() const
+        {
+            return m_count;
+        }
+        void clear();
+
+        static size_t hash_combine(size_t h, size_t value)
+        {
+            return h ^ (value + 0x9E3779B9 + (h << 6) + (h >> 2));
+        }
+
+    protected:
+        // a node to be made
+        struct Key
+        {
+            AstType                 m_atype;
+            int                     m_value;    // the integer or the type
+            atom_type               m_atom;
+            const string_type      *m_str;
+            const BaseAst *const   *m_children;
+            size_t                  m_count;
+        };
+        struct Bucket
+        {
+            const BaseAst  *m_ast;
+            size_t          m_hash;
+
+            Bucket() : m_ast(NULL), m_hash(0)
+            {
+            }
+        };
+
+        AstArena                                    m_arena;
+        std::vector<Bucket>                         m_buckets;  // open addressing
+        size_t                                      m_count;
+        std::unordered_map<const BaseAst *, size_t> m_hashes;
+        AstCanonView                                m_view;
+        std::vector<const BaseAst *>                m_sorted;
+        std::vector<std::pair<AstCanonView::node_type, bool> > m_stack;
+        std::vector<const BaseAst *>                m_made;
+
+        static Key make_key(AstType atype, int value = 0)
+        {
+            Key key = { atype, value, ATOM_NONE, NULL, NULL, 0 };
+            return key;
+        }
+        const BaseAst *find_or_make(const Key& key);
+        const BaseAst *make_view_node(AstCanonView::node_type node,
+                                      const BaseAst *const *children, size_t count);
+        size_t hash_of(const Key& key) const;
+        bool matches(const BaseAst *ast, const Key& key) const;
+        BaseAst *make_node(const Key& key);
+        void rehash();
+
+    private:
+        HashConsFactory(const HashConsFactory&);
+        HashConsFactory& operator=(const HashConsFactory&);
+    };
+
+    // NOTE: RuleIndex adds the rules as ast_add_rule() does, but it keeps
+    //       the hash-consed bodies and the names of the rules, so that an
+    //       equal body and a free name are found by the hash lookups. The
+    //       rules must be changed by add_rule() only while indexed.
+    class RuleIndex
+    {
+    public:
+        RuleIndex(BaseAst *rules);
+
+        void add_rule(string_type& name, const BaseAst *rule_expr);
+
+        const HashConsFactory& factory() const
+        {
+            return m_factory;
+        }
+
+    protected:
+        BaseAst                                        *m_rules;
+        HashConsFactory                                 m_factory;
+        std::unordered_map<const BaseAst *, atom_type>  m_bodies;   // the first rule
+        std::unordered_set<atom_type>                   m_names;
+
+        void index_rule(const BinaryAst *bin, const BaseAst *body);
+
+    private:
+        RuleIndex(const RuleIndex&);
+        RuleIndex& operator=(const RuleIndex&);
+    };
+
+    // ast_add_rule() by a RuleIndex of the rules
+    inline void ast_add_rule(RuleIndex& index, string_type& name, const BaseAst *rule_expr)
+    {
+        index.add_rule(name, rule_expr);
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    // HashConsFactory inlines
+
+    inline const BaseAst *HashConsFactory::make_empty()
+    {
+        return find_or_make(make_key(ATYPE_EMPTY));
+    }
+
+    inline const BaseAst *HashConsFactory::make_integer(int integer)
+    {
+        return find_or_make(make_key(ATYPE_INTEGER, integer));
+    }
+
+    inline const BaseAst *HashConsFactory::make_string(atom_type atom)
+    {
+        if (atom_table().str(atom).empty())
+            return make_empty();
+        Key key = make_key(ATYPE_STRING);
+        key.m_atom = atom;
+        return find_or_make(key);
+    }
+
+    inline const BaseAst *HashConsFactory::make_ident(atom_type atom)
+    {
+        Key key = make_key(ATYPE_IDENT);
+        key.m_atom = atom;
+        return find_or_make(key);
+    }
+
+    inline const BaseAst *HashConsFactory::make_special(const string_type& str)
+    {
+        Key key = make_key(ATYPE_SPECIAL);
+        key.m_str = &str;
+        return find_or_make(key);
+    }
+
+    inline const BaseAst *HashConsFactory::make_unary(UnaryType type, const BaseAst *arg)
+    {
+        assert(!arg || owns(arg));
+        Key key = make_key(ATYPE_UNARY, type);
+        key.m_children = &arg;
+        key.m_count = (arg ? 1 : 0);
+        return find_or_make(key);
+    }
+
+    inline const BaseAst *
+    HashConsFactory::make_binary(BinaryType type, const BaseAst *left, const BaseAst *right)
+    {
+        assert(owns(left) && owns(right));
+        const BaseAst *children[2] = { left, right };
+        Key key = make_key(ATYPE_BINARY, type);
+        key.m_children = children;
+        key.m_count = 2;
+        return find_or_make(key);
+    }
+
+    // NOTE: The equal alternatives are the same pointer, so they are
+    //       adjacent after sorting.
+    inline const BaseAst *
+    HashConsFactory::make_seq(SeqType type, const BaseAst *const *children, size_t count)
+    {
+        Key key = make_key(ATYPE_SEQ, type);
+        key.m_children = children;
+        key.m_count = count;
+        if (type == SEQ_EXPR)
+        {
+            m_sorted.assign(children, children + count);
+            std::sort(m_sorted.begin(), m_sorted.end(), ast_less_than_sorted);
+            m_sorted.erase(std::unique(m_sorted.begin(), m_sorted.end()), m_sorted.end());
+            key.m_children = m_sorted.data();
+            key.m_count = m_sorted.size();
+        }
+        for (size_t i = 0; i < key.m_count; ++i)
+        {
+            assert(owns(key.m_children[i]));
+        }
+        return find_or_make(key);
+    }
+
+    // NOTE: The canonical form is walked on an AstCanonView in post-order,
+    //       as ast_clone() does, so no copy of the tree is made.
+    inline const BaseAst *HashConsFactory::intern(const BaseAst *ast)
+    {
+        assert(ast);
+        m_stack.clear();
+        m_made.clear();
+        m_stack.push_back(std::make_pair(m_view.build(ast), false));
+        while (!m_stack.empty())
+        {
+            const AstCanonView::node_type node = m_stack.back().first;
+            const size_t count = m_view.count(node);
+            if (!m_stack.back().second)
+            {
+                m_stack.back().second = true;
+                for (size_t i = count; i-- > 0; )
+                {
+                    m_stack.push_back(std::make_pair(m_view.child(node, i), false));
+                }
+                continue;
+            }
+            m_stack.pop_back();
+
+            const size_t first = m_made.size() - count;
+            const BaseAst *made = make_view_node(node, m_made.data() + first, count);
+            m_made.resize(first);
+            m_made.push_back(made);
+        }
+
+        assert(m_made.size() == 1);
+        return m_made.back();
+    }
+
+    inline const BaseAst *
+    HashConsFactory::make_view_node(AstCanonView::node_type node,
+                                    const BaseAst *const *children, size_t count)
+    {
+        const BaseAst *ast = m_view.ast(node);
+        switch (m_view.atype(node))
+        {
+        case ATYPE_INTEGER:
+            return make_integer(ast->get_int_ast()->m_integer);
+        case ATYPE_STRING:
+            return make_string(ast->get_str_ast()->m_atom);
+        case ATYPE_IDENT:
+            return make_ident(ast->get_ident_ast()->m_atom);
+        case ATYPE_SPECIAL:
+            return make_special(ast->get_special_ast()->m_str);
+        case ATYPE_UNARY:
+            return make_unary(ast->get_unary_ast()->m_type, count ? children[0] : NULL);
+        case ATYPE_BINARY:
+            assert(count == 2);
+            return make_binary(ast->get_bin_ast()->m_type, children[0], children[1]);
+        case ATYPE_SEQ:
+            return make_seq(ast->get_seq_ast()->m_type, children, count);
+        case ATYPE_EMPTY:
+        case ATYPE_LAZY:
+            break;
+        }
+        return make_empty();
+    }
+
+    inline const BaseAst *HashConsFactory::find_or_make(const Key& key)
+    {
+        const size_t h = hash_of(key);
+        const size_t mask = m_buckets.size() - 1;
+        size_t i = h & mask;
+        while (m_buckets[i].m_ast)
+        {
+            if (m_buckets[i].m_hash == h && matches(m_buckets[i].m_ast, key))
+                return m_buckets[i].m_ast;
+            i = (i + 1) & mask;
+        }
+
+        BaseAst *ast = make_node(key);
+        m_buckets[i].m_ast = ast;
+        m_buckets[i].m_hash = h;
+        m_hashes[ast] = h;
+        ++m_count;
+
+        // keep the load factor under 1/2
+        if (m_count * 2 > m_buckets.size())
+            rehash();
+        return ast;
+    }
+
+    inline size_t HashConsFactory::hash_of(const Key& key) const
+    {
+        size_t h = hash_combine(0, key.m_atype);
+        switch (key.m_atype)
+        {
+        case ATYPE_STRING:
+        case ATYPE_IDENT:
+            h = hash_combine(h, atom_table().hash(key.m_atom));
+            break;
+        case ATYPE_SPECIAL:
+            h = hash_combine(h, AtomTable::hash_of(key.m_str->c_str(), key.m_str->size()));
+            break;
+        default:
+            h = hash_combine(h, size_t(unsigned(key.m_value)));
+            break;
+        }
+        for (size_t i = 0; i < key.m_count; ++i)
+        {
+            h = hash_combine(h, hash(key.m_children[i]));
+        }
+        return h;
+    }
+
+    // the children are compared as pointers
+    inline bool HashConsFactory::matches(const BaseAst *ast, const Key& key) const
+    {
+        if (ast->m_atype != key.m_atype)
+            return false;
+
+        switch (key.m_atype)
+        {
+        case ATYPE_INTEGER:
+            return ast->get_int_ast()->m_integer == key.m_value;
+        case ATYPE_STRING:
+            return ast->get_str_ast()->m_atom == key.m_atom;
+        case ATYPE_IDENT:
+            return ast->get_ident_ast()->m_atom == key.m_atom;
+        case ATYPE_SPECIAL:
+            return ast->get_special_ast()->m_str == *key.m_str;
+        case ATYPE_UNARY:
+            {
+                const UnaryAst *unary = ast->get_unary_ast();
+                return unary->m_type == key.m_value &&
+                       unary->m_arg == (key.m_count ? key.m_children[0] : NULL);
+            }
+        case ATYPE_BINARY:
+            {
+                const BinaryAst *bin = ast->get_bin_ast();
+                return bin->m_type == key.m_value &&
+                       bin->m_left == key.m_children[0] &&
+                       bin->m_right == key.m_children[1];
+            }
+        case ATYPE_SEQ:
+            {
+                const SeqAst *seq = ast->get_seq_ast();
+                return seq->m_type == key.m_value && seq->size() == key.m_count &&
+                       std::equal(seq->m_vec.begin(), seq->m_vec.end(), key.m_children);
+            }
+        case ATYPE_EMPTY:
+            return true;
+        case ATYPE_LAZY:
+            break;
+        }
+        return false;
+    }
+
+    // NOTE: The children are not owned, since the nodes of the arena are
+    //       never deleted by their parents.
+    inline BaseAst *HashConsFactory::make_node(const Key& key)
+    {
+        BaseAst *const *children = const_cast<BaseAst *const *>(key.m_children);
+        switch (key.m_atype)
+        {
+        case ATYPE_INTEGER:
+            return m_arena.make<IntegerAst>(key.m_value);
+        case ATYPE_STRING:
+            return m_arena.make<StringAst>(key.m_atom);
+        case ATYPE_IDENT:
+            return m_arena.make<IdentAst>(key.m_atom);
+        case ATYPE_SPECIAL:
+            return m_arena.make<SpecialAst>(*key.m_str);
+        case ATYPE_UNARY:
+            return m_arena.make<UnaryAst>(UnaryType(key.m_value),
+                                          key.m_count ? children[0] : NULL);
+        case ATYPE_BINARY:
+            return m_arena.make<BinaryAst>(BinaryType(key.m_value), children[0], children[1]);
+        case ATYPE_SEQ:
+            {
+                SeqAst *seq = m_arena.make<SeqAst>(SeqType(key.m_value));
+                seq->m_vec.assign(children, children + key.m_count);
+                return seq;
+            }
+        case ATYPE_EMPTY:
+        case ATYPE_LAZY:
+            break;
+        }
+        return m_arena.make<EmptyAst>();
+    }
+
+    inline void HashConsFactory::rehash()
+    {
+        std::vector<Bucket> buckets(m_buckets.size() * 2, Bucket());
+        const size_t mask = buckets.size() - 1;
+        for (size_t k = 0; k < m_buckets.size(); ++k)
+        {
+            if (m_buckets[k].m_ast == NULL)
+                continue;
+            size_t i = m_buckets[k].m_hash & mask;
+            while (buckets[i].m_ast)
+                i = (i + 1) & mask;
+            buckets[i] = m_buckets[k];
+        }
+        m_buckets.swap(buckets);
+    }
+
+    inline void HashConsFactory::clear()
+    {
+        m_buckets.assign(64, Bucket());
+        m_hashes.clear();
+        m_count = 0;
+        m_arena.clear();
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    // RuleIndex inlines
+
+    inline RuleIndex::RuleIndex(BaseAst *rules) : m_rules(rules)
+    {
+        assert(!ast_join_joinable_rules(rules));
+
+        const rules_vector *pvec = ast_get_rules_vector(rules);
+        assert(pvec);
+        for (size_t i = 0; i < pvec->size(); ++i)
+        {
+            const BinaryAst *bin = (*pvec)[i];
+            index_rule(bin, m_factory.intern(bin->m_right));
+        }
+    }
+
+    // NOTE: The first rule of an equal body is kept, as ast_add_rule()
+    //       finds it.
+    inline void RuleIndex::index_rule(const BinaryAst *bin, const BaseAst *body)
+    {
+        const atom_type atom = bin->m_left->get_ident_ast()->m_atom;
+        m_bodies.insert(std::make_pair(body, atom));
+        m_names.insert(atom);
+    }
+
+    inline void RuleIndex::add_rule(string_type& name, const BaseAst *rule_expr)
+    {
+        assert(rule_expr->get_expr());
+        const BaseAst *body = m_factory.intern(rule_expr);
+        std::unordered_map<const BaseAst *, atom_type>::const_iterator it = m_bodies.find(body);
+        if (it != m_bodies.end())
+        {
+            name = atom_table().str(it->second);
+            return;
+        }
+
+        for (;;)
+        {
+            const atom_type atom = atom_table().find(name);
+            if (atom == ATOM_NONE || m_names.count(atom) == 0)
+                break;
+            name_increment(name);
+        }
+
+        AstArena *arena = m_rules->m_arena;
+        IdentAst *ident = ast_new<IdentAst>(arena, name);
+        BaseAst *sorted = rule_expr->sorted_clone(arena);
+        SeqAst *expr = sorted->get_expr();
+        assert(expr);
+        BinaryAst *bin = ast_new<BinaryAst>(arena, BINARY_RULE, ident, expr);
+        m_rules->get_seq_ast()->push_back(bin);
+        index_rule(bin, body);
+    }
+} // namespace bnf_ast
+
+/////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef HASH_CONS_HPP_
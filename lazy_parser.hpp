@@ -0,0 +1,307 @@
+// lazy_parser.hpp --- ISO EBNF notation parser with lazy rule bodies
+// See ReadMe.txt and License.txt.
+/////////////////////////////////////////////////////////////////////////
+
+#ifndef LAZY_PARSER_HPP_
+#define LAZY_PARSER_HPP_    1   // Version 1
+
+#include "parallel_parser.hpp"  // for EBNF::RuleSplitter
+
+/////////////////////////////////////////////////////////////////////////
+
+namespace EBNF
+{
+    // NOTE: LazyRuleSource parses the bodies of the rules on demand. The
+    //       errors of the bodies go to aux() under a lock, so read aux()
+    //       after the bodies are parsed.
+    class LazyRuleSource : public LazySource
+    {
+    public:
+        // NOTE: This constructor keeps a copy of the text.
+        LazyRuleSource(const string_type& text)
+            : m_text(text), m_data(m_text.c_str()), m_size(m_text.size())
+        {
+        }
+        // NOTE: This constructor doesn't copy the buffer. The buffer must
+        //       outlive every LazyAst of the source.
+        LazyRuleSource(const char *data, size_t size)
+            : m_data(data), m_size(size)
+        {
+        }
+
+        virtual BaseAst *parse_body(const LazyAst *lazy);
+
+        const char *data() const
+        {
+            return m_data;
+        }
+        size_t size() const
+        {
+            return m_size;
+        }
+        const AuxInfo& aux() const
+        {
+            return m_aux;
+        }
+
+    protected:
+        string_type m_text;     // the copy, if any
+        const char *m_data;
+        size_t      m_size;
+        AuxInfo     m_aux;
+        std::mutex  m_mutex;
+
+    private:
+        LazyRuleSource(const LazyRuleSource&);
+        LazyRuleSource& operator=(const LazyRuleSource&);
+    };
+
+    // NOTE: LazyParser skims the buffer for the rule ends, and reads only
+    //       the name and the '=' of each rule. The body of a rule is a
+    //       LazyAst, parsed at the first access, so the errors in a body
+    //       are found then and go to source()->aux(). The rule names, the
+    //       offsets and the line numbers are as Parser makes.
+    //       parse() does not see the errors in the bodies. parse_bodies()
+    //       parses the rest of the bodies, copies their errors to the aux,
+    //       and returns false if any body fails.
+    // NOTE: The bodies are parsed from data itself, so the buffer must
+    //       outlive the AST, as the tokens of a zero-copy TokenStream do.
+    //       With copy_text(true), parse() gives the source a copy instead.
+    class LazyParser
+    {
+    public:
+        LazyParser(const char *data, size_t size, AuxInfo& aux)
+            : m_data(data), m_size(size), m_aux(aux), m_ast(NULL),
+              m_num_errors(0), m_num_warnings(0), m_copy_text(false)
+        {
+        }
+        ~LazyParser()
+        {
+            ast_delete(m_ast);
+        }
+
+        bool parse();
+        bool parse_bodies();
+
+        bool copy_text() const
+        {
+            return m_copy_text;
+        }
+        void copy_text(bool flag)
+        {
+            m_copy_text = flag;
+        }
+
+        BaseAst *ast() const
+        {
+            return m_ast;
+        }
+        BaseAst *detach()
+        {
+            BaseAst *ast = m_ast;
+            m_ast = NULL;
+            return ast;
+        }
+        const std::shared_ptr<LazyRuleSource>& source() const
+        {
+            return m_source;
+        }
+
+    protected:
+        const char                         *m_data;
+        size_t                              m_size;
+        AuxInfo&                            m_aux;
+        BaseAst                            *m_ast;
+        std::shared_ptr<LazyRuleSource>     m_source;
+        size_t                              m_num_errors;   // copied by parse_bodies()
+        size_t                              m_num_warnings;
+        bool                                m_copy_text;
+
+        BaseAst *skim_rule(const RuleChunk& chunk);
+        bool skim_rest(const RuleChunk& chunk, bool has_rules);
+
+    private:
+        LazyParser(const LazyParser&);
+        LazyParser& operator=(const LazyParser&);
+    };
+
+    /////////////////////////////////////////////////////////////////////////
+    // LazyRuleSource inlines
+
+    // NOTE: The body is parsed with its ';', as visit_syntax_rule() does.
+    inline BaseAst *LazyRuleSource::parse_body(const LazyAst *lazy)
+    {
+        ScanOrigin origin = { lazy->m_begin, lazy->m_head, lazy->m_line };
+        StringScanner scanner(m_data, lazy->m_end, origin);
+        AuxInfo aux;
+        TokenStream stream(scanner, aux);
+        stream.zero_copy(true);
+
+        BaseAst *body = NULL;
+        if (stream.scan())
+        {
+            stream.fixup();
+            Parser parser(stream, aux);
+            body = parser.visit_definitions_list();
+            if (body && stream.symbol() != SYM_TERMINATOR)
+            {
+                const Token& t = stream.token();
+                aux.add_error("expected ';' or ','", t.m_line, stream.get_column(t));
+                ast_delete(body);
+                body = NULL;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_aux.m_errors.insert(m_aux.m_errors.end(),
+                              aux.m_errors.begin(), aux.m_errors.end());
+        m_aux.m_warnings.insert(m_aux.m_warnings.end(),
+                                aux.m_warnings.begin(), aux.m_warnings.end());
+        return body;
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    // LazyParser inlines
+
+    inline bool LazyParser::parse()
+    {
+        ast_delete(m_ast);
+        m_ast = NULL;
+        m_aux.clear_errors();
+
+        // the offsets of a copy are the same as of m_data
+        if (m_copy_text)
+            m_source = std::make_shared<LazyRuleSource>(string_type(m_data, m_size));
+        else
+            m_source = std::make_shared<LazyRuleSource>(m_data, m_size);
+        m_num_errors = m_num_warnings = 0;
+        RuleSplitter splitter(m_source->data(), m_size);
+
+        SeqAst *rules = new SeqAst(SEQ_RULES);
+        RuleChunk chunk;
+        chunk.m_begin = chunk.m_head = 0;
+        chunk.m_line = 1;
+        bool ok = true;
+        for (;;)
+        {
+            chunk.m_end = splitter.cut(splitter.index());
+            if (chunk.m_end == 0)
+            {
+                chunk.m_end = m_size;
+                ok = skim_rest(chunk, rules->size() > 0);
+                break;
+            }
+
+            BaseAst *rule = skim_rule(chunk);
+            if (rule == NULL)
+            {
+                ok = false;
+                break;
+            }
+            rules->push_back(rule);
+
+            chunk.m_begin = chunk.m_end;
+            chunk.m_head = splitter.head();
+            chunk.m_line = splitter.line();
+        }
+
+        if (!ok)
+        {
+            ast_delete(rules);
+            return false;
+        }
+        rules->m_begin = rules->m_vec.front()->m_begin;
+        rules->m_end = rules->m_vec.back()->m_end;
+        m_ast = rules;
+        return true;
+    }
+
+    inline bool LazyParser::parse_bodies()
+    {
+        if (m_ast == NULL)
+            return false;
+
+        bool ok = true;
+        const rules_vector *pvec = ast_get_rules_vector(m_ast);
+        for (size_t i = 0; i < pvec->size(); ++i)
+        {
+            const LazyAst *lazy = (*pvec)[i]->m_right->get_lazy_ast();
+            if (lazy && lazy->failed())
+                ok = false;
+        }
+
+        // copy the errors not copied yet
+        const AuxInfo& aux = m_source->aux();
+        m_aux.m_errors.insert(m_aux.m_errors.end(),
+                              aux.m_errors.begin() + m_num_errors, aux.m_errors.end());
+        m_aux.m_warnings.insert(m_aux.m_warnings.end(),
+                                aux.m_warnings.begin() + m_num_warnings, aux.m_warnings.end());
+        m_num_errors = aux.m_errors.size();
+        m_num_warnings = aux.m_warnings.size();
+        return ok;
+    }
+
+    // read the name and the '=' of a rule
+    inline BaseAst *LazyParser::skim_rule(const RuleChunk& chunk)
+    {
+        const char *text = m_source->data();
+        StringScanner scanner(text, chunk.m_end, chunk);
+        TokenStream stream(scanner, m_aux);
+        stream.zero_copy(true);
+        stream.lazy(true);
+        if (!stream.scan())
+            return NULL;
+
+        if (stream.type() != TOK_IDENT)
+        {
+            const Token& t = stream.token();
+            m_aux.add_error("expected TOK_IDENT", t.m_line, stream.get_column(t));
+            return NULL;
+        }
+        const size_t first = stream.offset();
+        IdentAst *id = new IdentAst(stream.atom());
+        stream.next();
+        id->m_begin = first;
+        id->m_end = stream.prev_end();
+        if (stream.symbol() != SYM_DEFINING)
+        {
+            const Token& t = stream.token();
+            m_aux.add_error("expected '='", t.m_line, stream.get_column(t));
+            ast_delete(id);
+            return NULL;
+        }
+
+        const size_t begin = stream.offset() + 1;
+        size_t head = begin;
+        while (head > chunk.m_head && text[head - 1] != '\n')
+            --head;
+        LazyAst *body = new LazyAst(m_source, begin, chunk.m_end,
+                                    stream.token().m_line, head);
+        BinaryAst *bin = new BinaryAst(BINARY_RULE, id, body);
+        bin->m_begin = first;
+        bin->m_end = chunk.m_end;
+        return bin;
+    }
+
+    // the text after the last rule end must be trivia
+    inline bool LazyParser::skim_rest(const RuleChunk& chunk, bool has_rules)
+    {
+        StringScanner scanner(m_source->data(), chunk.m_end, chunk);
+        TokenStream stream(scanner, m_aux);
+        stream.zero_copy(true);
+        if (!stream.scan())
+            return false;
+        stream.fixup();
+        if (has_rules && stream.size() == 1)
+            return true;
+
+        // report as Parser does
+        Parser parser(stream, m_aux);
+        parser.parse();
+        return false;
+    }
+} // namespace EBNF
+
+/////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef LAZY_PARSER_HPP_
@@ -0,0 +1,239 @@
+// mapped_file.hpp --- read-only memory-mapped file
+// See ReadMe.txt and License.txt.
+/////////////////////////////////////////////////////////////////////////
+
+#ifndef MAPPED_FILE_HPP_
+#define MAPPED_FILE_HPP_    1   // Version 1
+
+#include <cstddef>      // for size_t
+#include <string>       // for std::string
+
+#ifdef _WIN32
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <windows.h>
+#else
+    #include <sys/types.h>  // for off_t
+    #include <sys/stat.h>   // for fstat
+    #include <sys/mman.h>   // for mmap, munmap, madvise
+    #include <fcntl.h>      // for open
+    #include <unistd.h>     // for close, read
+    #include <cerrno>       // for errno, EINTR
+#endif
+
+/////////////////////////////////////////////////////////////////////////
+
+namespace EBNF
+{
+    // NOTE: The mapped contents are not NUL-terminated. Give data() and
+    //       size() to the StringScanner(const char *, size_t) constructor.
+    //       A file that is not a regular file, e.g. a pipe, or that tells
+    //       no size, is read into memory instead. See is_mapped().
+    class MappedFile
+    {
+    public:
+        MappedFile() : m_data(NULL), m_size(0), m_mapped(false)
+        {
+            init_handles();
+        }
+        MappedFile(const char *filename) : m_data(NULL), m_size(0), m_mapped(false)
+        {
+            init_handles();
+            open(filename);
+        }
+        ~MappedFile()
+        {
+            close();
+        }
+
+        bool open(const char *filename);
+        void close();
+
+        bool is_open() const
+        {
+            return m_data != NULL;
+        }
+        const char *data() const
+        {
+            return m_data;
+        }
+        size_t size() const
+        {
+            return m_size;
+        }
+        bool is_mapped() const
+        {
+            return m_mapped;
+        }
+
+    protected:
+        const char *m_data;
+        size_t      m_size;
+        bool        m_mapped;
+        std::string m_read;     // the contents read, if not mapped
+#ifdef _WIN32
+        HANDLE      m_hFile;
+        HANDLE      m_hMapping;
+#endif
+
+        void init_handles()
+        {
+#ifdef _WIN32
+            m_hFile = INVALID_HANDLE_VALUE;
+            m_hMapping = NULL;
+#endif
+        }
+#ifdef _WIN32
+        bool read_all();
+#else
+        bool read_all(int fd);
+#endif
+
+    private:
+        MappedFile(const MappedFile&);
+        MappedFile& operator=(const MappedFile&);
+    };
+
+    /////////////////////////////////////////////////////////////////////////
+    // MappedFile inlines
+
+#ifdef _WIN32
+    inline bool MappedFile::open(const char *filename)
+    {
+        close();
+
+        m_hFile = ::CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (m_hFile == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER li;
+        if (::GetFileType(m_hFile) != FILE_TYPE_DISK ||
+            !::GetFileSizeEx(m_hFile, &li) || li.QuadPart == 0)
+        {
+            // a pipe or an empty file cannot be mapped
+            return read_all();
+        }
+        m_size = (size_t)li.QuadPart;
+
+        m_hMapping = ::CreateFileMappingA(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (m_hMapping == NULL)
+        {
+            close();
+            return false;
+        }
+
+        m_data = (const char *)::MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+        if (m_data == NULL)
+        {
+            close();
+            return false;
+        }
+        m_mapped = true;
+        return true;
+    }
+
+    inline bool MappedFile::read_all()
+    {
+        char buf[64 * 1024];
+        DWORD got;
+        while (::ReadFile(m_hFile, buf, sizeof(buf), &got, NULL) && got > 0)
+        {
+            m_read.append(buf, got);
+        }
+        m_data = m_read.c_str();
+        m_size = m_read.size();
+        return true;
+    }
+
+    inline void MappedFile::close()
+    {
+        if (m_mapped)
+            ::UnmapViewOfFile(m_data);
+        if (m_hMapping)
+            ::CloseHandle(m_hMapping);
+        if (m_hFile != INVALID_HANDLE_VALUE)
+            ::CloseHandle(m_hFile);
+        m_data = NULL;
+        m_size = 0;
+        m_mapped = false;
+        std::string().swap(m_read);
+        init_handles();
+    }
+#else   // ndef _WIN32
+    inline bool MappedFile::open(const char *filename)
+    {
+        close();
+
+        int fd = ::open(filename, O_RDONLY);
+        if (fd == -1)
+            return false;
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        if (!S_ISREG(st.st_mode) || st.st_size == 0)
+        {
+            // a pipe or an empty file cannot be mapped
+            bool ret = read_all(fd);
+            ::close(fd);
+            return ret;
+        }
+        m_size = (size_t)st.st_size;
+
+        void *p = ::mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+        {
+            m_size = 0;
+            return false;
+        }
+    #ifdef MADV_SEQUENTIAL
+        ::madvise(p, m_size, MADV_SEQUENTIAL);
+    #endif
+        m_data = (const char *)p;
+        m_mapped = true;
+        return true;
+    }
+
+    inline bool MappedFile::read_all(int fd)
+    {
+        char buf[64 * 1024];
+        for (;;)
+        {
+            ssize_t got = ::read(fd, buf, sizeof(buf));
+            if (got == 0)
+                break;
+            if (got < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                std::string().swap(m_read);
+                return false;
+            }
+            m_read.append(buf, (size_t)got);
+        }
+        m_data = m_read.c_str();
+        m_size = m_read.size();
+        return true;
+    }
+
+    inline void MappedFile::close()
+    {
+        if (m_mapped)
+            ::munmap((void *)m_data, m_size);
+        m_data = NULL;
+        m_size = 0;
+        m_mapped = false;
+        std::string().swap(m_read);
+    }
+#endif  // ndef _WIN32
+} // namespace EBNF
+
+/////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef MAPPED_FILE_HPP_
@@ -0,0 +1,425 @@
+// parallel_parser.hpp --- parallel ISO EBNF notation parser
+// See ReadMe.txt and License.txt.
+/////////////////////////////////////////////////////////////////////////
+
+#ifndef PARALLEL_PARSER_HPP_
+#define PARALLEL_PARSER_HPP_    1   // Version 1
+
+#include "EBNF.hpp"     // for EBNF::Parser, ...
+#include <thread>       // for std::thread
+#include <atomic>       // for std::atomic
+
+/////////////////////////////////////////////////////////////////////////
+
+namespace EBNF
+{
+    // a part of the buffer that holds whole syntax rules
+    struct RuleChunk : ScanOrigin
+    {
+        size_t  m_end;      // the offset next to the last character
+    };
+
+    // NOTE: RuleSplitter finds the ends of the rules, i.e. the ';' symbols
+    //       outside the terminal strings, the comments and the special
+    //       sequences, without making the tokens. It keeps the line number
+    //       and the line head of its position.
+    //       For the input in pieces, rebase() moves the splitter onto the
+    //       next buffer with its state kept. A partial buffer may end in
+    //       the middle of a string or a comment; a '(' or a '*' at its end
+    //       is left for the next buffer.
+    class RuleSplitter
+    {
+    public:
+        RuleSplitter(const char *data, size_t size)
+            : m_data(data), m_size(size), m_index(0), m_base(0), m_line(1),
+              m_head(0), m_rule_end(0), m_state(SS_TOP), m_quote(0),
+              m_partial(false)
+        {
+        }
+        // NOTE: This constructor splits data[origin.m_begin, size) only.
+        RuleSplitter(const char *data, size_t size, const ScanOrigin& origin)
+            : m_data(data), m_size(size), m_index(origin.m_begin), m_base(0),
+              m_line(origin.m_line), m_head(origin.m_head), m_rule_end(0),
+              m_state(SS_TOP), m_quote(0), m_partial(false)
+        {
+        }
+
+        // the buffer begins at the offset consumed of the old buffer
+        void rebase(const char *data, size_t size, size_t consumed, bool partial)
+        {
+            assert(consumed <= m_index && m_index - consumed <= size);
+            m_data = data;
+            m_size = size;
+            m_index -= consumed;
+            m_base += consumed;
+            m_rule_end = (m_rule_end > consumed ? m_rule_end - consumed : 0);
+            m_partial = partial;
+        }
+
+        // cut() returns the offset next to the first rule end after from,
+        // or zero if none.
+        size_t cut(size_t from);
+
+        // split() splits the buffer into at most count chunks of about the
+        // same size.
+        void split(std::vector<RuleChunk>& chunks, size_t count);
+
+        size_t index() const
+        {
+            return m_index;
+        }
+        // the offset of the buffer in the whole input
+        size_t base() const
+        {
+            return m_base;
+        }
+        size_t line() const
+        {
+            return m_line;
+        }
+        // NOTE: head() is an offset of the whole input, not of the buffer.
+        size_t head() const
+        {
+            return m_head;
+        }
+        // the 1-based column of index()
+        size_t column() const
+        {
+            return m_base + m_index - m_head + 1;
+        }
+        // the offset next to the last rule end found, or zero
+        size_t rule_end() const
+        {
+            return m_rule_end;
+        }
+
+    protected:
+        enum SplitterState
+        {
+            SS_TOP,
+            SS_STRING,
+            SS_COMMENT,
+            SS_SPECIAL
+        };
+
+        const char     *m_data;
+        size_t          m_size;
+        size_t          m_index;
+        size_t          m_base;     // the offset of m_data in the whole input
+        size_t          m_line;     // the line number of m_index
+        size_t          m_head;     // the offset of the line head of m_index
+        size_t          m_rule_end;
+        SplitterState   m_state;
+        char            m_quote;    // for SS_STRING
+        bool            m_partial;  // more input may follow
+    };
+
+    // NOTE: ParallelParser splits the buffer at the rule ends, then scans
+    //       and parses the chunks on the threads. Each chunk has its own
+    //       AuxInfo. The rules are merged into one SeqAst(SEQ_RULES) in
+    //       the source order. The offsets and the line numbers are of the
+    //       whole buffer. The errors of all the failed chunks are reported.
+    //       parse() clears the messages in the AuxInfo first, as
+    //       ParseContext::parse() does. Several ParallelParser's may run at
+    //       once, as they share nothing but the atom table.
+    class ParallelParser
+    {
+    public:
+        enum { CHUNKS_PER_THREAD = 4, MIN_CHUNK_SIZE = 16 * 1024 };
+
+        ParallelParser(const char *data, size_t size, AuxInfo& aux)
+            : m_data(data), m_size(size), m_aux(aux), m_ast(NULL),
+              m_scan_failed(false), m_thread_count(0), m_min_chunk_size(MIN_CHUNK_SIZE)
+        {
+        }
+        ~ParallelParser()
+        {
+            ast_delete(m_ast);
+        }
+
+        // NOTE: Zero threads means std::thread::hardware_concurrency().
+        size_t thread_count() const
+        {
+            return m_thread_count;
+        }
+        void thread_count(size_t count)
+        {
+            m_thread_count = count;
+        }
+        size_t min_chunk_size() const
+        {
+            return m_min_chunk_size;
+        }
+        void min_chunk_size(size_t size)
+        {
+            m_min_chunk_size = (size ? size : 1);
+        }
+        // the chunks of the last parse
+        const std::vector<RuleChunk>& chunks() const
+        {
+            return m_chunks;
+        }
+
+        bool parse();
+        // whether a chunk failed in scanning at the last parse
+        bool scan_failed() const
+        {
+            return m_scan_failed;
+        }
+
+        BaseAst *ast() const
+        {
+            return m_ast;
+        }
+        BaseAst *detach()
+        {
+            BaseAst *ast = m_ast;
+            m_ast = NULL;
+            return ast;
+        }
+
+    protected:
+        const char             *m_data;
+        size_t                  m_size;
+        AuxInfo&                m_aux;
+        BaseAst                *m_ast;
+        bool                    m_scan_failed;
+        size_t                  m_thread_count;
+        size_t                  m_min_chunk_size;
+        std::vector<RuleChunk>  m_chunks;
+
+        struct ChunkResult
+        {
+            AuxInfo     m_aux;
+            BaseAst    *m_ast;
+            bool        m_scanned;
+        };
+        void parse_chunk(const RuleChunk& chunk, ChunkResult& result) const;
+        static void work(const ParallelParser *self, std::atomic<size_t> *next,
+                         std::vector<ChunkResult> *results);
+
+    private:
+        ParallelParser(const ParallelParser&);
+        ParallelParser& operator=(const ParallelParser&);
+    };
+
+    /////////////////////////////////////////////////////////////////////////
+    // RuleSplitter inlines
+
+    inline size_t RuleSplitter::cut(size_t from)
+    {
+        while (m_index < m_size)
+        {
+            const char ch = m_data[m_index++];
+            if (ch == '\n')
+            {
+                ++m_line;
+                m_head = m_base + m_index;
+                continue;
+            }
+
+            switch (m_state)
+            {
+            case SS_TOP:
+                switch (ch)
+                {
+                case ';':
+                    m_rule_end = m_index;
+                    if (m_index > from)
+                        return m_index;
+                    break;
+                case '"':
+                case '\'':
+                    m_state = SS_STRING;
+                    m_quote = ch;
+                    break;
+                case '?':
+                    m_state = SS_SPECIAL;
+                    break;
+                case '(':
+                    if (m_index == m_size && m_partial)
+                    {
+                        --m_index;
+                        return 0;
+                    }
+                    if (m_index < m_size && m_data[m_index] == '*')
+                    {
+                        ++m_index;
+                        m_state = SS_COMMENT;
+                    }
+                    break;
+                }
+                break;
+            case SS_STRING:
+                if (ch == m_quote)
+                    m_state = SS_TOP;
+                break;
+            case SS_COMMENT:
+                if (ch == '*' && m_index == m_size && m_partial)
+                {
+                    --m_index;
+                    return 0;
+                }
+                if (ch == '*' && m_index < m_size && m_data[m_index] == ')')
+                {
+                    ++m_index;
+                    m_state = SS_TOP;
+                }
+                break;
+            case SS_SPECIAL:
+                if (ch == '?')
+                    m_state = SS_TOP;
+                break;
+            }
+        }
+        return 0;
+    }
+
+    // NOTE: Each chunk but the last ends at a rule end. The text after
+    //       the last rule end is joined to the last chunk.
+    inline void RuleSplitter::split(std::vector<RuleChunk>& chunks, size_t count)
+    {
+        assert(count > 0);
+        chunks.clear();
+
+        RuleChunk chunk;
+        chunk.m_begin = m_index;
+        chunk.m_head = m_head;
+        chunk.m_line = m_line;
+        const size_t step = (m_size - m_index) / count;
+        while (m_index < m_size)
+        {
+            size_t from = m_size;
+            if (chunks.size() + 1 < count)
+                from = chunk.m_begin + step;
+            chunk.m_end = cut(from);
+            if (chunk.m_end == 0)
+                break;
+            chunks.push_back(chunk);
+            chunk.m_begin = m_index;
+            chunk.m_head = m_head;
+            chunk.m_line = m_line;
+        }
+
+        chunk.m_end = m_size;
+        if (chunks.empty() || m_rule_end > chunk.m_begin)
+            chunks.push_back(chunk);
+        else
+            chunks.back().m_end = m_size;
+    }
+
+    /////////////////////////////////////////////////////////////////////////
+    // ParallelParser inlines
+
+    inline void
+    ParallelParser::parse_chunk(const RuleChunk& chunk, ChunkResult& result) const
+    {
+        result.m_ast = NULL;
+
+        StringScanner scanner(m_data, chunk.m_end, chunk);
+        TokenStream stream(scanner, result.m_aux);
+        stream.zero_copy(true);
+        result.m_scanned = stream.scan();
+        if (!result.m_scanned)
+            return;
+        stream.fixup();
+
+        Parser parser(stream, result.m_aux);
+        if (parser.parse())
+            result.m_ast = parser.detach();
+    }
+
+    inline void
+    ParallelParser::work(const ParallelParser *self, std::atomic<size_t> *next,
+                         std::vector<ChunkResult> *results)
+    {
+        for (;;)
+        {
+            const size_t i = (*next)++;
+            if (i >= results->size())
+                break;
+            self->parse_chunk(self->m_chunks[i], (*results)[i]);
+        }
+    }
+
+    inline bool ParallelParser::parse()
+    {
+        ast_delete(m_ast);
+        m_ast = NULL;
+        m_scan_failed = false;
+        m_aux.clear_errors();
+
+        size_t threads = m_thread_count;
+        if (threads == 0)
+            threads = std::thread::hardware_concurrency();
+        if (threads == 0)
+            threads = 1;
+
+        size_t count = threads * CHUNKS_PER_THREAD;
+        if (count > m_size / m_min_chunk_size + 1)
+            count = m_size / m_min_chunk_size + 1;
+        RuleSplitter splitter(m_data, m_size);
+        splitter.split(m_chunks, count);
+
+        std::vector<ChunkResult> results(m_chunks.size());
+        std::atomic<size_t> next(0);
+        if (threads > m_chunks.size())
+            threads = m_chunks.size();
+        if (threads <= 1)
+        {
+            work(this, &next, &results);
+        }
+        else
+        {
+            std::vector<std::thread> workers;
+            for (size_t i = 0; i < threads; ++i)
+            {
+                workers.push_back(std::thread(work, this, &next, &results));
+            }
+            for (size_t i = 0; i < workers.size(); ++i)
+            {
+                workers[i].join();
+            }
+        }
+
+        // merge the results in the source order
+        bool ok = true;
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const AuxInfo& aux = results[i].m_aux;
+            m_aux.m_errors.insert(m_aux.m_errors.end(),
+                                  aux.m_errors.begin(), aux.m_errors.end());
+            m_aux.m_warnings.insert(m_aux.m_warnings.end(),
+                                    aux.m_warnings.begin(), aux.m_warnings.end());
+            if (results[i].m_ast == NULL)
+                ok = false;
+            if (!results[i].m_scanned)
+                m_scan_failed = true;
+        }
+
+        SeqAst *rules = NULL;
+        if (ok)
+        {
+            rules = new SeqAst(SEQ_RULES);
+            rules->m_begin = results.front().m_ast->m_begin;
+            rules->m_end = results.back().m_ast->m_end;
+        }
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            SeqAst *seq = results[i].m_ast ? results[i].m_ast->get_seq_ast() : NULL;
+            if (rules && seq)
+            {
+                rules->insert(rules->size(), seq->m_vec.begin(), seq->m_vec.end());
+                seq->m_vec.clear();
+            }
+            ast_delete(results[i].m_ast);
+        }
+
+        m_ast = rules;
+        return ok;
+    }
+} // namespace EBNF
+
+/////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef PARALLEL_PARSER_HPP_
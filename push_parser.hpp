@@ -0,0 +1,202 @@
+// push_parser.hpp --- push-mode ISO EBNF notation parser
+// See ReadMe.txt and License.txt.
+/////////////////////////////////////////////////////////////////////////
+
+#ifndef PUSH_PARSER_HPP_
+#define PUSH_PARSER_HPP_    1   // Version 1
+
+#include "parallel_parser.hpp"  // for EBNF::RuleSplitter
+
+/////////////////////////////////////////////////////////////////////////
+
+namespace EBNF
+{
+    // NOTE: PushParser takes the input in pieces by feed(), and finish()
+    //       at the end. Only the text of the rule being received is kept,
+    //       so the memory is bounded by the largest rule. Each rule is
+    //       scanned and parsed when its ';' arrives, and handed to
+    //       on_rule(). The offsets and the line numbers are of the whole
+    //       input. After an error, feed() and finish() return false.
+    class PushParser
+    {
+    public:
+        PushParser(AuxInfo& aux)
+            : m_aux(aux), m_splitter(NULL, 0), m_rules(NULL), m_rule_count(0),
+              m_line(1), m_column(1), m_failed(false)
+        {
+        }
+        virtual ~PushParser()
+        {
+            ast_delete(m_rules);
+        }
+
+        bool feed(const char *data, size_t size);
+        bool finish();
+
+        bool failed() const
+        {
+            return m_failed;
+        }
+        // the number of the rules handed to on_rule()
+        size_t rule_count() const
+        {
+            return m_rule_count;
+        }
+        // the bytes kept for the rule being received
+        size_t buffered() const
+        {
+            return m_buffer.size();
+        }
+
+        // the rules collected by the default on_rule()
+        BaseAst *ast() const
+        {
+            return m_rules;
+        }
+        BaseAst *detach()
+        {
+            BaseAst *ast = m_rules;
+            m_rules = NULL;
+            return ast;
+        }
+
+    protected:
+        AuxInfo&        m_aux;
+        string_type     m_buffer;   // the text after the last rule end
+        RuleSplitter    m_splitter;
+        SeqAst         *m_rules;
+        size_t          m_rule_count;
+        size_t          m_line;     // the line number of m_buffer
+        size_t          m_column;   // the column of m_buffer
+        bool            m_failed;
+
+        // on_rule() takes the ownership of a BinaryAst(BINARY_RULE).
+        // The default collects the rules into ast().
+        virtual void on_rule(BaseAst *rule);
+
+        bool process(bool partial);
+        bool parse_rules(size_t begin, size_t end, bool at_end);
+
+    private:
+        PushParser(const PushParser&);
+        PushParser& operator=(const PushParser&);
+    };
+
+    /////////////////////////////////////////////////////////////////////////
+    // PushParser inlines
+
+    inline bool PushParser::feed(const char *data, size_t size)
+    {
+        if (m_failed)
+            return false;
+        m_buffer.append(data, size);
+        return process(true);
+    }
+
+    inline bool PushParser::finish()
+    {
+        if (m_failed || !process(false))
+            return false;
+
+        // the rest has no rule end
+        if (!parse_rules(0, m_buffer.size(), true))
+            m_failed = true;
+        m_buffer.clear();
+        return !m_failed;
+    }
+
+    // parse and hand out the complete rules in m_buffer
+    inline bool PushParser::process(bool partial)
+    {
+        m_splitter.rebase(m_buffer.c_str(), m_buffer.size(), 0, partial);
+
+        size_t begin = 0;
+        for (;;)
+        {
+            const size_t end = m_splitter.cut(m_splitter.index());
+            if (end == 0)
+                break;
+            if (!parse_rules(begin, end, false))
+            {
+                m_failed = true;
+                break;
+            }
+            begin = end;
+            m_line = m_splitter.line();
+            m_column = m_splitter.column();
+        }
+
+        // forget the text of the rules done
+        m_buffer.erase(0, begin);
+        m_splitter.rebase(m_buffer.c_str(), m_buffer.size(), begin, partial);
+        return !m_failed;
+    }
+
+    // NOTE: The scanner starts at a line head of its own, so the columns
+    //       on the first line are shifted back.
+    inline bool PushParser::parse_rules(size_t begin, size_t end, bool at_end)
+    {
+        const size_t base = m_splitter.base();
+        ScanOrigin origin = { begin, begin, m_line };
+        StringScanner scanner(m_buffer.c_str(), end, origin);
+        AuxInfo aux;
+        TokenStream stream(scanner, aux);
+        stream.zero_copy(true);
+
+        bool ok = stream.scan();
+        if (ok)
+        {
+            stream.fixup();
+
+            // only the trivia after the last rule
+            if (at_end && m_rule_count && stream.size() == 1)
+                return true;
+
+            Parser parser(stream, aux);
+            ok = parser.parse();
+            if (ok)
+            {
+                SeqAst *seq = parser.ast()->get_seq_ast();
+                for (size_t i = 0; i < seq->size(); ++i)
+                {
+                    ast_shift_spans(seq->m_vec[i], base);
+                    ast_set_parent(seq->m_vec[i], NULL);
+                    on_rule(seq->m_vec[i]);
+                    ++m_rule_count;
+                }
+                seq->m_vec.clear();
+            }
+        }
+
+        for (size_t i = 0; i < aux.m_errors.size(); ++i)
+        {
+            AuxItem& item = aux.m_errors[i];
+            if (item.m_line == m_line && item.m_column)
+                item.m_column += m_column - 1;
+            m_aux.m_errors.push_back(item);
+        }
+        for (size_t i = 0; i < aux.m_warnings.size(); ++i)
+        {
+            AuxItem& item = aux.m_warnings[i];
+            if (item.m_line == m_line && item.m_column)
+                item.m_column += m_column - 1;
+            m_aux.m_warnings.push_back(item);
+        }
+        return ok;
+    }
+
+    inline void PushParser::on_rule(BaseAst *rule)
+    {
+        if (m_rules == NULL)
+        {
+            m_rules = new SeqAst(SEQ_RULES);
+            m_rules->m_begin = rule->m_begin;
+        }
+        m_rules->push_back(rule);
+        m_rules->m_end = rule->m_end;
+    }
+} // namespace EBNF
+
+/////////////////////////////////////////////////////////////////////////
+
+#endif  // ndef PUSH_PARSER_HPP_